@@ -0,0 +1,45 @@
+# Locate the zstd compression library (optional).
+# This module defines
+# ZSTD_LIBRARY
+# ZSTD_FOUND, if false, do not try to link to zstd
+# ZSTD_INCLUDE_DIR, where to find zstd.h and zdict.h
+#
+# Set ZSTD_DIR to the zstd install location if it isn't found on its own.
+
+SET(ZSTD_DIR "" CACHE PATH "zstd install location, where include/lib can be found.")
+
+FIND_PATH(ZSTD_INCLUDE_DIR zstd.h
+    PATHS
+        ${ZSTD_DIR}
+        $ENV{ZSTD_DIR}
+        /usr/local/
+        /usr/
+        /sw/ # Fink
+        /opt/local/ # DarwinPorts
+        /opt/csw/ # Blastwave
+        /opt/
+    PATH_SUFFIXES
+        /include/
+)
+
+FIND_LIBRARY(ZSTD_LIBRARY
+    NAMES
+        zstd zstd_static libzstd
+    PATHS
+        ${ZSTD_DIR}
+        $ENV{ZSTD_DIR}
+        /usr/local/
+        /usr/
+        /sw/
+        /opt/local/
+        /opt/csw/
+        /opt/
+    PATH_SUFFIXES
+        lib
+        lib64
+)
+
+SET(ZSTD_FOUND "NO")
+IF(ZSTD_LIBRARY AND ZSTD_INCLUDE_DIR)
+    SET(ZSTD_FOUND "YES")
+ENDIF(ZSTD_LIBRARY AND ZSTD_INCLUDE_DIR)
@@ -0,0 +1,180 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2008-2014 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <osgDB/ReadFile>
+#include <osgEarth/Notify>
+#include <osgEarth/MapNode>
+#include <osgEarth/StringUtils>
+#include <osgEarthFeatures/FeatureSource>
+#include <osgEarthBuildings/BuildingExtension>
+#include <osgEarthBuildings/BuildingPager>
+#include <osgEarthBuildings/CompressedTileStore>
+#include <osgEarthBuildings/PackedTileStore>
+#include <iostream>
+
+#define LC "[osgearth_buildings_cache] "
+
+using namespace osgEarth;
+using namespace osgEarth::Features;
+using namespace osgEarth::Buildings;
+
+int
+usage(const char* name)
+{
+    std::cout
+        << "\nReports cached building tiles that are out of date with the catalog,"
+        << "\nstyles, resource libraries or compiler settings of an earth file.\n"
+        << "\nUsage: " << name << " file.earth [--stale] [--verbose] [--compact]\n"
+        << "\n    --stale      List the stale tiles and what changed"
+        << "\n    --verbose    List every cached tile"
+        << "\n    --compact    Compact packed tile caches (tile_cache_packed); nothing"
+        << "\n                 else may use the cache meanwhile\n"
+        << std::endl;
+
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser arguments(&argc,argv);
+
+    // help?
+    if ( arguments.read("--help") || argc < 2 )
+        return usage(argv[0]);
+
+    bool listStale = arguments.read("--stale");
+    bool verbose   = arguments.read("--verbose");
+    bool compact   = arguments.read("--compact");
+
+    osg::ref_ptr<osg::Node> node = osgDB::readNodeFiles( arguments );
+    MapNode* mapNode = MapNode::findMapNode( node.get() );
+    if ( !mapNode )
+    {
+        OE_WARN << LC << "Failed to load an earth file\n";
+        return usage(argv[0]);
+    }
+
+    unsigned numLayers = 0u;
+
+    const std::vector< osg::ref_ptr<Extension> >& extensions = mapNode->getExtensions();
+    for(unsigned e=0; e<extensions.size(); ++e)
+    {
+        BuildingExtension* ext = dynamic_cast<BuildingExtension*>( extensions[e].get() );
+        BuildingPager* pager = ext ? dynamic_cast<BuildingPager*>( ext->getPager() ) : 0L;
+        if ( !pager || !pager->getFeatureSource() || !pager->getFeatureSource()->getFeatureProfile() )
+            continue;
+
+        ++numLayers;
+
+        // Every tile the pager could create for the feature data:
+        const GeoExtent& extent = pager->getFeatureSource()->getFeatureProfile()->getExtent();
+
+        unsigned numTiles = 0u, numCached = 0u, numStale = 0u;
+        std::map<std::string, unsigned> changes;
+
+        for(unsigned lod = pager->getMinLevel(); lod <= pager->getMaxLevel(); ++lod)
+        {
+            std::vector<TileKey> keys;
+            pager->getProfile()->getIntersectingTiles( extent, lod, keys );
+
+            for(std::vector<TileKey>::const_iterator key = keys.begin(); key != keys.end(); ++key)
+            {
+                ++numTiles;
+
+                std::vector<std::string> changed;
+                if ( !pager->getStaleDependencies(*key, changed) )
+                    continue;
+
+                ++numCached;
+
+                if ( !changed.empty() )
+                {
+                    ++numStale;
+                    for(unsigned i=0; i<changed.size(); ++i)
+                        changes[changed[i]]++;
+                }
+
+                if ( verbose || (listStale && !changed.empty()) )
+                {
+                    std::cout << key->str() << ": "
+                        << (changed.empty() ? "current" : "stale (" + joinStrings(changed, ',') + ")")
+                        << std::endl;
+                }
+            }
+        }
+
+        std::cout
+            << "Layer " << (ext->getName().empty() ? "(unnamed)" : ext->getName()) << ": "
+            << numTiles << " tiles, " << numCached << " cached, " << numStale << " stale" << std::endl;
+
+        for(std::map<std::string, unsigned>::const_iterator c = changes.begin(); c != changes.end(); ++c)
+        {
+            std::cout << "    " << c->first << " changed in " << c->second << " tiles" << std::endl;
+        }
+
+        // checking the tiles read them all, which makes a decoding benchmark:
+        CompressedTileStore* compressed = dynamic_cast<CompressedTileStore*>( pager->getTileStore() );
+        if ( compressed && compressed->getStats().tilesRead > 0u )
+        {
+            CompressedTileStore::Stats stats = compressed->getStats();
+            std::cout
+                << "    " << stats.tilesRead << " compressed tiles: "
+                << (stats.bytesRead/1024u) << " KB on disk, "
+                << (stats.bytesDecoded/1024u) << " KB decompressed, "
+                << (stats.decodeMillis/(double)stats.tilesRead) << " ms per tile to decompress"
+                << std::endl;
+        }
+
+        // packed caches: how much of the packs is still in use, and compaction.
+        TileStore* store = pager->getTileStore();
+        if ( compressed )
+            store = compressed->getStore();
+
+        PackedTileStore* packed = dynamic_cast<PackedTileStore*>( store );
+        if ( packed )
+        {
+            PackedTileStore::Stats stats = packed->getStats();
+            std::cout
+                << "    " << stats.packs << " packs: " << (stats.packBytes/1024u) << " KB, "
+                << (stats.liveBytes/1024u) << " KB in use" << std::endl;
+
+            if ( compact )
+            {
+                if ( packed->compact() )
+                {
+                    stats = packed->getStats();
+                    std::cout << "    compacted to " << (stats.packBytes/1024u) << " KB" << std::endl;
+                }
+                else
+                {
+                    std::cout << "    compaction failed" << std::endl;
+                }
+            }
+        }
+    }
+
+    if ( numLayers == 0u )
+    {
+        OE_WARN << LC << "No building layers found\n";
+        return -1;
+    }
+
+    return 0;
+}
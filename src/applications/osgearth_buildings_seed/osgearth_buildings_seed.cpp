@@ -0,0 +1,406 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2008-2014 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <osg/Timer>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osgDB/ReadFile>
+#include <osgEarth/Notify>
+#include <osgEarth/MapNode>
+#include <osgEarth/Progress>
+#include <osgEarth/StringUtils>
+#include <osgEarthFeatures/FeatureSource>
+#include <osgEarthBuildings/BuildingExtension>
+#include <osgEarthBuildings/BuildingPager>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#  include <process.h>
+#else
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+#define LC "[osgearth_buildings_seed] "
+
+// Progress files, one per worker, in the progress folder.
+#define PROGRESS_PREFIX    "osgearth_buildings_seed."
+#define PROGRESS_EXTENSION "progress"
+
+// Tiles per batch; progress is recorded after each batch is in the cache.
+#define BATCH_SIZE 32u
+
+using namespace osgEarth;
+using namespace osgEarth::Features;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    struct WorkItem
+    {
+        BuildingPager* pager;
+        std::string    layer;
+        TileKey        key;
+
+        // line identifying the item in the progress files
+        std::string id() const { return layer + " " + key.str(); }
+    };
+
+    /** Reads the items recorded as done by any worker, in any earlier run. */
+    void readProgress(const std::string& folder, std::set<std::string>& done)
+    {
+        osgDB::DirectoryContents files = osgDB::getDirectoryContents( folder );
+        for(osgDB::DirectoryContents::const_iterator f = files.begin(); f != files.end(); ++f)
+        {
+            if ( !startsWith(*f, PROGRESS_PREFIX) || osgDB::getLowerCaseFileExtension(*f) != PROGRESS_EXTENSION )
+                continue;
+
+            std::ifstream in( osgDB::concatPaths(folder, *f).c_str() );
+            std::string line;
+            while( std::getline(in, line) )
+            {
+                if ( !line.empty() )
+                    done.insert( line );
+            }
+        }
+    }
+
+    /** Records a batch of seeded items as done, once they're really in the cache. */
+    void recordProgress(std::vector<const WorkItem*>& batch, std::ofstream& out)
+    {
+        std::set<BuildingPager*> pagers;
+        for(unsigned b=0; b<batch.size(); ++b)
+            pagers.insert( batch[b]->pager );
+
+        for(std::set<BuildingPager*>::const_iterator p = pagers.begin(); p != pagers.end(); ++p)
+            (*p)->flushCache();
+
+        for(unsigned b=0; b<batch.size(); ++b)
+            out << batch[b]->id() << "\n";
+        out.flush();
+
+        batch.clear();
+    }
+
+    /** Runs "numWorkers" copies of this program, each seeding its share of the tiles. */
+    int spawnWorkers(const std::vector<std::string>& args, unsigned numWorkers)
+    {
+        std::vector<std::vector<std::string> > workerArgs( numWorkers, args );
+        for(unsigned i=0; i<numWorkers; ++i)
+        {
+            workerArgs[i].push_back( "--worker" );
+            workerArgs[i].push_back( Stringify() << i );
+        }
+
+        unsigned failed = 0u;
+
+#ifdef _WIN32
+        std::vector<intptr_t> handles;
+        for(unsigned i=0; i<numWorkers; ++i)
+        {
+            std::vector<const char*> argv;
+            for(unsigned a=0; a<workerArgs[i].size(); ++a)
+                argv.push_back( workerArgs[i][a].c_str() );
+            argv.push_back( 0L );
+
+            intptr_t handle = ::_spawnvp( _P_NOWAIT, argv[0], &argv[0] );
+            if ( handle == -1 )
+                ++failed;
+            else
+                handles.push_back( handle );
+        }
+        for(unsigned i=0; i<handles.size(); ++i)
+        {
+            int status = 0;
+            if ( ::_cwait(&status, handles[i], 0) == -1 || status != 0 )
+                ++failed;
+        }
+#else
+        std::vector<pid_t> pids;
+        for(unsigned i=0; i<numWorkers; ++i)
+        {
+            std::vector<char*> argv;
+            for(unsigned a=0; a<workerArgs[i].size(); ++a)
+                argv.push_back( const_cast<char*>(workerArgs[i][a].c_str()) );
+            argv.push_back( 0L );
+
+            pid_t pid = ::fork();
+            if ( pid == 0 )
+            {
+                ::execvp( argv[0], &argv[0] );
+                ::_exit( 127 );
+            }
+            else if ( pid < 0 )
+                ++failed;
+            else
+                pids.push_back( pid );
+        }
+        for(unsigned i=0; i<pids.size(); ++i)
+        {
+            int status = 0;
+            if ( ::waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+                ++failed;
+        }
+#endif
+
+        if ( failed > 0u )
+        {
+            OE_WARN << LC << failed << " of " << numWorkers << " workers failed; run again to resume\n";
+            return -1;
+        }
+        return 0;
+    }
+}
+
+int
+usage(const char* name)
+{
+    std::cout
+        << "\nBuilds the building tiles of an earth file into its cache, without"
+        << "\na viewer. Interrupted runs resume where they left off.\n"
+        << "\nUsage: " << name << " file.earth [options]\n"
+        << "\n    --extent xmin ymin xmax ymax   Area to seed, in degrees (default: all features)"
+        << "\n    --min-level n                  First LOD to seed (default: the layer's)"
+        << "\n    --max-level n                  Last LOD to seed (default: the layer's)"
+        << "\n    --layer name                   Only seed this building layer"
+        << "\n    --workers n                    Split the tiles across n processes (default 1)"
+        << "\n    --progress folder              Where to record progress (default: current folder)"
+        << "\n    --restart                      Forget earlier progress\n"
+        << std::endl;
+
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    // keep the original command line for the workers.
+    std::vector<std::string> args( argv, argv+argc );
+
+    osg::ArgumentParser arguments(&argc,argv);
+
+    // help?
+    if ( arguments.read("--help") || argc < 2 )
+        return usage(argv[0]);
+
+    double xmin, ymin, xmax, ymax;
+    bool hasExtent = arguments.read("--extent", xmin, ymin, xmax, ymax);
+
+    int minLevel = -1, maxLevel = -1;
+    arguments.read("--min-level", minLevel);
+    arguments.read("--max-level", maxLevel);
+
+    std::string layerName;
+    arguments.read("--layer", layerName);
+
+    unsigned numWorkers = 1u;
+    arguments.read("--workers", numWorkers);
+    numWorkers = osg::maximum(numWorkers, 1u);
+
+    int worker = -1;
+    arguments.read("--worker", worker);
+
+    std::string progressFolder = ".";
+    arguments.read("--progress", progressFolder);
+
+    bool restart = arguments.read("--restart");
+
+    if ( restart && worker < 0 )
+    {
+        osgDB::DirectoryContents files = osgDB::getDirectoryContents( progressFolder );
+        for(osgDB::DirectoryContents::const_iterator f = files.begin(); f != files.end(); ++f)
+        {
+            if ( startsWith(*f, PROGRESS_PREFIX) && osgDB::getLowerCaseFileExtension(*f) == PROGRESS_EXTENSION )
+                ::remove( osgDB::concatPaths(progressFolder, *f).c_str() );
+        }
+    }
+
+    // With several workers, this process only starts them and sums up.
+    if ( numWorkers > 1u && worker < 0 )
+    {
+        std::set<std::string> doneBefore, doneAfter;
+        readProgress( progressFolder, doneBefore );
+
+        // "--restart" was handled here; the workers must not see it.
+        std::vector<std::string> workerArgs;
+        for(unsigned a=0; a<args.size(); ++a)
+        {
+            if ( args[a] != "--restart" )
+                workerArgs.push_back( args[a] );
+        }
+
+        osg::Timer_t start = osg::Timer::instance()->tick();
+        int result = spawnWorkers( workerArgs, numWorkers );
+        double seconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+
+        readProgress( progressFolder, doneAfter );
+        unsigned seeded = doneAfter.size() - doneBefore.size();
+
+        std::cout
+            << "\n" << numWorkers << " workers seeded " << seeded << " tiles in " << seconds << " s ("
+            << (seconds > 0.0 ? (double)seeded / seconds : 0.0) << " tiles/s)" << std::endl;
+
+        return result;
+    }
+
+    if ( worker < 0 )
+        worker = 0;
+
+    osg::ref_ptr<osg::Node> node = osgDB::readNodeFiles( arguments );
+    MapNode* mapNode = MapNode::findMapNode( node.get() );
+    if ( !mapNode )
+    {
+        OE_WARN << LC << "Failed to load an earth file\n";
+        return usage(argv[0]);
+    }
+
+    // Every tile of every building layer, always in the same order, so that
+    // each worker can tell its share by position.
+    std::vector<WorkItem> items;
+
+    const std::vector< osg::ref_ptr<Extension> >& extensions = mapNode->getExtensions();
+    for(unsigned e=0; e<extensions.size(); ++e)
+    {
+        BuildingExtension* ext = dynamic_cast<BuildingExtension*>( extensions[e].get() );
+        BuildingPager* pager = ext ? dynamic_cast<BuildingPager*>( ext->getPager() ) : 0L;
+        if ( !pager || !pager->getFeatureSource() || !pager->getFeatureSource()->getFeatureProfile() )
+            continue;
+
+        std::string name = ext->getName().empty() ? std::string(Stringify() << "layer" << e) : ext->getName();
+        if ( !layerName.empty() && name != layerName )
+            continue;
+
+        GeoExtent extent = pager->getFeatureSource()->getFeatureProfile()->getExtent();
+        if ( hasExtent )
+        {
+            extent = GeoExtent(SpatialReference::get("wgs84"), xmin, ymin, xmax, ymax).transform(
+                pager->getProfile()->getSRS() );
+        }
+
+        unsigned first = minLevel >= 0 ? osg::maximum((unsigned)minLevel, pager->getMinLevel()) : pager->getMinLevel();
+        unsigned last  = maxLevel >= 0 ? osg::minimum((unsigned)maxLevel, pager->getMaxLevel()) : pager->getMaxLevel();
+
+        for(unsigned lod = first; lod <= last; ++lod)
+        {
+            std::vector<TileKey> keys;
+            pager->getProfile()->getIntersectingTiles( extent, lod, keys );
+
+            for(std::vector<TileKey>::const_iterator key = keys.begin(); key != keys.end(); ++key)
+            {
+                WorkItem item;
+                item.pager = pager;
+                item.layer = name;
+                item.key = *key;
+                items.push_back( item );
+            }
+        }
+    }
+
+    if ( items.empty() )
+    {
+        OE_WARN << LC << "No building tiles to seed\n";
+        return -1;
+    }
+
+    // this worker's share: a contiguous range of the items.
+    size_t begin = items.size() * (size_t)worker / numWorkers;
+    size_t end   = items.size() * (size_t)(worker+1) / numWorkers;
+
+    std::set<std::string> done;
+    readProgress( progressFolder, done );
+
+    osgDB::makeDirectory( progressFolder );
+    std::string progressFile = osgDB::concatPaths(
+        progressFolder, Stringify() << PROGRESS_PREFIX << worker << "." << PROGRESS_EXTENSION );
+    std::ofstream progressOut( progressFile.c_str(), std::ios::app );
+    if ( !progressOut.is_open() )
+    {
+        OE_WARN << LC << "Failed to open " << progressFile << "\n";
+        return -1;
+    }
+
+    unsigned numSkipped = 0u, numTiles = 0u, numEmpty = 0u, numFailed = 0u;
+    std::vector<const WorkItem*> batch;
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    for(size_t i = begin; i < end; ++i)
+    {
+        const WorkItem& item = items[i];
+        if ( done.find(item.id()) != done.end() )
+        {
+            ++numSkipped;
+            continue;
+        }
+
+        // the same pipeline the pager runs when the tile comes into view,
+        // including writing it to the cache.
+        osg::ref_ptr<ProgressCallback> progress = new ProgressCallback();
+        osg::ref_ptr<osg::Node> tile = item.pager->createNode( item.key, progress.get() );
+        if ( tile.valid() )
+        {
+            ++numTiles;
+        }
+        else if ( progress->isCanceled() || !progress->message().empty() )
+        {
+            // not done; a resumed run tries it again.
+            OE_WARN << LC << "Failed to seed " << item.id() << ": " << progress->message() << "\n";
+            ++numFailed;
+            continue;
+        }
+        else
+        {
+            ++numEmpty;
+        }
+
+        batch.push_back( &item );
+
+        if ( batch.size() >= BATCH_SIZE )
+        {
+            recordProgress( batch, progressOut );
+
+            double seconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+            unsigned processed = numTiles + numEmpty + numFailed;
+            std::cout
+                << "Worker " << worker << ": " << (numSkipped + processed) << "/" << (end - begin) << " ("
+                << (seconds > 0.0 ? (double)processed / seconds : 0.0) << " tiles/s)" << std::endl;
+        }
+    }
+
+    recordProgress( batch, progressOut );
+
+    double seconds = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+    unsigned processed = numTiles + numEmpty + numFailed;
+
+    std::cout
+        << "\nWorker " << worker << " of " << numWorkers << ": " << (end - begin) << " tiles\n"
+        << "    " << numSkipped << " already seeded\n"
+        << "    " << numTiles << " built or loaded, " << numEmpty << " empty, " << numFailed << " failed\n"
+        << "    " << seconds << " s, " << (seconds > 0.0 ? (double)processed / seconds : 0.0) << " tiles/s"
+        << std::endl;
+
+    // failed tiles make the run incomplete, so the parent reports it.
+    return numFailed > 0u ? -1 : 0;
+}
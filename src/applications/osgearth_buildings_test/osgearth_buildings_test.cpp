@@ -0,0 +1,657 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2008-2014 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <osg/Math>
+#include <osgEarthBuildings/CacheWriter>
+#include <osgEarthBuildings/FootprintAnalysis>
+#include <osgEarthBuildings/PolygonOffset>
+#include <osgEarthBuildings/TextureStore>
+#include <osgEarthBuildings/TileFormat>
+#include <osgEarthBuildings/TileMemoryCache>
+#include <OpenThreads/Block>
+#include <OpenThreads/ScopedLock>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#define LC "[osgearth_buildings_test] "
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    unsigned s_numFailures = 0u;
+
+    // Reports a failed check with its location.
+    void check(bool condition, const char* what, const char* file, int line)
+    {
+        if ( !condition )
+        {
+            std::cout << "    FAILED: " << what << " (" << file << ":" << line << ")" << std::endl;
+            ++s_numFailures;
+        }
+    }
+
+    #define CHECK(X) check((X), #X, __FILE__, __LINE__)
+
+    // Polygon through "n" XY points.
+    Polygon* makePolygon(const double xy[][2], unsigned n)
+    {
+        Polygon* polygon = new Polygon();
+        for(unsigned i=0; i<n; ++i)
+            polygon->push_back( osg::Vec3d(xy[i][0], xy[i][1], 0.0) );
+        return polygon;
+    }
+
+    bool isNear(const osg::Vec3d& p, double x, double y, double epsilon =1e-6)
+    {
+        return fabs(p.x()-x) <= epsilon && fabs(p.y()-y) <= epsilon;
+    }
+
+    // Whether "p" is within "epsilon" of any of the first "n" points of "ring".
+    bool isNearAny(const osg::Vec3d& p, const Ring* ring, unsigned n, double epsilon)
+    {
+        for(unsigned i=0; i<n && i<ring->size(); ++i)
+            if ( isNear(p, (*ring)[i].x(), (*ring)[i].y(), epsilon) )
+                return true;
+        return false;
+    }
+
+    //........................................................................
+
+    void testPolygonOffset()
+    {
+        const double square[4][2] = { {0,0}, {10,0}, {10,10}, {0,10} };
+        const double squareCW[4][2] = { {0,0}, {0,10}, {10,10}, {10,0} };
+        std::vector<osg::Vec3d> out;
+
+        // inset: each corner moves along its mitre, in the same order.
+        osg::ref_ptr<Polygon> ccw = makePolygon(square, 4);
+        CHECK( PolygonOffset::offset(ccw.get(), 1.0, out) );
+        CHECK( out.size() == 4u );
+        if ( out.size() == 4u )
+        {
+            CHECK( isNear(out[0], 1, 1) );
+            CHECK( isNear(out[1], 9, 1) );
+            CHECK( isNear(out[2], 9, 9) );
+            CHECK( isNear(out[3], 1, 9) );
+        }
+
+        // the interior is found from the winding, so a CW ring insets too.
+        osg::ref_ptr<Polygon> cw = makePolygon(squareCW, 4);
+        CHECK( PolygonOffset::offset(cw.get(), 1.0, out) );
+        CHECK( out.size() == 4u && isNear(out[0], 1, 1) && isNear(out[1], 1, 9) );
+
+        // a negative distance grows the ring.
+        CHECK( PolygonOffset::offset(ccw.get(), -1.0, out) );
+        CHECK( out.size() == 4u && isNear(out[0], -1, -1) && isNear(out[2], 11, 11) );
+
+        // a closing point is ignored.
+        osg::ref_ptr<Polygon> closed = makePolygon(square, 4);
+        closed->push_back( closed->front() );
+        CHECK( PolygonOffset::offset(closed.get(), 1.0, out) );
+        CHECK( out.size() == 4u );
+
+        // collapsed and inverted rings fail.
+        CHECK( !PolygonOffset::offset(ccw.get(), 5.0, out) );
+        CHECK( !PolygonOffset::offset(ccw.get(), 6.0, out) );
+
+        // so does a corner that's too sharp for the mitre limit.
+        const double spike[3][2] = { {0,0}, {10,0}, {0,0.5} };
+        osg::ref_ptr<Polygon> sharp = makePolygon(spike, 3);
+        CHECK( !PolygonOffset::offset(sharp.get(), 0.1, out) );
+
+        // degenerate input:
+        const double line[3][2] = { {0,0}, {5,0}, {10,0} };
+        osg::ref_ptr<Polygon> flat = makePolygon(line, 3);
+        CHECK( !PolygonOffset::offset(flat.get(), 1.0, out) );
+        osg::ref_ptr<Polygon> two = makePolygon(square, 2);
+        CHECK( !PolygonOffset::offset(two.get(), 1.0, out) );
+        CHECK( !PolygonOffset::offset((const Ring*)0L, 1.0, out) );
+
+        // the polygon version copies the result, and doesn't do holes.
+        osg::ref_ptr<Polygon> result = PolygonOffset::offset(ccw.get(), 1.0);
+        CHECK( result.valid() && result->size() == 4u );
+        osg::ref_ptr<Polygon> holed = makePolygon(square, 4);
+        holed->getHoles().push_back( new Ring() );
+        result = PolygonOffset::offset(holed.get(), 1.0);
+        CHECK( !result.valid() );
+
+        // self-intersection:
+        std::vector<osg::Vec3d> points;
+        for(unsigned i=0; i<4; ++i)
+            points.push_back( osg::Vec3d(square[i][0], square[i][1], 0.0) );
+        CHECK( !PolygonOffset::isSelfIntersecting(points) );
+        std::swap( points[1], points[2] );
+        CHECK( PolygonOffset::isSelfIntersecting(points) );
+    }
+
+    //........................................................................
+
+    void testFootprintAnalysis()
+    {
+        // a 20x10 rectangle, rotated by 30 degrees:
+        const double a = osg::DegreesToRadians(30.0), c = cos(a), s = sin(a);
+        const double corners[4][2] = { {0,0}, {20,0}, {20,10}, {0,10} };
+        double rotated[4][2];
+        for(unsigned i=0; i<4; ++i)
+        {
+            rotated[i][0] = c*corners[i][0] - s*corners[i][1];
+            rotated[i][1] = s*corners[i][0] + c*corners[i][1];
+        }
+
+        osg::ref_ptr<Polygon> rectangle = makePolygon(rotated, 4);
+        osg::ref_ptr<FootprintAnalysis> analysis = new FootprintAnalysis(rectangle.get());
+        CHECK( analysis->isRectangle() );
+
+        // the rotated bounds align with the long edge:
+        const osg::BoundingBox& rb = analysis->getRotatedBounds();
+        double width = rb.xMax()-rb.xMin(), height = rb.yMax()-rb.yMin();
+        CHECK( fabs(osg::maximum(width, height) - 20.0) < 1e-3 );
+        CHECK( fabs(osg::minimum(width, height) - 10.0) < 1e-3 );
+
+        // so the box is the rectangle itself.
+        const Polygon* box = analysis->getBox();
+        CHECK( box && box->size() == 4u );
+        for(unsigned i=0; box && i<box->size(); ++i)
+            CHECK( isNearAny((*box)[i], rectangle.get(), 4, 1e-3) );
+
+        // a rectangle insets directly, and the result is reused.
+        bool direct = false;
+        const Polygon* inset = analysis->getOffset(1.0f, &direct);
+        CHECK( inset && direct && inset->size() == 4u );
+        CHECK( analysis->getOffset(1.0f) == inset );
+
+        // a closing point doesn't count as a corner.
+        osg::ref_ptr<Polygon> closed = makePolygon(rotated, 4);
+        closed->push_back( closed->front() );
+        analysis = new FootprintAnalysis(closed.get());
+        CHECK( analysis->isRectangle() );
+
+        // a slightly skewed footprint still counts.
+        const double skewed[4][2] = { {0,0}, {20,0}, {20,10.05}, {0,10} };
+        osg::ref_ptr<Polygon> nearRectangle = makePolygon(skewed, 4);
+        analysis = new FootprintAnalysis(nearRectangle.get());
+        CHECK( analysis->isRectangle() );
+
+        // not rectangles:
+        const double trapezoid[4][2] = { {0,0}, {20,0}, {15,10}, {5,10} };
+        osg::ref_ptr<Polygon> trap = makePolygon(trapezoid, 4);
+        analysis = new FootprintAnalysis(trap.get());
+        CHECK( !analysis->isRectangle() );
+
+        const double ell[6][2] = { {0,0}, {20,0}, {20,5}, {5,5}, {5,10}, {0,10} };
+        osg::ref_ptr<Polygon> lshape = makePolygon(ell, 6);
+        analysis = new FootprintAnalysis(lshape.get());
+        CHECK( !analysis->isRectangle() );
+
+        osg::ref_ptr<Polygon> holed = makePolygon(rotated, 4);
+        holed->getHoles().push_back( new Ring() );
+        analysis = new FootprintAnalysis(holed.get());
+        CHECK( !analysis->isRectangle() );
+    }
+
+    //........................................................................
+
+    // Geometry with two textured triangles, in the form the compilers make.
+    osg::Geometry* makeQuad()
+    {
+        osg::Geometry* geom = new osg::Geometry();
+        osg::Vec3Array* verts = new osg::Vec3Array();
+        osg::Vec3Array* normals = new osg::Vec3Array();
+        osg::Vec4Array* colors = new osg::Vec4Array();
+        osg::Vec3Array* texCoords = new osg::Vec3Array();
+        for(unsigned i=0; i<4; ++i)
+        {
+            verts->push_back( osg::Vec3(i, 2*i, 3*i) );
+            normals->push_back( osg::Vec3(0, 0, 1) );
+            colors->push_back( osg::Vec4(1, 1, 1, 0.5f) );
+            texCoords->push_back( osg::Vec3(i&1, i>>1, 7) );
+        }
+        geom->setVertexArray( verts );
+        geom->setNormalArray( normals, osg::Array::BIND_PER_VERTEX );
+        geom->setColorArray( colors, osg::Array::BIND_PER_VERTEX );
+        geom->setTexCoordArray( 0, texCoords, osg::Array::BIND_PER_VERTEX );
+
+        osg::DrawElementsUShort* de = new osg::DrawElementsUShort(GL_TRIANGLES);
+        const unsigned short indices[6] = { 0, 1, 2, 2, 3, 0 };
+        de->insert( de->end(), indices, indices+6 );
+        geom->addPrimitiveSet( de );
+        return geom;
+    }
+
+    bool decodes(const std::string& data)
+    {
+        TileFormat::Tile tile;
+        return TileFormat::decode(data.data(), data.size(), tile);
+    }
+
+    void setWord(std::string& data, size_t offset, unsigned value)
+    {
+        if ( offset + sizeof(value) <= data.size() )
+            ::memcpy( &data[offset], &value, sizeof(value) );
+    }
+
+    void testTileFormat()
+    {
+        osg::ref_ptr<osg::Geometry> quad = makeQuad();
+        std::vector<osg::Matrix> matrices;
+        matrices.push_back( osg::Matrix::translate(1, 2, 3) );
+        matrices.push_back( osg::Matrix::scale(2, 2, 2) );
+
+        TileFormat::Writer writer( osg::Matrixd::translate(1e6, 2e6, 3e6) );
+        writer.setMetadata( "metadata" );
+        CHECK( writer.addGeometry("roof", "skin.png", quad.get()) );
+        writer.addInstances( "tree.osgb", matrices );
+        std::string data = writer.finish();
+
+        // round trip:
+        TileFormat::Tile tile;
+        CHECK( TileFormat::decode(data.data(), data.size(), tile) );
+        CHECK( tile.localToWorld == osg::Matrixd::translate(1e6, 2e6, 3e6) );
+        CHECK( tile.metadata == "metadata" );
+        CHECK( tile.geometries.size() == 1u && tile.instances.size() == 1u );
+        if ( tile.geometries.size() == 1u && tile.instances.size() == 1u )
+        {
+            const TileFormat::Geometry& g = tile.geometries[0];
+            CHECK( g.tag == "roof" && g.stateKey == "skin.png" );
+            CHECK( g.numVerts == 4u && g.indexSize == 2u && g.numIndices == 6u && g.texCoords != 0L );
+            CHECK( ::memcmp(g.verts, quad->getVertexArray()->getDataPointer(), 4*3*sizeof(float)) == 0 );
+            CHECK( ::memcmp(g.indices, quad->getPrimitiveSet(0)->getDataPointer(), 6*sizeof(unsigned short)) == 0 );
+
+            osg::ref_ptr<osg::Geometry> copy = TileFormat::createGeometry(g);
+            const osg::Vec3Array* verts = dynamic_cast<const osg::Vec3Array*>(copy->getVertexArray());
+            const osg::Vec3Array* texCoords = dynamic_cast<const osg::Vec3Array*>(copy->getTexCoordArray(0));
+            CHECK( verts && verts->size() == 4u && (*verts)[3] == osg::Vec3(3, 6, 9) );
+            CHECK( texCoords && texCoords->size() == 4u && (*texCoords)[3] == osg::Vec3(1, 1, 7) );
+            CHECK( copy->getNumPrimitiveSets() == 1u && copy->getPrimitiveSet(0)->getNumIndices() == 6u );
+
+            const TileFormat::Instances& inst = tile.instances[0];
+            CHECK( inst.modelName == "tree.osgb" && inst.count == 2u );
+            CHECK( inst.count == 2u && inst.matrices[12] == 1.0f && inst.matrices[16] == 2.0f );
+        }
+
+        if ( tile.geometries.size() != 1u )
+            return;
+
+        std::string metadata;
+        CHECK( TileFormat::readMetadata(data.data(), data.size(), metadata) && metadata == "metadata" );
+
+        // replacing state keys changes nothing else:
+        std::map<std::string, std::string> stateKeys;
+        std::string replaced;
+        CHECK( TileFormat::replaceStateKeys(data.data(), data.size(), stateKeys, replaced) && replaced == data );
+        stateKeys["skin.png"] = "#0123456789abcdef";
+        CHECK( TileFormat::replaceStateKeys(data.data(), data.size(), stateKeys, replaced) );
+        TileFormat::Tile replacedTile;
+        CHECK( TileFormat::decode(replaced.data(), replaced.size(), replacedTile) );
+        CHECK( replacedTile.geometries.size() == 1u && replacedTile.geometries[0].stateKey == "#0123456789abcdef" );
+        CHECK( replacedTile.instances.size() == 1u && replacedTile.metadata == "metadata" );
+
+        // unrepresentable geometry:
+        osg::ref_ptr<osg::Geometry> bad = makeQuad();
+        static_cast<osg::DrawElementsUShort*>(bad->getPrimitiveSet(0))->pop_back();
+        CHECK( !writer.addGeometry("roof", "skin.png", bad.get()) );
+        bad = makeQuad();
+        bad->setPrimitiveSet( 0, new osg::DrawArrays(GL_TRIANGLES, 0, 3) );
+        CHECK( !writer.addGeometry("roof", "skin.png", bad.get()) );
+        bad = makeQuad();
+        bad->setNormalArray( 0L );
+        CHECK( !writer.addGeometry("roof", "skin.png", bad.get()) );
+
+        // every truncation fails.
+        unsigned numTruncationsDecoded = 0u;
+        for(size_t size=0; size<data.size(); ++size)
+        {
+            std::vector<char> truncated( data.begin(), data.begin()+size );
+            TileFormat::Tile t;
+            if ( TileFormat::decode(truncated.empty() ? 0L : &truncated[0], size, t) )
+                ++numTruncationsDecoded;
+        }
+        CHECK( numTruncationsDecoded == 0u );
+        CHECK( !TileFormat::readMetadata(data.data(), 100u, metadata) );
+
+        // in a tile with empty strings, numGeometries is at offset 12, and
+        // the first geometry's numVerts and numIndices at 164 and 176.
+        TileFormat::Geometry record = tile.geometries[0];
+        record.tag.clear();
+        record.stateKey.clear();
+        record.texCoords = 0L;
+        TileFormat::Writer plain( osg::Matrixd::identity() );
+        plain.addGeometry( record );
+        const std::string valid = plain.finish();
+        CHECK( decodes(valid) );
+
+        std::string corrupt = valid;
+        setWord( corrupt, 4, TileFormat::VERSION+1u );
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        corrupt[0] = 'X';
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        setWord( corrupt, 12, 0xFFFFFFFFu );
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        setWord( corrupt, 164, 0xFFFFFFFFu );
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        setWord( corrupt, 164, 0x40000000u );
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        setWord( corrupt, 176, 0xFFFFFFFFu );
+        CHECK( !decodes(corrupt) );
+        corrupt = valid;
+        setWord( corrupt, 176, 5u );
+        CHECK( !decodes(corrupt) );
+
+        // an index past the last vertex fails.
+        const unsigned short outOfRange[6] = { 0, 1, 2, 2, 3, 4 };
+        record.indices = outOfRange;
+        TileFormat::Writer overrun( osg::Matrixd::identity() );
+        overrun.addGeometry( record );
+        CHECK( !decodes(overrun.finish()) );
+
+        // any word set to all ones either fails or still decodes to
+        // something consistent; run under a memory checker to catch overruns.
+        for(size_t offset=0; offset+4<=data.size(); offset+=4)
+        {
+            corrupt = data;
+            setWord( corrupt, offset, 0xFFFFFFFFu );
+            std::vector<char> buffer( corrupt.begin(), corrupt.end() );
+            TileFormat::Tile t;
+            if ( TileFormat::decode(&buffer[0], buffer.size(), t) )
+            {
+                for(unsigned i=0; i<t.geometries.size(); ++i)
+                {
+                    osg::ref_ptr<osg::Geometry> g = TileFormat::createGeometry(t.geometries[i]);
+                    CHECK( g.valid() );
+                }
+            }
+        }
+    }
+
+    //........................................................................
+
+    /**
+     * In-memory tile store whose writes can be held up, so a test can look
+     * at a CacheWriter while it's writing a tile.
+     */
+    class TestTileStore : public TileStore
+    {
+    public:
+        TestTileStore() : _numWrites(0u) { }
+
+        TileBlob* read(const std::string& key)
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            std::map<std::string, std::string>::const_iterator i = _tiles.find(key);
+            return i != _tiles.end() ? new BufferTileBlob(i->second, 0) : 0L;
+        }
+
+        bool write(const std::string& key, const char* data, size_t size)
+        {
+            {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+                _tiles[key].assign(data, size);
+                ++_numWrites;
+            }
+            _writing.release();
+            _gate.block();
+            return true;
+        }
+
+        std::string getTile(const std::string& key)
+        {
+            osg::ref_ptr<TileBlob> blob = read(key);
+            return blob.valid() ? std::string(blob->data(), blob->size()) : std::string();
+        }
+
+        unsigned getNumWrites() const
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            return _numWrites;
+        }
+
+        OpenThreads::Block _writing; // released once a write starts
+        OpenThreads::Block _gate;    // holds up writes until released
+
+    protected:
+        virtual ~TestTileStore() { }
+
+        std::map<std::string, std::string> _tiles;
+        unsigned                           _numWrites;
+        mutable OpenThreads::Mutex         _mutex;
+    };
+
+    void testCacheWriter()
+    {
+        osg::ref_ptr<TestTileStore> store = new TestTileStore();
+        osg::ref_ptr<CacheWriter> writer = new CacheWriter(10u);
+        std::string data;
+
+        // hold up the writer in the first tile, which stays readable:
+        writer->writeCompact( store.get(), "a", "1" );
+        store->_writing.block();
+        CHECK( writer->getPendingCompact("a", data) && data == "1" );
+
+        // tiles queued behind it coalesce.
+        writer->writeCompact( store.get(), "b", "2" );
+        writer->writeCompact( store.get(), "b", "3" );
+        CHECK( writer->getNumCoalesced() == 1u );
+        CHECK( writer->getQueueSize() == 1u );
+        CHECK( writer->getPendingCompact("b", data) && data == "3" );
+        CHECK( !writer->getPendingCompact("c", data) );
+
+        // flush writes each key once, with its last copy.
+        store->_gate.release();
+        writer->flush();
+        CHECK( writer->getQueueSize() == 0u );
+        CHECK( !writer->getPendingCompact("a", data) && !writer->getPendingCompact("b", data) );
+        CHECK( store->getNumWrites() == 2u );
+        CHECK( store->getTile("a") == "1" && store->getTile("b") == "3" );
+
+        // the destructor writes what's left.
+        writer->writeCompact( store.get(), "c", "4" );
+        writer = 0L;
+        CHECK( store->getTile("c") == "4" );
+    }
+
+    // State key of the first geometry of an encoded tile.
+    std::string getStateKey(const std::string& data)
+    {
+        TileFormat::Tile tile;
+        if ( !TileFormat::decode(data.data(), data.size(), tile) || tile.geometries.empty() )
+            return std::string();
+        return tile.geometries[0].stateKey;
+    }
+
+    void testTextureStore()
+    {
+        const std::string textureFile = "osgearth_buildings_test_texture.png";
+        {
+            std::ofstream out( textureFile.c_str(), std::ios::binary );
+            out << "not really a PNG";
+        }
+
+        osg::ref_ptr<osg::Geometry> quad = makeQuad();
+        TileFormat::Writer tileWriter( osg::Matrixd::identity() );
+        tileWriter.addGeometry( "wall", textureFile, quad.get() );
+        const std::string tile = tileWriter.finish();
+
+        std::set<std::string> imageURIs;
+        imageURIs.insert( textureFile );
+
+        osg::ref_ptr<TestTileStore> store = new TestTileStore();
+        osg::ref_ptr<TextureStore> textures = new TextureStore(store.get());
+        osg::ref_ptr<CacheWriter> writer = new CacheWriter(10u);
+
+        // the writer stores the texture first; meanwhile the tile reads back as queued.
+        writer->writeCompact( store.get(), "tile", tile, textures.get(), imageURIs );
+        store->_writing.block();
+        std::string data;
+        CHECK( writer->getPendingCompact("tile", data) && data == tile );
+
+        store->_gate.release();
+        writer->flush();
+
+        // the written tile refers to the texture by content.
+        std::string stateKey = getStateKey( store->getTile("tile") );
+        std::string uri;
+        CHECK( TextureStore::isContentKey(stateKey) );
+        CHECK( textures->getURI(stateKey, uri) && uri == textureFile );
+
+        // the same texture is stored once, and counted per tile.
+        writer->writeCompact( store.get(), "tile2", tile, textures.get(), imageURIs );
+        writer->flush();
+        CHECK( getStateKey(store->getTile("tile2")) == stateKey );
+        TextureStore::Stats stats = textures->getStats();
+        CHECK( stats.textures == 1u && stats.references == 2u );
+
+        // a texture that can't be read leaves its URI in the tile.
+        ::remove( textureFile.c_str() );
+        std::set<std::string> missing;
+        missing.insert( "osgearth_buildings_test_missing.png" );
+        TileFormat::Writer missingWriter( osg::Matrixd::identity() );
+        missingWriter.addGeometry( "wall", *missing.begin(), quad.get() );
+        writer->writeCompact( store.get(), "tile3", missingWriter.finish(), textures.get(), missing );
+        writer->flush();
+        CHECK( getStateKey(store->getTile("tile3")) == *missing.begin() );
+        CHECK( textures->getStats().references == 2u );
+    }
+
+    //........................................................................
+
+    void testTileMemoryCache()
+    {
+        osg::ref_ptr<TileMemoryCache> cache = new TileMemoryCache(10u, false);
+        std::string data;
+
+        cache->insert( "a", "1234" );
+        cache->insert( "b", "5678" );
+        CHECK( cache->get("a", data) && data == "1234" );
+
+        // "b" is now the least recently used, so it makes room for "c".
+        cache->insert( "c", "abcd" );
+        CHECK( !cache->get("b", data) );
+        CHECK( cache->get("a", data) && data == "1234" );
+        CHECK( cache->get("c", data) && data == "abcd" );
+
+        TileMemoryCache::Stats stats = cache->getStats();
+        CHECK( stats.hits == 3u && stats.misses == 1u );
+        CHECK( stats.evictions == 1u && stats.entries == 2u && stats.bytes == 8u );
+
+        // replacing a tile frees its old bytes.
+        cache->insert( "a", "xy" );
+        CHECK( cache->get("a", data) && data == "xy" );
+        stats = cache->getStats();
+        CHECK( stats.entries == 2u && stats.bytes == 6u && stats.evictions == 1u );
+
+        // a tile bigger than the budget isn't cached, and evicts nothing.
+        cache->insert( "d", "0123456789a" );
+        CHECK( !cache->get("d", data) );
+        CHECK( cache->getStats().entries == 2u );
+
+        // compression (if there's a compressor) is transparent.
+        std::string tile;
+        for(unsigned i=0; i<1000u; ++i)
+            tile.append( "building" );
+        osg::ref_ptr<TileMemoryCache> compressed = new TileMemoryCache(1u<<20, true);
+        compressed->insert( "a", tile );
+        CHECK( compressed->get("a", data) && data == tile );
+        CHECK( compressed->getStats().bytes <= tile.size() );
+    }
+
+    //........................................................................
+
+    struct Test
+    {
+        const char* name;
+        void (*run)();
+    };
+
+    const Test s_tests[] =
+    {
+        { "PolygonOffset",     testPolygonOffset },
+        { "FootprintAnalysis", testFootprintAnalysis },
+        { "TileFormat",        testTileFormat },
+        { "CacheWriter",       testCacheWriter },
+        { "TextureStore",      testTextureStore },
+        { "TileMemoryCache",   testTileMemoryCache }
+    };
+
+    const unsigned s_numTests = sizeof(s_tests)/sizeof(s_tests[0]);
+}
+
+int
+usage(const char* name)
+{
+    std::cout
+        << "\nRuns the self-tests of the osgEarthBuildings library.\n"
+        << "\nUsage: " << name << " [test ...]\n"
+        << "\n    Runs the named tests, or all of them:";
+
+    for(unsigned t=0; t<s_numTests; ++t)
+        std::cout << " " << s_tests[t].name;
+
+    std::cout << "\n" << std::endl;
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    for(int a=1; a<argc; ++a)
+    {
+        if ( std::string(argv[a]) == "--help" )
+            return usage(argv[0]);
+    }
+
+    unsigned numRun = 0u, numFailed = 0u;
+    for(unsigned t=0; t<s_numTests; ++t)
+    {
+        bool selected = argc < 2;
+        for(int a=1; a<argc && !selected; ++a)
+            selected = std::string(argv[a]) == s_tests[t].name;
+        if ( !selected )
+            continue;
+
+        unsigned failuresBefore = s_numFailures;
+        s_tests[t].run();
+        bool passed = s_numFailures == failuresBefore;
+
+        std::cout << s_tests[t].name << ": " << (passed ? "passed" : "FAILED") << std::endl;
+        ++numRun;
+        if ( !passed )
+            ++numFailed;
+    }
+
+    if ( numRun == 0u )
+        return usage(argv[0]);
+
+    std::cout << numRun-numFailed << " of " << numRun << " tests passed" << std::endl;
+    return numFailed > 0u ? 1 : 0;
+}
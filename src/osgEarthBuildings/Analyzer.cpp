@@ -26,6 +26,11 @@
 #include <osgDB/Registry>
 #include <osgDB/WriteFile>
 #include <osgUtil/Statistics>
+#include <osg/AnimationPath>
+#include <osg/Transform>
+#include <osg/Polytope>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <set>
 
@@ -131,6 +136,108 @@ namespace
         }
         std::set<osg::Object*> _vbos;
     };
+
+    // Collects the world-space bounding box and vertex count of each drawable.
+    struct CollectDrawableBounds : public osg::NodeVisitor
+    {
+        struct Entry {
+            osg::BoundingBox box;
+            unsigned         numVerts;
+        };
+        std::vector<Entry> _entries;
+        unsigned           _totalVerts;
+
+        CollectDrawableBounds() : _totalVerts(0u) {
+            setTraversalMode(TRAVERSE_ALL_CHILDREN);
+            setNodeMaskOverride(~0);
+        }
+        void apply(osg::Geode& geode) {
+            osg::Matrix l2w = osg::computeLocalToWorld(getNodePath());
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i) {
+                osg::Drawable* d = geode.getDrawable(i);
+                const osg::BoundingBox& local = d->getBoundingBox();
+                if (!local.valid())
+                    continue;
+                Entry e;
+                for (unsigned c = 0; c < 8; ++c)
+                    e.box.expandBy(local.corner(c) * l2w);
+                osg::Geometry* g = d->asGeometry();
+                e.numVerts = g && g->getVertexArray() ? g->getVertexArray()->getNumElements() : 0u;
+                _totalVerts += e.numVerts;
+                _entries.push_back(e);
+            }
+        }
+    };
+
+    // Loads the recorded camera path named by the OSGEARTH_BUILDINGS_CAMERA_PATH
+    // environment variable (an osg::AnimationPath file), once.
+    osg::AnimationPath* getCameraPath()
+    {
+        static bool s_loaded = false;
+        static osg::ref_ptr<osg::AnimationPath> s_path;
+        if (!s_loaded)
+        {
+            s_loaded = true;
+            const char* filename = ::getenv("OSGEARTH_BUILDINGS_CAMERA_PATH");
+            if (filename)
+            {
+                std::ifstream in(filename);
+                if (in.is_open())
+                {
+                    s_path = new osg::AnimationPath();
+                    s_path->read(in);
+                    OE_INFO << LC << "Loaded camera path " << filename << " (" << s_path->getTimeControlPointMap().size() << " points)\n";
+                }
+                else
+                {
+                    OE_WARN << LC << "Failed to load camera path " << filename << "\n";
+                }
+            }
+        }
+        return s_path.get();
+    }
+
+    // Frustum-culls the drawables in "node" against each view along the camera 
+    // path and records the average fraction of drawables and vertices that
+    // survive. Lower is better; a single tile-sized drawable always survives.
+    void analyzeCulling(osg::Node* node, osg::AnimationPath* path, ProgressCallback* progress)
+    {
+        CollectDrawableBounds collect;
+        node->accept(collect);
+
+        const osg::AnimationPath::TimeControlPointMap& points = path->getTimeControlPointMap();
+        if (collect._entries.empty() || collect._totalVerts == 0u || points.empty())
+            return;
+
+        const osg::Matrix proj = osg::Matrix::perspective(30.0, 1.5, 1.0, 1e7);
+
+        double drawableRatio = 0.0, vertRatio = 0.0;
+        for (osg::AnimationPath::TimeControlPointMap::const_iterator p = points.begin(); p != points.end(); ++p)
+        {
+            osg::Matrix cameraToWorld;
+            p->second.getMatrix(cameraToWorld);
+
+            osg::Polytope frustum;
+            frustum.setToUnitFrustum();
+            frustum.transformProvidingInverse(osg::Matrix::inverse(cameraToWorld) * proj);
+
+            unsigned visibleDrawables = 0u, visibleVerts = 0u;
+            for (unsigned i = 0; i < collect._entries.size(); ++i)
+            {
+                if (frustum.contains(collect._entries[i].box))
+                {
+                    ++visibleDrawables;
+                    visibleVerts += collect._entries[i].numVerts;
+                }
+            }
+
+            drawableRatio += (double)visibleDrawables / (double)collect._entries.size();
+            vertRatio     += (double)visibleVerts / (double)collect._totalVerts;
+        }
+
+        progress->stats("# cull visible drawables %") = 100.0 * drawableRatio / (double)points.size();
+        progress->stats("# cull visible verts %")     = 100.0 * vertRatio / (double)points.size();
+    }
 }
 
 void
@@ -170,6 +277,13 @@ Analyzer::analyze(osg::Node* node, ProgressCallback* progress, unsigned numFeatu
         progress->stats("# primsets") = primsets;
         progress->stats("# vbos") = stats._vbos.size();
 
+        // CPU-side culling efficiency along a recorded camera path, if there is one:
+        osg::AnimationPath* cameraPath = getCameraPath();
+        if (cameraPath)
+        {
+            analyzeCulling(node, cameraPath, progress);
+        }
+
         FindTextures ft;
         node->accept(ft);
         ft.print(std::cout);
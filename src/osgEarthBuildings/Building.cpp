@@ -68,6 +68,9 @@ Building::build(const Polygon* footprint, BuildContext& bc)
     if ( !footprint || !footprint->isValid() )
         return false;
 
+    // Analysis data are only valid for the building under construction.
+    bc.resetFootprintAnalyses();
+
     // Resolve an instanced building model if available.
     resolveInstancedModel( bc );
     
@@ -83,7 +86,7 @@ Building::build(const Polygon* footprint, BuildContext& bc)
     // if we are using an instanced model, we still need the rotation/AABB from the first elevation:
     else if ( _elevations.size() > 0 )
     {
-        _elevations.front()->calculateRotations(footprint);
+        _elevations.front()->calculateRotations( *bc.getFootprintAnalysis(footprint) );
     }
 
     return true;
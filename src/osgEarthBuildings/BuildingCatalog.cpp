@@ -22,10 +22,13 @@
 #include "BuildingSymbol"
 #include "BuildingVisitor"
 #include "BuildContext"
+#include "CacheDependencies"
 
 #include <osgEarth/XmlUtils>
 #include <osgEarth/Containers>
+#include <osgEarth/StringUtils>
 #include <osgEarthSymbology/Style>
+#include <sstream>
 
 using namespace osgEarth;
 using namespace osgEarth::Symbology;
@@ -50,6 +53,10 @@ BuildingCatalog::createBuildings(Feature*              feature,
     if ( !feature )
         return false;
 
+    // every building depends on the selection rules, whichever template it gets.
+    if ( context.getDependencies() )
+        context.getDependencies()->add("catalog");
+
     Geometry* geometry = feature->getGeometry();
 
     if ( geometry && geometry->getComponentType() == Geometry::TYPE_POLYGON && geometry->isValid() )
@@ -85,7 +92,7 @@ BuildingCatalog::createBuildings(Feature*              feature,
                 float area = polygon->getBounds().area2d();
 
                 // A footprint is the minumum info required to make a building.
-                osg::ref_ptr<Building> building = cloneBuildingTemplate(feature, tags, height, area);
+                osg::ref_ptr<Building> building = cloneBuildingTemplate(feature, tags, height, area, context);
 
                 if ( building )
                 {
@@ -140,7 +147,8 @@ Building*
 BuildingCatalog::cloneBuildingTemplate(Feature*           feature,
                                        const TagVector&   tags,
                                        float              height,
-                                       float              area) const
+                                       float              area,
+                                       BuildContext&      context) const
 {
     if ( !_buildingsTemplates.empty() )
     {
@@ -165,6 +173,14 @@ BuildingCatalog::cloneBuildingTemplate(Feature*           feature,
             candidates.push_back(i);
         }
 
+        // The pick is random among the candidates, so the building depends on
+        // all of them and not just the one it gets.
+        if ( context.getDependencies() )
+        {
+            for(unsigned i=0; i<candidates.size(); ++i)
+                context.getDependencies()->add( Stringify() << "template." << candidates[i] );
+        }
+
         if ( !candidates.empty() )
         {
             UID uid = feature->getFID() + 1u;
@@ -200,6 +216,9 @@ BuildingCatalog::load(const URI& uri, const osgDB::Options* dbo, ProgressCallbac
 bool
 BuildingCatalog::parseBuildings(const Config& conf, ProgressCallback* progress)
 {
+    // the template-picking rules, for the cache's selection hash:
+    std::stringstream selection;
+
     for(ConfigSet::const_iterator b = conf.children().begin(); b != conf.children().end(); ++b)
     {
         if ( b->empty() )
@@ -235,8 +254,17 @@ BuildingCatalog::parseBuildings(const Config& conf, ProgressCallback* progress)
         }
 
         _buildingsTemplates.push_back( building );
+        _templateHashes.push_back( CacheDependencies::hash(b->toJSON(false)) );
+
+        selection
+            << b->value("tags") << ";"
+            << b->value("min_height") << ";" << b->value("max_height") << ";"
+            << b->value("min_area") << ";" << b->value("max_area") << ";"
+            << b->value("instanced") << "\n";
     }
 
+    _selectionHash = CacheDependencies::hash(selection.str());
+
     OE_INFO << LC << "Read " << _buildingsTemplates.size() << " building templates\n";
 
     return true;
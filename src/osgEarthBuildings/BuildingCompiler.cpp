@@ -40,6 +40,13 @@ _session( session )
     _instancedBuildingCompiler = new InstancedBuildingCompiler( session );
 }
 
+void
+BuildingCompiler::setSettings(const CompilerSettings& settings)
+{
+    _gableRoofCompiler->setUseInstancing( settings.useInstancedGableRoofs() == true );
+    _elevationCompiler->setUseInstancedBoxes( settings.useInstancedBoxes() == true );
+}
+
 bool
 BuildingCompiler::compile(const BuildingVector& input,
                           CompilerOutput&       output,
@@ -48,6 +55,10 @@ BuildingCompiler::compile(const BuildingVector& input,
 {
     OE_START_TIMER(total);
 
+    unsigned numRectangles = 0;
+    unsigned numInstancedBoxes = 0;
+    double   instancedBoxBytesSaved = 0.0;
+
     for(BuildingVector::const_iterator i = input.begin(); i != input.end(); ++i)
     {
         if ( progress && progress->isCanceled() )
@@ -69,12 +80,27 @@ BuildingCompiler::compile(const BuildingVector& input,
         else
         {
             addElevations( output, building, building->getElevations(), output.getWorldToLocal(), readOptions);
+
+            if ( !building->getElevations().empty() && building->getElevations().front()->isRectangle() )
+                ++numRectangles;
+
+            if ( progress && progress->collectStats() )
+            {
+                countInstancedBoxes( building->getElevations(), numInstancedBoxes, instancedBoxBytesSaved );
+            }
         }
     }
 
     if ( progress && progress->collectStats() )
     {
         progress->stats("compile.total") += OE_GET_TIMER(total);
+        progress->stats("# rect fast path") += numRectangles;
+
+        if ( _elevationCompiler->getUseInstancedBoxes() )
+        {
+            progress->stats("# instanced boxes") += numInstancedBoxes;
+            progress->stats("# instanced box KB saved") += instancedBoxBytesSaved / 1024.0;
+        }
     }
 
     return true;
@@ -156,3 +182,26 @@ BuildingCompiler::addRoof(CompilerOutput&       output,
     }
     return false;
 }
+
+void
+BuildingCompiler::countInstancedBoxes(const ElevationVector& elevations,
+                                      unsigned&              count,
+                                      double&                bytesSaved) const
+{
+    for(ElevationVector::const_iterator e = elevations.begin(); e != elevations.end(); ++e)
+    {
+        const Elevation* elevation = e->get();
+        if ( _elevationCompiler->isInstancedBox(elevation) )
+        {
+            ++count;
+
+            // What ElevationCompiler would have generated: 4 verts per face per floor,
+            // each with a position, normal and texture coordinate, plus 6 (ushort) indices;
+            // versus one instance matrix.
+            unsigned numQuads = elevation->getWalls().front().faces.size() * (unsigned)elevation->getNumFloors();
+            bytesSaved += (double)numQuads * (4.0*3.0*sizeof(osg::Vec3f) + 6.0*sizeof(GLushort)) - sizeof(osg::Matrixf);
+        }
+
+        countInstancedBoxes( elevation->getElevations(), count, bytesSaved );
+    }
+}
@@ -150,6 +150,17 @@ BuildingExtension::connect(MapNode* mapNode)
     if (enableCancelation().isSet())
         pager->setEnableCancelation(enableCancelation().get());
 
+    // Optionally load all the skins into one texture array up front:
+    if ( compilerSettings().get().useTextureArrays() == true && session->styles() )
+    {
+        osg::ref_ptr<SkinTextureArray> skinArray = new SkinTextureArray();
+        skinArray->setMaxTextureSize( compilerSettings().get().maxTextureArraySize().get() );
+        if ( skinArray->build(session->styles()->getDefaultResourceLibrary(), _readOptions.get()) )
+        {
+            pager->setSkinTextureArray( skinArray.get() );
+        }
+    }
+
     pager->build();
 
     if ( createIndex() == true )
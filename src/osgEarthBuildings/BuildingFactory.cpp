@@ -35,7 +35,8 @@ using namespace osgEarth::Symbology;
 
 #define LC "[BuildingFactory] "
 
-BuildingFactory::BuildingFactory()
+BuildingFactory::BuildingFactory() :
+_dependencies( 0L )
 {
     setSession( new Session(0L) );
 }
@@ -107,6 +108,10 @@ BuildingFactory::create(Feature*               feature,
     BuildContext context;
     context.setDBOptions( readOptions );
     context.setResourceLibrary( reslib );
+    context.setDependencies( _dependencies );
+
+    if ( _dependencies && reslib )
+        _dependencies->add( "library." + reslib->getName() );
 
     // URI context for external models
     URIContext uriContext( readOptions );
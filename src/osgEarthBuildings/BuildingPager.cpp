@@ -21,12 +21,15 @@
 #include <osgEarth/Registry>
 #include <osgEarthSymbology/Query>
 #include <osgEarthSymbology/StyleSheet>
+#include <osgEarthSymbology/ResourceLibrary>
+#include <osgEarth/StringUtils>
 #include <osgUtil/Optimizer>
 #include <osgUtil/Statistics>
 #include <osg/Version>
 #include <osg/CullFace>
 #include <osg/Geometry>
 #include <osgDB/WriteFile>
+#include <OpenThreads/Thread>
 
 #define LC "[BuildingPager] "
 
@@ -96,6 +99,12 @@ _index     ( 0L )
     // Texture object cache
     _texCache = new TextureCache();
 
+    // States and generated shaders, shared by all tiles
+    _stateSetCache = new StateSetCache();
+
+    // Instance model prototypes, prepared once and shared by all tiles
+    _protoCache = new PrototypeCache( _stateSetCache.get() );
+
 #if OSG_VERSION_GREATER_OR_EQUAL(3,5,1)
     // Read this to see why the version check exists:
     // https://github.com/openscenegraph/OpenSceneGraph/commit/5b17e3bc2a0c02cf84d891bfdccf14f170ee0ec8
@@ -108,6 +117,15 @@ _index     ( 0L )
         new osg::CullFace(), osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
 }
 
+BuildingPager::~BuildingPager()
+{
+    // finish writing queued tiles before the cache goes away.
+    if (_cacheWriter.valid())
+    {
+        _cacheWriter->flush();
+    }
+}
+
 void
 BuildingPager::setSession(Session* session)
 {
@@ -116,6 +134,7 @@ BuildingPager::setSession(Session* session)
     if ( session )
     {
         _compiler = new BuildingCompiler(session);
+        _compiler->setSettings( _compilerSettings );
 
         // Analyze the styles to determine the min and max LODs.
         // Styles are named by LOD.
@@ -166,11 +185,111 @@ BuildingPager::setCompilerSettings(const CompilerSettings& settings)
 {
     _compilerSettings = settings;
 
+    if ( _compiler.valid() )
+    {
+        _compiler->setSettings( _compilerSettings );
+    }
+
     // Apply the range factor from the settings:
     if (_compilerSettings.rangeFactor().isSet())
     {
         this->setRangeFactor(_compilerSettings.rangeFactor().get());
     }
+
+    // Cached tiles depend on the settings, except those that only affect how
+    // tiles are produced or where they're stored:
+    Config settingsConf = _compilerSettings.getConfig();
+    settingsConf.remove("post_process_threads");
+    settingsConf.remove("tile_cache_path");
+    settingsConf.remove("tile_cache_packed");
+    settingsConf.remove("cache_write_queue_size");
+    settingsConf.remove("memory_cache_size_mb");
+    settingsConf.remove("memory_cache_compression");
+    settingsConf.remove("tile_cache_compression");
+    settingsConf.remove("tile_cache_compression_level");
+    settingsConf.remove("tile_cache_dictionary_samples");
+    settingsConf.remove("texture_cache_size_mb");
+    _settingsHash = CacheDependencies::hash(settingsConf.toJSON(false));
+
+    // Shared textures past this are released once no tile uses them:
+    _texCache->setBudget((size_t)_compilerSettings.textureCacheSize().get() * 1024u * 1024u);
+
+    // Compact tile cache, if configured:
+    _tileStore = 0L;
+    _texCache->setTextureStore(0L);
+    if (_compilerSettings.tileCachePath().isSet() && !_compilerSettings.tileCachePath()->empty())
+    {
+        osg::ref_ptr<TileStore> files;
+        if (_compilerSettings.tileCachePacked() == true)
+            files = new PackedTileStore(_compilerSettings.tileCachePath().get());
+        else
+            files = new FileTileStore(_compilerSettings.tileCachePath().get());
+        _tileStore = files.get();
+        OE_INFO << LC << "Tile store at " << _compilerSettings.tileCachePath().get() << "\n";
+
+        if (_compilerSettings.tileCacheCompression().get() == "zstd")
+        {
+            if (CompressedTileStore::isAvailable())
+            {
+                _tileStore = new CompressedTileStore(
+                    files.get(),
+                    _compilerSettings.tileCacheCompressionLevel().get(),
+                    _compilerSettings.tileCacheDictionarySamples().get());
+            }
+            else
+            {
+                OE_WARN << LC << "Tile cache compression \"zstd\" requested, but this build doesn't support it\n";
+            }
+        }
+        else if (_compilerSettings.tileCacheCompression().get() != "none")
+        {
+            OE_WARN << LC << "Unknown tile cache compression \"" << _compilerSettings.tileCacheCompression().get() << "\"\n";
+        }
+
+        // Textures of compact tiles are stored once, next to the tiles (already
+        // compressed image files, so they skip the tile compression):
+        _texCache->setTextureStore(new TextureStore(files.get()));
+    }
+
+    // Write-behind cache queue, unless writes are to be synchronous:
+    if (_cacheWriter.valid())
+    {
+        _cacheWriter->flush();
+    }
+    _cacheWriter = _compilerSettings.cacheWriteQueueSize().get() > 0u ?
+        new CacheWriter(_compilerSettings.cacheWriteQueueSize().get()) : 0L;
+
+    // In-memory cache of recently produced tiles:
+    _memoryCache = _compilerSettings.memoryCacheSize().get() > 0u ?
+        new TileMemoryCache((size_t)_compilerSettings.memoryCacheSize().get() * 1024u * 1024u, _compilerSettings.memoryCacheCompression().get()) : 0L;
+
+    // Post-processing threads, shared by all pager threads (which work on
+    // their own tiles as well, hence one fewer):
+    unsigned postProcessThreads = _compilerSettings.postProcessThreads().get();
+    if (postProcessThreads == 0u)
+        postProcessThreads = OpenThreads::GetNumberOfProcessors();
+    _workerPool = postProcessThreads > 1u ? new WorkerPool(postProcessThreads - 1u) : 0L;
+}
+
+void
+BuildingPager::flushCache()
+{
+    if (_cacheWriter.valid())
+    {
+        _cacheWriter->flush();
+    }
+}
+
+void
+BuildingPager::setSkinTextureArray(SkinTextureArray* value)
+{
+    _skinTextureArray = value;
+
+    // register the array so that tiles read from the cache can share it.
+    if ( _skinTextureArray.valid() && _skinTextureArray->getTexture() )
+    {
+        _texCache->getOrInsert( _skinTextureArray->getTexture() );
+    }
 }
 
 void BuildingPager::setIndex(FeatureIndexBuilder* index)
@@ -187,8 +306,11 @@ BuildingPager::setElevationPool(ElevationPool* pool)
 bool
 BuildingPager::cacheReadsEnabled(const osgDB::Options* readOptions) const
 {
+    // Cached tiles don't carry object IDs (they are only valid in the session
+    // that assigned them), so with an index every tile is built and tagged.
     CacheSettings* cacheSettings = CacheSettings::get(readOptions);
     return
+        _index == 0L &&
         cacheSettings && 
         cacheSettings->getCacheBin() &&
         cacheSettings->cachePolicy()->isCacheReadable();
@@ -204,12 +326,126 @@ BuildingPager::cacheWritesEnabled(const osgDB::Options* writeOptions) const
         cacheSettings->cachePolicy()->isCacheWriteable();
 }
 
+std::string
+BuildingPager::getDependencyHash(const std::string& name, const TileKey& key) const
+{
+    if (name == "settings")
+    {
+        return _settingsHash;
+    }
+
+    else if (name == "style")
+    {
+        // the style for this LOD, plus any script its expressions may call:
+        std::string styleName = Stringify() << key.getLOD();
+        const Style* style = _session.valid() && _session->styles() ? _session->styles()->getStyle(styleName) : 0L;
+        std::string input = style ? style->getConfig().toJSON(false) : "";
+        if (_session.valid() && _session->styles() && _session->styles()->script())
+        {
+            input += _session->styles()->script()->code;
+        }
+        return CacheDependencies::hash(input);
+    }
+
+    else if (name == "catalog")
+    {
+        return _catalog.valid() ? _catalog->getSelectionHash() : "";
+    }
+
+    else if (startsWith(name, "template."))
+    {
+        unsigned index = as<unsigned>(name.substr(9), ~0u);
+        return _catalog.valid() ? _catalog->getTemplateHash(index) : "";
+    }
+
+    else if (startsWith(name, "library."))
+    {
+        std::string libName = name.substr(8);
+
+        Threading::ScopedMutexLock lock(_libraryHashesMutex);
+        std::map<std::string, std::string>::const_iterator i = _libraryHashes.find(libName);
+        if (i != _libraryHashes.end())
+            return i->second;
+
+        ResourceLibrary* reslib = _session.valid() && _session->styles() ? _session->styles()->getResourceLibrary(libName) : 0L;
+        std::string input;
+        if (reslib)
+        {
+            SkinResourceVector skins;
+            reslib->getSkins(skins, _session->getDBOptions());
+            for (SkinResourceVector::const_iterator r = skins.begin(); r != skins.end(); ++r)
+                input += r->get()->getConfig().toJSON(false);
+
+            ModelResourceVector models;
+            reslib->getModels(models, _session->getDBOptions());
+            for (ModelResourceVector::const_iterator r = models.begin(); r != models.end(); ++r)
+                input += r->get()->getConfig().toJSON(false);
+        }
+
+        std::string hash = reslib ? CacheDependencies::hash(input) : "";
+        _libraryHashes[libName] = hash;
+        return hash;
+    }
+
+    return "";
+}
+
+void
+BuildingPager::resolveDependencies(CacheDependencies& deps, const TileKey& key) const
+{
+    CacheDependencies::Hashes hashes = deps.getHashes();
+    for (CacheDependencies::Hashes::const_iterator i = hashes.begin(); i != hashes.end(); ++i)
+    {
+        deps.set(i->first, getDependencyHash(i->first, key));
+    }
+}
+
+bool
+BuildingPager::getChangedDependencies(const CacheDependencies& cached, const TileKey& key, std::vector<std::string>& changed) const
+{
+    // Tiles cached without dependencies can't be checked; they stay valid
+    // until the cache expires them, as before.
+    const CacheDependencies::Hashes& hashes = cached.getHashes();
+    for (CacheDependencies::Hashes::const_iterator i = hashes.begin(); i != hashes.end(); ++i)
+    {
+        if (getDependencyHash(i->first, key) != i->second)
+        {
+            changed.push_back(i->first);
+        }
+    }
+    return !changed.empty();
+}
+
+bool
+BuildingPager::getStaleDependencies(const TileKey& key, std::vector<std::string>& changed) const
+{
+    if (!_session.valid())
+        return false;
+
+    osg::ref_ptr<osgDB::Options> readOptions = Registry::cloneOrCreateOptions(_session->getDBOptions());
+
+    CompilerOutput output;
+    output.setName(key.str());
+    output.setTileKey(key);
+    output.setTileStore(_tileStore.get());
+    output.setCacheWriter(_cacheWriter.get());
+
+    Config metadata;
+    if (!output.readCacheMetadata(readOptions.get(), metadata))
+        return false;
+
+    getChangedDependencies(CacheDependencies(metadata), key, changed);
+    return true;
+}
+
 osg::Node*
 BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 {
     if ( !_session.valid() || !_compiler.valid() || !_features.valid() )
     {
         OE_WARN << LC << "Misconfiguration error; make sure Session and FeatureSource are set\n";
+        if ( progress )
+            progress->message() = "Misconfiguration error";
         return 0L;
     }
 
@@ -240,7 +476,7 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 
     // TESTING:
     Registry::instance()->startActivity("Bld art cache", Stringify()<<((ArtCache*)(_artCache.get()))->size());
-    Registry::instance()->startActivity("Bld tex cache", Stringify() << _texCache->_cache.size());
+    Registry::instance()->startActivity("Bld tex cache", Stringify() << _texCache->getStats().entries);
     Registry::instance()->startActivity("RCache skins", Stringify() << _session->getResourceCache()->getSkinStats()._entries);
     Registry::instance()->startActivity("RCache insts", Stringify() << _session->getResourceCache()->getInstanceStats()._entries);
 
@@ -250,30 +486,103 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
     output.setTileKey(tileKey);
     output.setIndex(_index);
     output.setTextureCache(_texCache.get());
+    output.setPrototypeCache(_protoCache.get());
+    output.setStateSetCache(_stateSetCache.get());
+    output.setSkinTextureArray(_skinTextureArray.get());
+    output.setWorkerPool(_workerPool.get());
+
+    output.setTileStore(_tileStore.get());
+    output.setCacheWriter(_cacheWriter.get());
 
     bool canceled = false;
     bool caching = true;
 
-    // Try to load from the cache.
-    if (cacheReadsEnabled(readOptions.get()) && !canceled)
+    // fetch the style for this LOD:
+    std::string styleName = Stringify() << tileKey.getLOD();
+    const Style* style = _session->styles() ? _session->styles()->getStyle(styleName) : 0L;
+
+    // set the distance at which details become visible.
+    osg::BoundingSphere tileBound = getBounds(tileKey);
+    output.setRange(tileBound.radius() * getRangeFactor());
+
+    bool needsPostProcess = false;
+
+    // Try the in-memory cache of recently produced tiles first. Like the
+    // cache, it holds tiles without object IDs, so it's unused with an index.
+    bool fromMemory = false;
+    bool useMemoryCache = _memoryCache.valid() && _index == 0L;
+    if (useMemoryCache && !canceled)
+    {
+        OE_START_TIMER(readMemory);
+
+        std::string data;
+        if (_memoryCache->get(tileKey.str(), data))
+        {
+            node = output.decodeCompact(data, _session.get(), _compilerSettings, readOptions.get());
+            fromMemory = node.valid();
+            needsPostProcess = fromMemory;
+        }
+
+        if (progress && progress->collectStats())
+            progress->stats("pager.readMemory") = OE_GET_TIMER(readMemory);
+    }
+
+    // Then the cache.
+    if (!node.valid() && cacheReadsEnabled(readOptions.get()) && !canceled)
     {
         OE_START_TIMER(readCache);
 
-        node = output.readFromCache(readOptions.get(), progress);
+        Config metadata;
+        node = output.readFromCache(_session.get(), _compilerSettings, readOptions.get(), progress, &needsPostProcess, &metadata);
+
+        // Discard the tile if anything it was built from has changed since.
+        std::vector<std::string> changed;
+        if (node.valid() && getChangedDependencies(CacheDependencies(metadata), tileKey, changed))
+        {
+            OE_INFO << LC << "Tile " << tileKey.str() << " is cached but stale (" << joinStrings(changed, ',') << ")\n";
+            node = 0L;
+            needsPostProcess = false;
+            output.clearCompactSource();
+        }
 
         if (progress && progress->collectStats())
+        {
             progress->stats("pager.readCache") = OE_GET_TIMER(readCache);
+
+            // average time to decompress a tile, to weigh against the bytes saved
+            CompressedTileStore* compressed = dynamic_cast<CompressedTileStore*>(_tileStore.get());
+            if (compressed && compressed->getStats().tilesRead > 0u)
+            {
+                CompressedTileStore::Stats stats = compressed->getStats();
+                progress->stats("cache.decompress") = stats.decodeMillis / (double)stats.tilesRead;
+            }
+        }
     }
 
     bool fromCache = node.valid();
 
     canceled = canceled || (progress && progress->isCanceled());
 
+    // Compact tiles come back as the raw graph, like a fresh build.
+    if (fromCache && needsPostProcess && !canceled)
+    {
+        OE_START_TIMER(postProcess);
+
+        if (style)
+            applyRenderSymbology(node.get(), *style);
+
+        output.postProcess(node.get(), _compilerSettings, progress);
+
+        if (progress && progress->collectStats())
+            progress->stats("pager.postProcess") = OE_GET_TIMER(postProcess);
+    }
+
     if (!node.valid() && !canceled)
     {
-        // fetch the style for this LOD:
-        std::string styleName = Stringify() << tileKey.getLOD();
-        const Style* style = _session->styles() ? _session->styles()->getStyle(styleName) : 0L;
+        // Everything the tile is built from, for checking the cached copy later:
+        CacheDependencies dependencies;
+        dependencies.add("settings");
+        dependencies.add("style");
 
         // Create a cursor to iterator over the feature data:
         Query query;
@@ -283,6 +592,7 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
         if (cursor.valid() && cursor->hasMore() && !canceled)
         {
             osg::ref_ptr<BuildingFactory> factory = new BuildingFactory();
+            factory->setDependencies(&dependencies);
 
             factory->setSession(_session.get());
             factory->setCatalog(_catalog.get());
@@ -305,6 +615,8 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
                 // to the underlying map for some reason (Map closed, e.g.). In this case we
                 // should just cancel the tile operation.
                 OE_INFO << LC << "Failed to create clamping envelope for " << tileKey.str() << "\n";
+                if (progress)
+                    progress->message() = "Failed to create clamping envelope";
                 canceled = true;
             }
 
@@ -341,9 +653,6 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 
             if (!canceled)
             {
-                // set the distance at which details become visible.
-                osg::BoundingSphere tileBound = getBounds(tileKey);
-                output.setRange(tileBound.radius() * getRangeFactor());
                 node = output.createSceneGraph(_session.get(), _compilerSettings, readOptions, progress);
             }
             else
@@ -351,6 +660,12 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
                 //OE_INFO << LC << "Tile " << tileKey.str() << " was canceled " << progress->message() << "\n";
             }
         }
+        else if (!cursor.valid())
+        {
+            // not the same as a tile without features; don't let callers take it for one.
+            if (progress)
+                progress->message() = "Failed to read features";
+        }
 
         // This can go here now that we can serialize DIs and TBOs.
         if (node.valid() && !canceled)
@@ -371,13 +686,72 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
         {
             OE_START_TIMER(writeCache);
 
+            resolveDependencies(dependencies, tileKey);
+            output.setDependencies(dependencies);
             output.writeToCache(node, readOptions, progress);
 
             if (progress && progress->collectStats())
+            {
                 progress->stats("pager.writeCache") = OE_GET_TIMER(writeCache);
+                if (_cacheWriter.valid())
+                {
+                    progress->stats("# cache queue") = _cacheWriter->getQueueSize();
+                    progress->stats("# cache coalesced") = _cacheWriter->getNumCoalesced();
+                    progress->stats("# cache blocked") = _cacheWriter->getNumBlocked();
+                }
+                if (_texCache->getTextureStore())
+                {
+                    // footprint of the shared textures vs. one copy per referencing tile
+                    TextureStore::Stats stats = _texCache->getTextureStore()->getStats();
+                    progress->stats("# texture store KB") = (double)(stats.bytesStored/1024u);
+                    progress->stats("# texture refs KB") = (double)(stats.bytesReferenced/1024u);
+                }
+                CompressedTileStore* compressed = dynamic_cast<CompressedTileStore*>(_tileStore.get());
+                if (compressed)
+                {
+                    // bytes on disk against what was compressed
+                    CompressedTileStore::Stats stats = compressed->getStats();
+                    progress->stats("# cache raw KB") = (double)(stats.bytesIn/1024u);
+                    progress->stats("# cache stored KB") = (double)(stats.bytesOut/1024u);
+                }
+            }
         }
     }
 
+    // Keep the tile in memory in case it's paged out and comes back into view.
+    // Tiles loaded from osgb can't be encoded (their instance data is gone).
+    // The compact source, if any, is the tile we return: the one it was read
+    // from, or the fresh build writeToCache encoded.
+    if (useMemoryCache && node.valid() && !canceled && !fromMemory)
+    {
+        std::string data;
+        if (output.getCompactSource())
+            data.assign(output.getCompactSource()->data(), output.getCompactSource()->size());
+        else if (!fromCache)
+            output.encodeCompact(node.get(), data);
+
+        if (!data.empty())
+            _memoryCache->insert(tileKey.str(), data);
+
+        if (progress && progress->collectStats())
+        {
+            TileMemoryCache::Stats stats = _memoryCache->getStats();
+            progress->stats("# memory cache hits") = stats.hits;
+            progress->stats("# memory cache misses") = stats.misses;
+            progress->stats("# memory cache evictions") = stats.evictions;
+            progress->stats("# memory cache KB") = (double)(stats.bytes/1024u);
+        }
+    }
+
+    if (progress && progress->collectStats())
+    {
+        TextureCache::Stats stats = _texCache->getStats();
+        progress->stats("# texture cache hits") = stats.hits;
+        progress->stats("# texture cache misses") = stats.misses;
+        progress->stats("# texture cache evictions") = stats.evictions;
+        progress->stats("# texture cache KB") = (double)(stats.bytes/1024u);
+    }
+
     Registry::instance()->endActivity(activityName);
 
     double totalTime = OE_GET_TIMER(total);
@@ -392,6 +766,8 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
     if (canceled)
     {
         OE_INFO << LC << "Building tile " << tileKey.str() << " - canceled\n";
+        if (progress && progress->message().empty())
+            progress->message() = "canceled";
         return 0L;
     }
     else
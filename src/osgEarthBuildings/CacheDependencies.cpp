@@ -0,0 +1,60 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "CacheDependencies"
+#include <osgEarth/StringUtils>
+
+#define LC "[CacheDependencies] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+CacheDependencies::CacheDependencies(const Config& conf)
+{
+    const Config* deps = conf.key() == "dependencies" ? &conf : conf.child_ptr("dependencies");
+    if ( deps )
+    {
+        for(ConfigSet::const_iterator i = deps->children().begin(); i != deps->children().end(); ++i)
+        {
+            if ( i->key() == "dependency" && i->hasValue("name") )
+            {
+                set( i->value("name"), i->value("hash") );
+            }
+        }
+    }
+}
+
+Config
+CacheDependencies::getConfig() const
+{
+    Config conf("dependencies");
+    for(Hashes::const_iterator i = _hashes.begin(); i != _hashes.end(); ++i)
+    {
+        Config dep("dependency");
+        dep.add("name", i->first);
+        dep.add("hash", i->second);
+        conf.add(dep);
+    }
+    return conf;
+}
+
+std::string
+CacheDependencies::hash(const std::string& input)
+{
+    return hashToString(input);
+}
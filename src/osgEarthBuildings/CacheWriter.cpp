@@ -0,0 +1,210 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "CacheWriter"
+#include <osgEarth/Notify>
+#include <OpenThreads/ScopedLock>
+
+#define LC "[CacheWriter] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+CacheWriter::CacheWriter(unsigned maxQueueSize) :
+_writing     ( false ),
+_done        ( false ),
+_maxQueueSize( osg::maximum(maxQueueSize, 1u) ),
+_numCoalesced( 0u ),
+_numBlocked  ( 0u )
+{
+    _thread = new WriterThread( this );
+    _thread->startThread();
+}
+
+CacheWriter::~CacheWriter()
+{
+    // write out whatever is left, then stop the thread.
+    flush();
+    {
+        ScopedLock lock( _mutex );
+        _done = true;
+        _queued.broadcast();
+    }
+    _thread->join();
+    delete _thread;
+}
+
+void
+CacheWriter::writeCompact(TileStore* store, const std::string& key, const std::string& data,
+                          TextureStore* textures, const std::set<std::string>& imageURIs)
+{
+    Job job;
+    job.store     = store;
+    job.data      = data;
+    job.textures  = textures;
+    job.imageURIs = imageURIs;
+    enqueue( key, job );
+}
+
+void
+CacheWriter::writeNode(CacheBin* bin, const std::string& key, osg::Node* node, const Config& metadata, const osgDB::Options* writeOptions)
+{
+    Job job;
+    job.bin      = bin;
+    job.node     = node;
+    job.metadata = metadata;
+    job.options  = writeOptions;
+    enqueue( key, job );
+}
+
+void
+CacheWriter::enqueue(const std::string& key, const Job& job)
+{
+    ScopedLock lock( _mutex );
+
+    Jobs::iterator i = _jobs.find( key );
+    if ( i != _jobs.end() )
+    {
+        // newer copy of a tile that hasn't been written yet; it keeps its place.
+        i->second = job;
+        ++_numCoalesced;
+        return;
+    }
+
+    // backpressure: wait for the writer to make room.
+    if ( _jobs.size() >= _maxQueueSize )
+    {
+        ++_numBlocked;
+        while ( _jobs.size() >= _maxQueueSize && !_done )
+            _written.wait( &_mutex );
+    }
+
+    _jobs[key] = job;
+    _order.push_back( key );
+    _queued.signal();
+}
+
+const CacheWriter::Job*
+CacheWriter::findPending(const std::string& key) const
+{
+    Jobs::const_iterator i = _jobs.find( key );
+    if ( i != _jobs.end() )
+        return &i->second;
+
+    if ( _writing && _currentKey == key )
+        return &_current;
+
+    return 0L;
+}
+
+bool
+CacheWriter::getPendingCompact(const std::string& key, std::string& data) const
+{
+    ScopedLock lock( _mutex );
+    const Job* job = findPending( key );
+    if ( job && job->store.valid() )
+    {
+        data = job->data;
+        return true;
+    }
+    return false;
+}
+
+osg::ref_ptr<osg::Node>
+CacheWriter::getPendingNode(const std::string& key, Config& metadata) const
+{
+    // the reference keeps the node alive after the writer is done with it.
+    ScopedLock lock( _mutex );
+    const Job* job = findPending( key );
+    if ( job && job->node.valid() )
+    {
+        metadata = job->metadata;
+        return job->node;
+    }
+    return 0L;
+}
+
+void
+CacheWriter::flush()
+{
+    ScopedLock lock( _mutex );
+    while ( !_jobs.empty() || _writing )
+        _written.wait( &_mutex );
+}
+
+unsigned
+CacheWriter::getQueueSize() const
+{
+    ScopedLock lock( _mutex );
+    return _jobs.size();
+}
+
+void
+CacheWriter::run()
+{
+    while ( true )
+    {
+        {
+            ScopedLock lock( _mutex );
+            while ( _order.empty() && !_done )
+                _queued.wait( &_mutex );
+
+            if ( _order.empty() )
+                return;
+
+            // keep the job visible to readers until it's on disk.
+            _currentKey = _order.front();
+            _order.pop_front();
+            Jobs::iterator i = _jobs.find( _currentKey );
+            _current = i->second;
+            _jobs.erase( i );
+            _writing = true;
+        }
+
+        if ( _current.store.valid() )
+        {
+            // storing the textures rewrites the tile; readers still see the
+            // queued copy (its image URIs are valid state keys too).
+            std::string data = _current.data;
+            std::set<std::string> contentKeys;
+            bool ok = !_current.textures.valid() ||
+                _current.textures->putTextures( _current.imageURIs, data, contentKeys );
+
+            // a tile replaced in the queue, or not written, refers to nothing.
+            if ( ok && _current.store->write( _currentKey, data.data(), data.size() ) )
+            {
+                for(std::set<std::string>::const_iterator k = contentKeys.begin(); k != contentKeys.end(); ++k)
+                    _current.textures->addReference( *k );
+            }
+        }
+        else if ( _current.bin.valid() && _current.node.valid() )
+        {
+            _current.bin->writeNode( _currentKey, _current.node.get(), _current.metadata, _current.options.get() );
+        }
+
+        {
+            ScopedLock lock( _mutex );
+            _writing = false;
+            _current = Job();
+            _currentKey.clear();
+            _written.broadcast();
+        }
+    }
+}
@@ -23,6 +23,19 @@ using namespace osgEarth::Buildings;
 
 #define LC "[Compiler] "
 
+TemplateModelResource::TemplateModelResource(const std::string& name, osg::Node* node) :
+ModelResource(),
+_node( node )
+{
+    this->name() = name;
+}
+
+osg::Node*
+TemplateModelResource::createNodeFromURI(const URI& uri, const osgDB::Options* dbOptions) const
+{
+    return _node.get();
+}
+
 void
 Compiler::addCappedBox(const osg::Vec3f& LL,
                        const osg::Vec3f& UR,
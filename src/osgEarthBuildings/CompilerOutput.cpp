@@ -17,19 +17,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "CompilerOutput"
+#include "IndexOptimizer"
+#include "Instancing"
 #include <osg/LOD>
 #include <osg/MatrixTransform>
 #include <osg/ProxyNode>
 #include <osgUtil/Optimizer>
 #include <osgEarth/ShaderGenerator>
-#include <osgEarth/DrawInstanced>
 #include <osgEarth/Registry>
+#include <osgEarth/ObjectIndex>
 #include <osgEarth/ImageUtils>
 #include <osgEarthFeatures/Session>
 #include <osgEarthSymbology/ResourceCache>
+#include <osgEarthSymbology/ResourceLibrary>
+#include <osgEarthSymbology/StyleSheet>
 #include <osgEarthSymbology/MeshFlattener>
+#include <osgEarth/StringUtils>
 #include <osgDB/WriteFile>
 #include <set>
+#include <cmath>
+#include <ctime>
 
 using namespace osgEarth;
 using namespace osgEarth::Buildings;
@@ -45,16 +52,66 @@ using namespace osgEarth::Buildings;
 
 #define USE_LODS 1
 
+// Instance clustering cell budget when maxVertsPerCluster isn't set.
+#define DEFAULT_INSTANCE_CELL_VERTS 65536u
+
+// Same limit the old post-hoc merge pass used.
+#define MAX_VERTS_PER_POOL 250000u
+
+namespace
+{
+    /** Collects the geometries in a subgraph, in traversal order. */
+    struct CollectGeometries : public osg::NodeVisitor
+    {
+        std::vector< osg::ref_ptr<osg::Geometry> > _geometries;
+        CollectGeometries() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) { }
+        void apply(osg::Geode& geode)
+        {
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if (geom)
+                    _geometries.push_back(geom);
+            }
+        }
+    };
+
+    /** Removes the feature index's object IDs from the geometries in a subgraph. */
+    struct RemoveObjectIDs : public osg::NodeVisitor
+    {
+        int _location;
+        RemoveObjectIDs() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN),
+            _location(Registry::objectIndex()->getObjectIDAttribLocation()) { }
+        void apply(osg::Geode& geode)
+        {
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if (geom && geom->getVertexAttribArray(_location))
+                    geom->setVertexAttribArray(_location, 0L);
+            }
+        }
+    };
+}
+
 CompilerOutput::CompilerOutput() :
-_range( FLT_MAX ),
+_numLooseDrawables( 0u ),
 _index( 0L ),
-_currentFeature( 0L )
+_currentFeature( 0L ),
+_currentChunk( 0u ),
+_currentObjectID( 0u ),
+_range( FLT_MAX ),
+_numSkinStateSetsReused( 0u )
 {
     _externalModelsGroup = new osg::Group();
     _externalModelsGroup->setName(EXTERNALS_ROOT);
 
     _debugGroup = new osg::Group();
     _debugGroup->setName(DEBUG_ROOT);
+
+    // private caches, for outputs used without a pager (which shares its own):
+    _texCache = new TextureCache();
+    _protoCache = new PrototypeCache();
 }
 
 void
@@ -82,6 +139,7 @@ CompilerOutput::addDrawable(osg::Drawable* drawable, const std::string& tag)
         geode = new osg::Geode();
     }
     geode->addDrawable( drawable );
+    ++_numLooseDrawables;
 
     if ( _index && _currentFeature )
     {
@@ -89,12 +147,118 @@ CompilerOutput::addDrawable(osg::Drawable* drawable, const std::string& tag)
     }
 }
 
+void
+CompilerOutput::setCurrentFeature(Feature* feature)
+{
+    _currentFeature = feature;
+    ++_currentChunk;
+
+    // Until createSceneGraph tags the geometry, the pools and instances carry
+    // the feature's number in this output instead of its index object ID.
+    _currentObjectID = 0u;
+    if ( _index && feature )
+    {
+        _features.push_back( feature );
+        _currentObjectID = _features.size();
+    }
+}
+
+void
+CompilerOutput::tagObjectIDs(osg::Geometry* geom) const
+{
+    // The index writes its object IDs over our feature numbers, one range
+    // per run of a feature's vertices; a chunk is never split, so that's
+    // once per feature in each geometry.
+    osg::ref_ptr<osg::UIntArray> numbers = dynamic_cast<osg::UIntArray*>(
+        geom->getVertexAttribArray(Registry::objectIndex()->getObjectIDAttribLocation()) );
+    if ( !numbers.valid() )
+        return;
+
+    // read the numbers from a copy; tagging may replace the array.
+    std::vector<unsigned> runs( numbers->begin(), numbers->end() );
+    for(unsigned start = 0; start < runs.size(); )
+    {
+        unsigned number = runs[start];
+        unsigned end = start+1;
+        while ( end < runs.size() && runs[end] == number )
+            ++end;
+
+        if ( number > 0u && number <= _objectIDs.size() )
+        {
+            _objectIDs[number-1] = _index->tagRange( geom, _features[number-1].get(), start, end-start );
+        }
+        start = end;
+    }
+}
+
+void
+CompilerOutput::tagInstances(osg::Group*                  instancedGroup,
+                             const std::vector<unsigned>& numbers,
+                             const std::vector<unsigned>& objectIDs) const
+{
+    // Features that only have instances don't have an ID yet. The index tags
+    // their slots in the per-instance ID array, which each batch of the
+    // instanced group shares among its geometries, in matrix order.
+    int location = Registry::objectIndex()->getObjectIDAttribLocation();
+    unsigned first = 0u;
+    for(unsigned b=0; b<instancedGroup->getNumChildren() && first < numbers.size(); ++b)
+    {
+        CollectGeometries collect;
+        instancedGroup->getChild(b)->accept( collect );
+        if ( collect._geometries.empty() )
+            return;
+
+        osg::Geometry* geom = collect._geometries.front().get();
+        const osg::Array* ids = geom->getVertexAttribArray(location);
+        if ( !ids )
+            return;
+
+        unsigned count = ids->getNumElements();
+        for(unsigned k=0; k<count && first+k < numbers.size(); ++k)
+        {
+            unsigned number = numbers[first+k];
+            if ( objectIDs[first+k] == 0u && number > 0u && number <= _features.size() )
+            {
+                _objectIDs[number-1] = _index->tagRange( geom, _features[number-1].get(), k, 1u );
+            }
+        }
+
+        // tagging may replace the array; keep it shared by the whole batch.
+        osg::Array* tagged = geom->getVertexAttribArray(location);
+        for(unsigned g=1; g<collect._geometries.size(); ++g)
+        {
+            collect._geometries[g]->setVertexAttribArray( location, tagged );
+        }
+
+        first += count;
+    }
+}
+
 void
 CompilerOutput::addInstance(ModelResource* model, const osg::Matrix& matrix)
 {
-    _instances[model].push_back( matrix );
+    Instances& instances = _instances[model];
+    instances.matrices.push_back( matrix );
 
-    //TODO: index it. the vector needs to be a vector of pair<matrix,feature>
+    if ( _currentObjectID != 0u || !instances.objectIDs.empty() )
+    {
+        instances.objectIDs.resize( instances.matrices.size()-1, 0u );
+        instances.objectIDs.push_back( _currentObjectID );
+    }
+}
+
+GeometryPool*
+CompilerOutput::getGeometryPool(const std::string& tag, osg::StateSet* stateSet)
+{
+    osg::ref_ptr<GeometryPool>& pool = _pools[PoolKey(tag, stateSet)];
+    if ( !pool.valid() || pool->getNumVertices() >= MAX_VERTS_PER_POOL )
+    {
+        pool = new GeometryPool( stateSet );
+        _allPools.push_back( std::make_pair(tag, pool.get()) );
+    }
+    // With a feature index, the chunk carries the feature's object ID per vertex.
+    pool->beginChunk( _currentChunk, _currentObjectID );
+    return pool.get();
 }
 
 std::string
@@ -116,40 +280,76 @@ CompilerOutput::createCacheKey() const
 
 namespace
 {
-    struct ConsolidateTextures : public TextureAndImageVisitor
+    // State key of the shared skin texture array in compact tiles.
+    const std::string ARRAY_STATE_KEY = "@array";
+
+    // Finds the key under which the compact format records a geometry's state:
+    // its texture's image URI (which the caller may swap for a content key),
+    // or the array key. Returns false if the state can't be referred to that way.
+    bool getStateKey(const osg::StateSet* stateSet, const osg::Texture* arrayTexture, std::string& key)
     {
-        TextureCache* _cache;
-        ConsolidateTextures(TextureCache* cache) : _cache(cache) { }
-        void apply(osg::StateSet& stateSet)
+        key.clear();
+        if ( !stateSet )
+            return true;
+
+        const osg::Texture* tex = dynamic_cast<const osg::Texture*>(
+            stateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE) );
+        if ( !tex )
+            return true;
+
+        if ( arrayTexture && tex == arrayTexture )
         {
-            osg::StateSet::TextureAttributeList& a = stateSet.getTextureAttributeList();
-            for (osg::StateSet::TextureAttributeList::iterator i = a.begin(); i != a.end(); ++i)
-            {
-                osg::StateSet::AttributeList& b = *i;
-                for (osg::StateSet::AttributeList::iterator j = b.begin(); j != b.end(); ++j)
-                {
-                    osg::StateAttribute* sa = j->second.first.get();
-                    if (sa)
-                    {
-                        osg::Texture* tex = dynamic_cast<osg::Texture*>(sa);
-                        if (tex)
-                        {
-                            osg::Texture* sharedTex = _cache->getOrInsert(tex);
-                            if (sharedTex != 0L && sharedTex != tex)
-                            {
-                                j->second.first = sharedTex;
-                            }
-                        }
-                    }
-                }
-            }
+            key = ARRAY_STATE_KEY;
+            return true;
         }
-    };
+
+        if ( tex->getNumImages() == 1 && tex->getImage(0) && !tex->getImage(0)->getFileName().empty() )
+        {
+            key = tex->getImage(0)->getFileName();
+            return true;
+        }
+
+        return false;
+    }
+
+    // Finds an instance model by the name a compact tile refers to it by.
+    ModelResource* findModel(const std::string& name, Session* session, PrototypeCache* protoCache, const osgDB::Options* readOptions)
+    {
+        ModelResource* model = protoCache ? protoCache->findModel(name) : 0L;
+        if ( !model && session && session->styles() && session->styles()->getDefaultResourceLibrary() )
+        {
+            model = session->styles()->getDefaultResourceLibrary()->getModel(name, readOptions);
+        }
+        return model;
+    }
+
+    // Copy of a tile for the write-behind queue, which serializes it while the
+    // original is in the scene. Everything the render thread might touch is
+    // copied; vertex arrays and images are shared, since nothing changes them.
+    osg::Node* copyForCache(const osg::Node* node)
+    {
+        return osg::clone( node, osg::CopyOp(
+            osg::CopyOp::DEEP_COPY_NODES |
+            osg::CopyOp::DEEP_COPY_DRAWABLES |
+            osg::CopyOp::DEEP_COPY_PRIMITIVES |
+            osg::CopyOp::DEEP_COPY_STATESETS |
+            osg::CopyOp::DEEP_COPY_STATEATTRIBUTES |
+            osg::CopyOp::DEEP_COPY_TEXTURES |
+            osg::CopyOp::DEEP_COPY_USERDATA) );
+    }
 }
 
 osg::Node*
-CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallback* progress) const
+CompilerOutput::readFromCache(Session*                session,
+                              const CompilerSettings& settings,
+                              const osgDB::Options*   readOptions,
+                              ProgressCallback*       progress,
+                              bool*                   needsPostProcess,
+                              Config*                 metadata) const
 {
+    if ( needsPostProcess )
+        *needsPostProcess = false;
+
     CacheSettings* cacheSettings = CacheSettings::get(readOptions);
 
     if ( !cacheSettings || !cacheSettings->getCacheBin() )
@@ -159,8 +359,66 @@ CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallbac
     if (cacheKey.empty())
         return 0L;
 
+    // tiles still waiting to be written are served from memory.
+    if ( _cacheWriter.valid() )
+    {
+        osg::Node* pending = readPending(cacheKey, session, settings, readOptions, needsPostProcess, metadata);
+        if ( pending )
+        {
+            OE_INFO << LC << "Loaded " << _name << " from the cache write queue (key = " << cacheKey << ")\n";
+            return pending;
+        }
+    }
+
+    // try the compact store first.
+    if ( _tileStore.valid() )
+    {
+        OE_START_TIMER(compact);
+
+        osg::ref_ptr<TileBlob> blob = _tileStore->read(cacheKey);
+        if ( blob.valid() )
+        {
+            if (cacheSettings->cachePolicy()->isExpired(blob->getLastModified()))
+            {
+                OE_DEBUG << LC << "Tile " << _name << " is cached but expired.\n";
+                return 0L;
+            }
+
+            TileFormat::Tile tile;
+            osg::ref_ptr<osg::Node> node;
+            if ( TileFormat::decode(blob->data(), blob->size(), tile) )
+            {
+                node = readCompact(tile, session, settings, readOptions);
+            }
+            else
+            {
+                OE_WARN << LC << "Tile " << _name << " in the tile store is corrupt or out of date; ignoring it\n";
+            }
+
+            if ( node.valid() )
+            {
+                if ( metadata )
+                    metadata->fromJSON( tile.metadata );
+
+                if ( progress && progress->collectStats() )
+                {
+                    progress->stats("cache.compact") = OE_GET_TIMER(compact);
+                    progress->stats("# cache KB") = (double)(blob->size()/1024u);
+                }
+
+                if ( needsPostProcess )
+                    *needsPostProcess = true;
+
+                _compactSource = blob.get();
+
+                OE_INFO << LC << "Loaded " << _name << " from the tile store (key = " << cacheKey << ")\n";
+                return node.release();
+            }
+        }
+    }
+
     // read from the cache.
-    osg::ref_ptr<osg::Node> node;
+    OE_START_TIMER(osgb);
 
     osgEarth::ReadResult result = cacheSettings->getCacheBin()->readObject(cacheKey, readOptions);
     if (result.succeeded())
@@ -171,8 +429,15 @@ CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallbac
             return 0L;
         }
 
-        ConsolidateTextures consolidate(_texCache.get());
-        result.getNode()->accept(consolidate);
+        _texCache->consolidate( result.getNode() );
+
+        if ( metadata )
+            *metadata = result.metadata();
+
+        if ( progress && progress->collectStats() )
+        {
+            progress->stats("cache.osgb") = OE_GET_TIMER(osgb);
+        }
 
         OE_INFO << LC << "Loaded " << _name << " from the cache (key = " << cacheKey << ")\n";
         return result.releaseNode();
@@ -184,18 +449,202 @@ CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallbac
     }
 }
 
-osg::StateSet*
-CompilerOutput::getSkinStateSet(SkinResource* skin, const osgDB::Options* readOptions)
+osg::Node*
+CompilerOutput::decodeCompact(const std::string&      data,
+                              Session*                session,
+                              const CompilerSettings& settings,
+                              const osgDB::Options*   readOptions) const
+{
+    TileFormat::Tile tile;
+    if ( !TileFormat::decode(data.data(), data.size(), tile) )
+        return 0L;
+
+    return readCompact(tile, session, settings, readOptions);
+}
+
+osg::Node*
+CompilerOutput::readPending(const std::string&      cacheKey,
+                            Session*                session,
+                            const CompilerSettings& settings,
+                            const osgDB::Options*   readOptions,
+                            bool*                   needsPostProcess,
+                            Config*                 metadata) const
 {
-    osg::ref_ptr<osg::StateSet>& ss = _skinStateSetCache[skin->imageURI()->full()];
-    if (!ss.valid()) {
-        ss = new osg::StateSet();
-        osg::Texture* tex = _texCache->get(skin, readOptions);
-        if (tex) {
-            ss->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
+    if ( !_cacheWriter.valid() )
+        return 0L;
+
+    std::string data;
+    if ( _tileStore.valid() && _cacheWriter->getPendingCompact(cacheKey, data) )
+    {
+        TileFormat::Tile tile;
+        if ( !TileFormat::decode(data.data(), data.size(), tile) )
+            return 0L;
+
+        osg::Node* node = readCompact(tile, session, settings, readOptions);
+        if ( node )
+        {
+            if ( metadata )
+                metadata->fromJSON( tile.metadata );
+            if ( needsPostProcess )
+                *needsPostProcess = true;
         }
-        //OE_INFO << LC << "Cached stateset for texture " << skin->getName() << "\n";
+        return node;
     }
+
+    // the writer may be serializing the queued graph right now, so the scene
+    // gets a copy of it, with the shared textures swapped back in like a tile
+    // read from the cache.
+    Config pendingMetadata;
+    osg::ref_ptr<osg::Node> pending = _cacheWriter->getPendingNode(cacheKey, pendingMetadata);
+    if ( pending.valid() )
+    {
+        if ( metadata )
+            *metadata = pendingMetadata;
+        osg::ref_ptr<osg::Node> node = copyForCache( pending.get() );
+        _texCache->consolidate( node.get() );
+        return node.release();
+    }
+
+    return 0L;
+}
+
+bool
+CompilerOutput::readCacheMetadata(const osgDB::Options* readOptions, Config& metadata) const
+{
+    CacheSettings* cacheSettings = CacheSettings::get(readOptions);
+
+    if ( !cacheSettings || !cacheSettings->getCacheBin() )
+        return false;
+
+    std::string cacheKey = createCacheKey();
+    if (cacheKey.empty())
+        return false;
+
+    // a tile still in the write queue is newer than what's on disk.
+    if ( _cacheWriter.valid() )
+    {
+        std::string data, json;
+        if ( _tileStore.valid() && _cacheWriter->getPendingCompact(cacheKey, data) &&
+             TileFormat::readMetadata(data.data(), data.size(), json) )
+        {
+            metadata = Config();
+            metadata.fromJSON( json );
+            return true;
+        }
+
+        if ( _cacheWriter->getPendingNode(cacheKey, metadata).valid() )
+            return true;
+    }
+
+    if ( _tileStore.valid() )
+    {
+        osg::ref_ptr<TileBlob> blob = _tileStore->read(cacheKey);
+        std::string json;
+        if ( blob.valid() && TileFormat::readMetadata(blob->data(), blob->size(), json) )
+        {
+            metadata = Config();
+            metadata.fromJSON( json );
+            return true;
+        }
+    }
+
+    osgEarth::ReadResult result = cacheSettings->getCacheBin()->readObject(cacheKey, readOptions);
+    if ( result.succeeded() )
+    {
+        metadata = result.metadata();
+        return true;
+    }
+
+    return false;
+}
+
+osg::Node*
+CompilerOutput::readCompact(const TileFormat::Tile&  tile,
+                            Session*                session,
+                            const CompilerSettings& settings,
+                            const osgDB::Options*   readOptions) const
+{
+    osg::ref_ptr<osg::MatrixTransform> root = new osg::MatrixTransform( tile.localToWorld );
+
+    TaggedGeodes geodes;
+    for(std::vector<TileFormat::Geometry>::const_iterator g = tile.geometries.begin(); g != tile.geometries.end(); ++g)
+    {
+        osg::ref_ptr<osg::StateSet> stateSet;
+        if ( g->stateKey == ARRAY_STATE_KEY )
+        {
+            stateSet = _skinTextureArray.valid() ? _skinTextureArray->getStateSet() : 0L;
+        }
+        else if ( !g->stateKey.empty() )
+        {
+            stateSet = _texCache->getSkinStateSet(g->stateKey, readOptions);
+        }
+
+        // a texture we can't restore means the tile has to be built again.
+        if ( !g->stateKey.empty() && !stateSet.valid() )
+        {
+            OE_DEBUG << LC << "Tile " << _name << ": no texture for \"" << g->stateKey << "\"\n";
+            return 0L;
+        }
+
+        osg::Geometry* geom = TileFormat::createGeometry( *g );
+        if ( stateSet.valid() )
+            geom->setStateSet( stateSet.get() );
+
+        osg::ref_ptr<osg::Geode>& geode = geodes[g->tag];
+        if ( !geode.valid() )
+        {
+            geode = new osg::Geode();
+        }
+        geode->addDrawable( geom );
+    }
+
+    osg::LOD* geodeLOD = createGeodeLOD( geodes, settings );
+    if ( geodeLOD )
+    {
+        root->addChild( geodeLOD );
+    }
+
+    InstanceMap instanceMap;
+    for(std::vector<TileFormat::Instances>::const_iterator i = tile.instances.begin(); i != tile.instances.end(); ++i)
+    {
+        ModelResource* model = findModel( i->modelName, session, _protoCache.get(), readOptions );
+        if ( !model )
+        {
+            OE_DEBUG << LC << "Tile " << _name << ": unknown model \"" << i->modelName << "\"\n";
+            return 0L;
+        }
+
+        Instances& instances = instanceMap[model];
+        instances.matrices.reserve( i->count );
+        for(unsigned k=0; k<i->count; ++k)
+        {
+            instances.matrices.push_back( osg::Matrix(osg::Matrixf(i->matrices + 16*k)) );
+        }
+    }
+
+    unsigned numInstances = 0u;
+    double shaderGenSaved = 0.0;
+    osg::Node* instances = createInstances( instanceMap, session, settings, readOptions, numInstances, shaderGenSaved );
+    if ( instances )
+    {
+        root->addChild( instances );
+    }
+
+    return root.release();
+}
+
+osg::ref_ptr<osg::StateSet>
+CompilerOutput::getSkinStateSet(SkinResource* skin, const osgDB::Options* readOptions)
+{
+    if ( _skinTextureArray.valid() && _skinTextureArray->contains(skin) )
+    {
+        return _skinTextureArray->getStateSet();
+    }
+
+    bool reused = false;
+    osg::ref_ptr<osg::StateSet> ss = _texCache->getSkinStateSet(skin, readOptions, reused);
+    if (reused)
+        ++_numSkinStateSetsReused;
     return ss;
 }
 
@@ -211,11 +660,151 @@ CompilerOutput::writeToCache(osg::Node* node, const osgDB::Options* writeOptions
     if (cacheKey.empty())
         return;
 
-    cacheSettings->getCacheBin()->writeNode(cacheKey, node, Config(), writeOptions);
+    if ( _tileStore.valid() )
+    {
+        OE_START_TIMER(compact);
+        std::string data;
+        std::set<std::string> imageURIs;
+        if ( encodeCompact(node, data, &imageURIs) )
+        {
+            // keep the bytes, so the caller needn't encode the tile again.
+            _compactSource = new BufferTileBlob( data, (TimeStamp)::time(0L) );
+
+            // With a texture store, the textures are stored and the tile is
+            // pointed at their content keys before it's written; that reads
+            // the image files, so the cache writer does it off this thread.
+            // For the footprint stats, the tile's texture references count once
+            // it's written: what the tile would weigh carrying its textures.
+            TextureStore* textureStore = _texCache->getTextureStore();
+            bool written = true;
+            if ( _cacheWriter.valid() )
+            {
+                _cacheWriter->writeCompact( _tileStore.get(), cacheKey, data, textureStore, imageURIs );
+            }
+            else
+            {
+                std::set<std::string> contentKeys;
+                std::string stored = data;
+                written =
+                    (!textureStore || textureStore->putTextures(imageURIs, stored, contentKeys)) &&
+                    _tileStore->write( cacheKey, stored.data(), stored.size() );
+                if ( written && textureStore )
+                {
+                    for(std::set<std::string>::const_iterator k = contentKeys.begin(); k != contentKeys.end(); ++k)
+                        textureStore->addReference( *k );
+                }
+            }
+
+            if ( written )
+            {
+                if ( progress && progress->collectStats() )
+                    progress->stats("cache.writeCompact") = OE_GET_TIMER(compact);
+
+                OE_INFO << LC << (_cacheWriter.valid() ? "Queued " : "Wrote ") << _name << " to the tile store (key = " << cacheKey << ")\n";
+                return;
+            }
+        }
+    }
+
+    // The writer serializes the node later, after the tile is in the scene,
+    // so it gets a copy of its own. Object IDs are only valid in this
+    // session's feature index, so the cached tile goes without them.
+    osg::ref_ptr<osg::Node> copy = node;
+    if ( _cacheWriter.valid() || _index )
+    {
+        copy = copyForCache( node );
+        if ( _index )
+        {
+            RemoveObjectIDs removeObjectIDs;
+            copy->accept( removeObjectIDs );
+        }
+    }
+
+    if ( _cacheWriter.valid() )
+    {
+        _cacheWriter->writeNode(cacheSettings->getCacheBin(), cacheKey, copy.get(), _dependencies.getConfig(), writeOptions);
+        OE_INFO << LC << "Queued " << _name << " for the cache (key = " << cacheKey << ")\n";
+        return;
+    }
+
+    cacheSettings->getCacheBin()->writeNode(cacheKey, copy.get(), _dependencies.getConfig(), writeOptions);
 
     OE_INFO << LC << "Wrote " << _name << " to cache (key = " << cacheKey << ")\n";
 }
 
+bool
+CompilerOutput::encodeCompact(osg::Node* node, std::string& data, std::set<std::string>* imageURIs) const
+{
+    osg::MatrixTransform* root = dynamic_cast<osg::MatrixTransform*>(node);
+    if ( !root )
+        return false;
+
+    // external models and debug geometry only exist as scene graph.
+    if ( _externalModelsGroup->getNumChildren() > 0 || _debugGroup->getNumChildren() > 0 )
+        return false;
+
+    TileFormat::Writer writer( root->getMatrix() );
+    writer.setMetadata( _dependencies.getConfig().toJSON(false) );
+
+    const osg::Texture* arrayTexture = _skinTextureArray.valid() ? _skinTextureArray->getTexture() : 0L;
+
+    for(unsigned c=0; c<root->getNumChildren(); ++c)
+    {
+        osg::Node* child = root->getChild(c);
+
+        if ( child->getName() == GEODES_ROOT )
+        {
+            osg::Group* geodeLOD = child->asGroup();
+            for(unsigned g=0; g<geodeLOD->getNumChildren(); ++g)
+            {
+                osg::Geode* geode = geodeLOD->getChild(g)->asGeode();
+                if ( !geode )
+                    return false;
+
+                for(unsigned d=0; d<geode->getNumDrawables(); ++d)
+                {
+                    const osg::Geometry* geom = geode->getDrawable(d)->asGeometry();
+                    std::string stateKey;
+                    if ( !geom || !getStateKey(geom->getStateSet(), arrayTexture, stateKey) )
+                    {
+                        return false;
+                    }
+
+                    // textures are referred to by image URI for now; a texture
+                    // store may swap in content keys (TextureStore::putTextures).
+                    if ( imageURIs && !stateKey.empty() && stateKey != ARRAY_STATE_KEY )
+                    {
+                        imageURIs->insert( stateKey );
+                    }
+
+                    if ( !writer.addGeometry(geode->getName(), stateKey, geom) )
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        else if ( child->getName() != INSTANCES_ROOT )
+        {
+            return false;
+        }
+    }
+
+    // Instances are stored as the matrices they were built from; reading the tile
+    // builds them again from the shared prototypes.
+    for(InstanceMap::const_iterator i = _instances.begin(); i != _instances.end(); ++i)
+    {
+        const std::string& name = i->first->name();
+        if ( name.empty() || _protoCache->findModel(name) != i->first.get() )
+            return false;
+
+        writer.addInstances( name, i->second.matrices );
+    }
+
+    data = writer.finish();
+    return true;
+}
+
 osg::Node*
 CompilerOutput::createSceneGraph(Session*                session,
                                  const CompilerSettings& settings,
@@ -227,178 +816,437 @@ CompilerOutput::createSceneGraph(Session*                session,
     // install the master matrix for this graph:
     osg::ref_ptr<osg::MatrixTransform> root = new osg::MatrixTransform( getLocalToWorld() );
 
-    // tagged geodes:
-    if ( !_geodes.empty() )
+    unsigned clusterBudget = settings.clusterVertexBudget().get();
+
+    // Merge the drawables that were added individually. Pooled geometry is
+    // already merged and clustered, so only the geodes holding loose
+    // drawables are merged, and before the clusters join them; merging
+    // those would glue the clusters back into one tile-sized drawable.
+    // NOTE: be careful; don't mess with state during optimization.
+    OE_START_TIMER(optimize);
+    if ( _numLooseDrawables > 0u )
     {
-        // The Geode LOD holds each geode in its range.
-        osg::LOD* geodeLOD = new osg::LOD();
-        geodeLOD->setName(GEODES_ROOT);
-        root->addChild( geodeLOD );
+        // because the default merge limit is 10000 and there's no other way to change it
+        osgUtil::Optimizer::MergeGeometryVisitor mergeGeometry;
+        mergeGeometry.setTargetMaximumNumberOfVertices( clusterBudget > 0u ? clusterBudget : MAX_VERTS_PER_POOL );
+        for(TaggedGeodes::const_iterator g = _geodes.begin(); g != _geodes.end(); ++g)
+        {
+            g->second->accept( mergeGeometry );
+        }
+    }
+    double optimizeTime = OE_GET_TIMER(optimize);
 
-        const GeoCircle bc = _key.getExtent().computeBoundingGeoCircle();
+    // turn the geometry pools into drawables, each pool clustered spatially
+    // under the vertex budget so the clusters can be culled separately:
+    OE_START_TIMER(pools);
+    TaggedGeodes geodes = _geodes;
+    unsigned numClusters = 0u;
+    std::vector< osg::ref_ptr<osg::Geometry> > clusters;
+    _objectIDs.assign( _features.size(), 0u );
+    for(TaggedPools::const_iterator p = _allPools.begin(); p != _allPools.end(); ++p)
+    {
+        const GeometryPool* pool = p->second.get();
+        if ( pool->getNumIndices() == 0u )
+            continue;
 
-        for(TaggedGeodes::const_iterator g = _geodes.begin(); g != _geodes.end(); ++g)
+        osg::ref_ptr<osg::Geode>& geode = geodes[p->first];
+        if ( !geode.valid() )
+        {
+            geode = new osg::Geode();
+        }
+
+        clusters.clear();
+        pool->createGeometries( clusterBudget, clusters );
+        numClusters += clusters.size();
+
+        for(unsigned c=0; c<clusters.size(); ++c)
         {
-            const std::string& tag = g->first;
-            const CompilerSettings::LODBin* bin = settings.getLODBin(tag);
-            //float minRange = bin && bin->minLodScale > 0.0f? g->second->getBound().radius() + _range*bin->minLodScale : 0.0f;
-            //float maxRange = bin ? g->second->getBound().radius() + _range*bin->lodScale : FLT_MAX;
-            float minRange = bin && bin->minLodScale > 0.0f? bc.getRadius() + _range*bin->minLodScale : 0.0f;
-            float maxRange = bin ? bc.getRadius() + _range*bin->lodScale : FLT_MAX;
-            geodeLOD->addChild( g->second.get(), minRange, maxRange );
+            if ( !_features.empty() )
+                tagObjectIDs( clusters[c].get() );
+            geode->addDrawable( clusters[c].get() );
         }
     }
+    double poolsTime = OE_GET_TIMER(pools);
+
+    // tagged geodes:
+    osg::LOD* geodeLOD = createGeodeLOD( geodes, settings );
+    if ( geodeLOD )
+    {
+        root->addChild( geodeLOD );
+    }
 
     if ( _externalModelsGroup->getNumChildren() > 0 )
     {
         root->addChild( _externalModelsGroup.get() );
     }
-    
-    // Run an optimization pass before adding any debug data or models
-    // NOTE: be careful; don't mess with state during optimization.
-    OE_START_TIMER(optimize);
+
+    // Final index stage for the building geometry (not the instanced models):
+    // single primitive set, exact index width, vertex cache order.
+    OE_START_TIMER(indices);
+    IndexOptimizer::Stats indexStats;
+    if ( geodeLOD && settings.optimizeIndices() == true )
     {
-        // because the default merge limit is 10000 and there's no other way to change it
-        osgUtil::Optimizer::MergeGeometryVisitor mergeGeometry;
-        mergeGeometry.setTargetMaximumNumberOfVertices( 250000u );
-        root->accept( mergeGeometry );
+        IndexOptimizer::optimize( geodeLOD, &indexStats );
     }
-    double optimizeTime = OE_GET_TIMER(optimize);
+    double indicesTime = OE_GET_TIMER(indices);
 
     
     // install the model instances, creating one instance group for each model.
     OE_START_TIMER(instances);
-    if (!_instances.empty())
+    unsigned numInstances = 0u;
+    double shaderGenSaved = 0.0;
+    osg::Node* instances = createInstances( _instances, session, settings, readOptions, numInstances, shaderGenSaved );
+    if ( instances )
+    {
+        root->addChild( instances );
+    }
+    double instanceTime = OE_GET_TIMER(instances);
+
+    if ( progress && progress->collectStats() )
+    {
+        progress->stats("out.pools"    ) = poolsTime;
+        progress->stats("# clusters"   ) = numClusters;
+        progress->stats("out.optimize" ) = optimizeTime;
+        progress->stats("out.indices"  ) = indicesTime;
+        progress->stats("# index KB"   ) = (double)(indexStats.indexBytes/1024u);
+        progress->stats("# ACMR before") = indexStats.getACMRBefore();
+        progress->stats("# ACMR after" ) = indexStats.getACMRAfter();
+        progress->stats("out.instances") = instanceTime;
+        progress->stats("# instances"  ) = numInstances;
+        progress->stats("# skin stateSets reused") = _numSkinStateSetsReused;
+        progress->stats("out.shaderGenSaved") = shaderGenSaved;
+        progress->stats("out.total")     = OE_GET_TIMER(total);
+    }
+
+    return root.release();
+}
+
+osg::LOD*
+CompilerOutput::createGeodeLOD(const TaggedGeodes& geodes, const CompilerSettings& settings) const
+{
+    if ( geodes.empty() )
+        return 0L;
+
+    // The Geode LOD holds each geode in its range.
+    osg::LOD* geodeLOD = new osg::LOD();
+    geodeLOD->setName(GEODES_ROOT);
+
+    const GeoCircle bc = _key.getExtent().computeBoundingGeoCircle();
+
+    for(TaggedGeodes::const_iterator g = geodes.begin(); g != geodes.end(); ++g)
     {
+        const std::string& tag = g->first;
+
+        // the tag travels with the geode so the compact cache can restore its range.
+        g->second->setName( tag );
+
+        const CompilerSettings::LODBin* bin = settings.getLODBin(tag);
+        //float minRange = bin && bin->minLodScale > 0.0f? g->second->getBound().radius() + _range*bin->minLodScale : 0.0f;
+        //float maxRange = bin ? g->second->getBound().radius() + _range*bin->lodScale : FLT_MAX;
+        float minRange = bin && bin->minLodScale > 0.0f? bc.getRadius() + _range*bin->minLodScale : 0.0f;
+        float maxRange = bin ? bc.getRadius() + _range*bin->lodScale : FLT_MAX;
+        geodeLOD->addChild( g->second.get(), minRange, maxRange );
+    }
+
+    return geodeLOD;
+}
+
+osg::Node*
+CompilerOutput::createInstances(const InstanceMap&      instanceMap,
+                                Session*                session,
+                                const CompilerSettings& settings,
+                                const osgDB::Options*   readOptions,
+                                unsigned&               numInstances,
+                                double&                 shaderGenSaved) const
+{
+    if ( instanceMap.empty() )
+        return 0L;
+
 #ifdef USE_LODS
-        // group to hold all instanced models:
-        osg::LOD* instances = new osg::LOD();
+    // group to hold all instanced models:
+    osg::LOD* instances = new osg::LOD();
 #else
-        osg::Group* instances = new osg::Group();
+    osg::Group* instances = new osg::Group();
 #endif
-        instances->setName(INSTANCES_ROOT);
-
-        // keeps one copy of each instanced model per resource:
-        typedef std::map< ModelResource*, osg::ref_ptr<osg::Node> > ModelNodes;
-        ModelNodes modelNodes;
-
-        for(InstanceMap::const_iterator i = _instances.begin(); i != _instances.end(); ++i)
-        {
-            ModelResource* res = i->first.get();
-
-            // look up or create the node corresponding to this instance:
-            osg::ref_ptr<osg::Node>& modelNode = modelNodes[res];
-            if (!modelNode.valid())
-            {                
-                // Instance models use the GLOBAL resource cache, so that an instance model gets
-                // loaded only once. Then it's cloned for each tile. That way the shader generator
-                // will never touch live data. (Note that texture images are memory-cached in the
-                // readOptions.)
-                //
-                // TODO: even though the images are shared, the texture object itself is not.
-                // So it would be great to post-process this node and consolidate its texture
-                // references with those in the global texture cache, thereby reducing the GPU
-                // memory footprint.
-                if (!session->getResourceCache()->cloneOrCreateInstanceNode(res, modelNode, readOptions))
-                {
-                    OE_WARN << LC << "Failed to materialize resource " << res->uri()->full() << "\n";
-                }
-            }
-
-            if ( modelNode.valid() )
-            {
-                modelNode->setName(INSTANCE_MODEL);
+    instances->setName(INSTANCES_ROOT);
 
-                // remove any transforms since these will screw up instancing.
-                osgUtil::Optimizer optimizer;
-                optimizer.optimize(
-                    modelNode.get(),
-                    //optimizer.INDEX_MESH |
-                    optimizer.STATIC_OBJECT_DETECTION | optimizer.FLATTEN_STATIC_TRANSFORMS);
+    for(InstanceMap::const_iterator i = instanceMap.begin(); i != instanceMap.end(); ++i)
+    {
+        ModelResource* res = i->first.get();
 
-                osg::Group* modelGroup = new osg::Group();
-                modelGroup->setName(INSTANCE_MODEL_GROUP);
+        // The prototype is loaded, flattened, texture-consolidated and shader-generated
+        // once for all tiles; this tile only adds its instance data.
+        // Reusing a prototype saves the time its shader generation took.
+        double saved = 0.0;
+        osg::Node* proto = _protoCache->get(res, session, _texCache.get(), readOptions, &saved);
+        shaderGenSaved += saved;
 
-                // Build a normal scene graph based on MatrixTransforms, and then convert it 
-                // over to use instancing if it's available.
-                const MatrixVector& mats = i->second;
+        if ( proto )
+        {
+            // Give this tile its own nodes and geometry objects, sharing the arrays
+            // and state: instancing sets the instance count and bounds on the
+            // geometry, clustering parents the model under this tile's transforms
+            // and flattens it, and neither may touch the shared prototype while
+            // other pager threads use it.
+            osg::ref_ptr<osg::Node> modelNode = osg::clone(
+                proto,
+                osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES | osg::CopyOp::DEEP_COPY_PRIMITIVES );
+            modelNode->setName(INSTANCE_MODEL);
+
+            const MatrixVector& mats = i->second.matrices;
+            osg::Group* modelGroup = 0L;
+
+            if ( settings.useClustering() == true )
+            {
+                // Build a normal scene graph based on MatrixTransforms; postProcess
+                // will flatten it into clusters.
+                modelGroup = new osg::Group();
                 for(MatrixVector::const_iterator m = mats.begin(); m != mats.end(); ++m)
                 {
                     osg::MatrixTransform* modelxform = new osg::MatrixTransform( *m );
                     modelxform->addChild( modelNode.get() );
                     modelGroup->addChild( modelxform );
                 }
+            }
+            else
+            {
+                // Draw-instanced: the matrices go straight into the instance buffer,
+                // and object IDs (if indexing) into a per-instance attribute.
+                const std::vector<unsigned>& numbers = i->second.objectIDs;
+                std::vector<unsigned> objectIDs;
+                objectIDs.reserve( numbers.size() );
+                for(std::vector<unsigned>::const_iterator n = numbers.begin(); n != numbers.end(); ++n)
+                    objectIDs.push_back( *n > 0u && *n <= _objectIDs.size() ? _objectIDs[*n-1] : 0u );
+                modelGroup = Instancing::createInstancedGroup(
+                    modelNode.get(), mats, objectIDs.empty() ? 0L : &objectIDs );
+                if ( !objectIDs.empty() )
+                    tagInstances( modelGroup, numbers, objectIDs );
+            }
+
+            modelGroup->setName(INSTANCE_MODEL_GROUP);
+            numInstances += mats.size();
 
 #ifdef USE_LODS
-                // check for a display bin for this model resource:
-                const CompilerSettings::LODBin* bin = settings.getLODBin( res->tags() );
-                float lodScale = bin ? bin->lodScale : 1.0f;
+            // check for a display bin for this model resource:
+            const CompilerSettings::LODBin* bin = settings.getLODBin( res->tags() );
+            float lodScale = bin ? bin->lodScale : 1.0f;
 
-                float maxRange = _range*lodScale;
+            float maxRange = _range*lodScale;
 
-                // find the LOD range to add it to, or create a new one if neccesary:
-                bool added = false;
-                for(unsigned i=0; i<instances->getNumChildren() && !added; ++i)
+            // find the LOD range to add it to, or create a new one if neccesary:
+            bool added = false;
+            for(unsigned i=0; i<instances->getNumChildren() && !added; ++i)
+            {
+                if (instances->getMaxRange(i) == maxRange)
                 {
-                    if (instances->getMaxRange(i) == maxRange)
-                    {
-                        instances->getChild(i)->asGroup()->addChild(modelGroup);
-                        added = true;
-                    }
+                    instances->getChild(i)->asGroup()->addChild(modelGroup);
+                    added = true;
                 }
+            }
 
-                if (!added)
-                {
-                    osg::Group* parent = new osg::Group();
-                    instances->addChild(parent, 0.0, maxRange);
-                    parent->addChild( modelGroup );
-                }
+            if (!added)
+            {
+                osg::Group* parent = new osg::Group();
+                instances->addChild(parent, 0.0, maxRange);
+                parent->addChild( modelGroup );
+            }
 #else
-                instances->addChild( modelGroup );
+            instances->addChild( modelGroup );
 #endif
-            }
         }
-              
-        // finally add all the instance groups.
-        root->addChild( instances );
-    }
-    double instanceTime = OE_GET_TIMER(instances);
-
-    if ( progress && progress->collectStats() )
-    {
-        progress->stats("out.optimize" ) = optimizeTime;
-        progress->stats("out.instances") = instanceTime;
-        progress->stats("out.total")     = OE_GET_TIMER(total);
     }
 
-    return root.release();
+    return instances;
 }
 
 namespace
 {
     /**
-     * Performs all the shader component installation on the scene graph. 
-     * Once this is done the model is ready to render.
+     * One independent piece of post-processing. Tasks touch only their own
+     * subtree, so they can run concurrently and the result doesn't depend on
+     * the order in which they finish.
+     */
+    struct PostProcessTask : public WorkerPool::Task
+    {
+        std::string _name;
+        double _time;
+
+        PostProcessTask(const std::string& name) : _name(name), _time(0.0) { }
+
+        void run()
+        {
+            OE_START_TIMER(task);
+            process();
+            _time = OE_GET_TIMER(task);
+        }
+
+        virtual void process() =0;
+    };
+    typedef std::vector< osg::ref_ptr<PostProcessTask> > PostProcessTasks;
+
+    /** Runs the shader generator on a subtree. */
+    struct ShaderGenTask : public PostProcessTask
+    {
+        osg::ref_ptr<osg::Node> _node;
+        std::string _vpName;
+        osg::ref_ptr<StateSetCache> _sscache;
+
+        ShaderGenTask(const std::string& name, osg::Node* node, const std::string& vpName, StateSetCache* sscache) :
+            PostProcessTask(name), _node(node), _vpName(vpName), _sscache(sscache) { }
+
+        void process()
+        {
+            Registry::instance()->shaderGenerator().run(_node.get(), _vpName, _sscache.get());
+        }
+    };
+
+    /** Flattens a group of instance transforms into clusters, then generates shaders. */
+    struct FlattenTask : public PostProcessTask
+    {
+        osg::ref_ptr<osg::Group> _group;
+        optional<unsigned> _maxVerts;
+        osg::ref_ptr<StateSetCache> _sscache;
+
+        FlattenTask(const std::string& name, osg::Group* group, const optional<unsigned>& maxVerts, StateSetCache* sscache) :
+            PostProcessTask(name), _group(group), _maxVerts(maxVerts), _sscache(sscache) { }
+
+        void process()
+        {
+            if (_maxVerts.isSet())
+                osgEarth::Symbology::MeshFlattener::run(_group.get(), _maxVerts.get());
+            else
+                osgEarth::Symbology::MeshFlattener::run(_group.get());
+
+            // Generate shaders afterwards.
+            Registry::instance()->shaderGenerator().run(_group.get(), "Instances Root", _sscache.get());
+        }
+    };
+
+    /** Counts the vertices in a subgraph. */
+    struct CountVertices : public osg::NodeVisitor
+    {
+        unsigned _count;
+        CountVertices() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN), _count(0u) { }
+        void apply(osg::Geode& geode)
+        {
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if (geom && geom->getVertexArray())
+                    _count += geom->getVertexArray()->getNumElements();
+            }
+        }
+    };
+
+    /**
+     * Finds all the shader component installation work in the scene graph,
+     * as a list of independent tasks. Once the tasks run, the model is ready
+     * to render.
      */
     struct PostProcessNodeVisitor : public osg::NodeVisitor
     {
         osg::ref_ptr<StateSetCache> _sscache;
         unsigned _models, _instanceGroups, _geodes;
         bool _useDrawInstanced;
-        ProgressCallback* _progress;
         const CompilerSettings* _settings;
+        PostProcessTasks _tasks;
+        unsigned _numCells;
+        std::map<osg::Node*, unsigned> _modelVerts;
 
-        PostProcessNodeVisitor() : osg::NodeVisitor()
+        PostProcessNodeVisitor(StateSetCache* sscache) : osg::NodeVisitor()
         {
             setTraversalMode(TRAVERSE_ALL_CHILDREN);
             setNodeMaskOverride(~0);
 
-            _sscache = new StateSetCache();
+            // share states and generated shaders with other tiles if possible.
+            _sscache = sscache ? sscache : new StateSetCache();
 
             _models = 0;
             _instanceGroups = 0;
             _geodes = 0;
             _useDrawInstanced = false;
+            _numCells = 0;
+        }
+
+        unsigned getNumVertices(osg::Node* model)
+        {
+            std::map<osg::Node*, unsigned>::iterator i = _modelVerts.find(model);
+            if (i != _modelVerts.end())
+                return i->second;
+
+            CountVertices count;
+            if (model)
+                model->accept(count);
+            _modelVerts[model] = count._count;
+            return count._count;
+        }
+
+        /**
+         * Partitions the instance transforms under "group" into a regular grid
+         * of cells, sized so that a cell holds about "budget" vertices, and makes
+         * a flattening task for each cell. Cells are spatially compact, so the
+         * flattened clusters get tight bounds and cull well, and they flatten
+         * concurrently.
+         */
+        void addGridFlattenTasks(osg::Group* group, const std::string& name)
+        {
+            unsigned budget = _settings->maxVertsPerCluster().isSet() ?
+                _settings->maxVertsPerCluster().get() : DEFAULT_INSTANCE_CELL_VERTS;
+
+            std::vector< osg::ref_ptr<osg::MatrixTransform> > xforms;
+            osg::BoundingBox extent;
+            unsigned totalVerts = 0u;
+
+            for (unsigned i = 0; i < group->getNumChildren(); ++i)
+            {
+                osg::Group* modelGroup = group->getChild(i)->asGroup();
+                if (!modelGroup)
+                    continue;
+
+                for (unsigned k = 0; k < modelGroup->getNumChildren(); ++k)
+                {
+                    osg::MatrixTransform* xform = dynamic_cast<osg::MatrixTransform*>(modelGroup->getChild(k));
+                    if (!xform || xform->getNumChildren() == 0)
+                        continue;
+
+                    xforms.push_back(xform);
+                    extent.expandBy(xform->getMatrix().getTrans());
+                    totalVerts += getNumVertices(xform->getChild(0));
+                }
+            }
+
+            if (xforms.empty())
+                return;
+
+            unsigned numCells = osg::maximum(1u, (totalVerts + budget - 1u) / budget);
+            unsigned dim = (unsigned)ceil(sqrt((double)numCells));
+            float cellWidth  = (extent.xMax() - extent.xMin()) / (float)dim;
+            float cellHeight = (extent.yMax() - extent.yMin()) / (float)dim;
+
+            std::vector< osg::ref_ptr<osg::Group> > cells(dim*dim);
+            for (unsigned i = 0; i < xforms.size(); ++i)
+            {
+                const osg::Vec3d p = xforms[i]->getMatrix().getTrans();
+                unsigned cx = cellWidth  > 0.0f ? osg::minimum(dim-1u, (unsigned)((p.x() - extent.xMin()) / cellWidth)) : 0u;
+                unsigned cy = cellHeight > 0.0f ? osg::minimum(dim-1u, (unsigned)((p.y() - extent.yMin()) / cellHeight)) : 0u;
+
+                osg::ref_ptr<osg::Group>& cell = cells[cy*dim + cx];
+                if (!cell.valid())
+                    cell = new osg::Group();
+                cell->addChild(xforms[i].get());
+            }
+
+            group->removeChildren(0, group->getNumChildren());
+
+            for (unsigned c = 0; c < cells.size(); ++c)
+            {
+                if (cells[c].valid())
+                {
+                    group->addChild(cells[c].get());
+                    _tasks.push_back(new FlattenTask(name, cells[c].get(), budget, _sscache.get()));
+                    _numCells++;
+                }
+            }
         }
 
         void apply(osg::Node& node)
@@ -406,34 +1254,32 @@ namespace
             if (node.getName() == GEODES_ROOT)
             {
                 _geodes++;
-                Registry::instance()->shaderGenerator().run(&node, "Building geodes", _sscache.get());
+                _tasks.push_back(new ShaderGenTask("post.geodes", &node, "Building geodes", _sscache.get()));
                 // no traverse necessary
             }
 
             else if (node.getName() == INSTANCES_ROOT && _useDrawInstanced)
             {
-                DrawInstanced::install(node.getOrCreateStateSet());
+                Instancing::install(node.getOrCreateStateSet());
                 traverse(node);
             }
 
             else if (node.getName() == INSTANCE_MODEL_GROUP && _useDrawInstanced)
             {
+                // already instanced by createSceneGraph.
                 _instanceGroups++;
-                DrawInstanced::convertGraphToUseDrawInstanced(node.asGroup());
                 traverse(node);   
             }
             
             else if (node.getName() == INSTANCE_MODEL && _useDrawInstanced)
             {
+                // shaders were generated once, in the PrototypeCache.
                 _models++;
-                Registry::instance()->shaderGenerator().run(&node, "Resource Model", _sscache.get());
                 // no traverse necessary
             }
 
             else if (node.getName() == INSTANCES_ROOT && !_useDrawInstanced)
             {
-                OE_START_TIMER(clustering);
-
                 // Clustering:
                 osg::Group* group = node.asGroup();
 
@@ -442,22 +1288,24 @@ namespace
                 for (unsigned i = 0; i<group->getNumChildren(); ++i)
                 {
                     osg::Group* instanceGroup = group->getChild(i)->asGroup();
-                    
-                    if (_settings->maxVertsPerCluster().isSet())
-                        osgEarth::Symbology::MeshFlattener::run(instanceGroup, _settings->maxVertsPerCluster().get());
+                    if (!instanceGroup)
+                        continue;
+
+                    std::string name = Stringify() << "post.flatten." << i;
+
+                    if (_settings->gridInstanceClustering() == true)
+                    {
+                        addGridFlattenTasks(instanceGroup, name);
+                    }
                     else
-                        osgEarth::Symbology::MeshFlattener::run(instanceGroup);                        
+                    {
+                        _tasks.push_back(new FlattenTask(name, instanceGroup, _settings->maxVertsPerCluster(), _sscache.get()));
+                    }
                 }
 #else
-                osgEarth::Symbology::MeshFlattener::run(group);
+                _tasks.push_back(new FlattenTask("post.flatten", group, optional<unsigned>(), _sscache.get()));
 #endif
 
-                // Generate shaders afterwards.
-                Registry::instance()->shaderGenerator().run(&node, "Instances Root", _sscache.get());
-
-                if (_progress)
-                    _progress->stats("clustering") += OE_GET_TIMER(clustering);
-
                 // no traverse necessary
             }
 
@@ -474,9 +1322,39 @@ CompilerOutput::postProcess(osg::Node* graph, const CompilerSettings& settings,
 {
     if (!graph) return;
 
-    PostProcessNodeVisitor ppnv;
+    PostProcessNodeVisitor ppnv( _stateSetCache.get() );
     ppnv._useDrawInstanced = !settings.useClustering().get();
-    ppnv._progress = progress;
     ppnv._settings = &settings;
     graph->accept(ppnv);
+
+    PostProcessTasks& tasks = ppnv._tasks;
+
+    // Fan the independent subtrees out to the shared worker pool; this thread
+    // works too. Without a pool they run here, one after the other.
+    unsigned numThreads = _workerPool.valid() ? _workerPool->getNumThreads() + 1u : 1u;
+
+    OE_START_TIMER(postProcess);
+
+    if (_workerPool.valid())
+    {
+        WorkerPool::Tasks work(tasks.begin(), tasks.end());
+        _workerPool->run(work);
+    }
+    else
+    {
+        for (PostProcessTasks::iterator t = tasks.begin(); t != tasks.end(); ++t)
+            (*t)->run();
+    }
+
+    if (progress && progress->collectStats())
+    {
+        // per-subtree timings, in graph order:
+        for (PostProcessTasks::const_iterator t = tasks.begin(); t != tasks.end(); ++t)
+            progress->stats((*t)->_name) += (*t)->_time;
+
+        progress->stats("post.tasks") = OE_GET_TIMER(postProcess);
+        progress->stats("# post tasks") = tasks.size();
+        progress->stats("# post threads") = numThreads;
+        progress->stats("# instance cells") = ppnv._numCells;
+    }
 }
@@ -23,7 +23,23 @@ using namespace osgEarth::Buildings;
 
 CompilerSettings::CompilerSettings() :
 _rangeFactor  ( 6.0f ),
-_useClustering( false )
+_useClustering( false ),
+_useInstancedGableRoofs( false ),
+_useInstancedBoxes( false ),
+_useTextureArrays( false ),
+_maxTextureArraySize( 1024u ),
+_clusterVertexBudget( 16384u ),
+_optimizeIndices( true ),
+_postProcessThreads( 1u ),
+_gridInstanceClustering( true ),
+_tileCachePacked( false ),
+_cacheWriteQueueSize( 64u ),
+_memoryCacheSize( 64u ),
+_memoryCacheCompression( false ),
+_tileCacheCompression( "none" ),
+_tileCacheCompressionLevel( 3 ),
+_tileCacheDictionarySamples( 100u ),
+_textureCacheSize( 512u )
 {
     //nop
 }
@@ -31,6 +47,24 @@ _useClustering( false )
 CompilerSettings::CompilerSettings(const CompilerSettings& rhs) :
 _rangeFactor( rhs._rangeFactor ),
 _useClustering( rhs._useClustering ),
+_maxVertsPerCluster( rhs._maxVertsPerCluster ),
+_useInstancedGableRoofs( rhs._useInstancedGableRoofs ),
+_useInstancedBoxes( rhs._useInstancedBoxes ),
+_useTextureArrays( rhs._useTextureArrays ),
+_maxTextureArraySize( rhs._maxTextureArraySize ),
+_clusterVertexBudget( rhs._clusterVertexBudget ),
+_optimizeIndices( rhs._optimizeIndices ),
+_postProcessThreads( rhs._postProcessThreads ),
+_gridInstanceClustering( rhs._gridInstanceClustering ),
+_tileCachePath( rhs._tileCachePath ),
+_tileCachePacked( rhs._tileCachePacked ),
+_cacheWriteQueueSize( rhs._cacheWriteQueueSize ),
+_memoryCacheSize( rhs._memoryCacheSize ),
+_memoryCacheCompression( rhs._memoryCacheCompression ),
+_tileCacheCompression( rhs._tileCacheCompression ),
+_tileCacheCompressionLevel( rhs._tileCacheCompressionLevel ),
+_tileCacheDictionarySamples( rhs._tileCacheDictionarySamples ),
+_textureCacheSize( rhs._textureCacheSize ),
 _lodBins( rhs._lodBins )
 {
     //nop
@@ -71,7 +105,24 @@ CompilerSettings::getLODBin(const TagSet& tags) const
 
 
 CompilerSettings::CompilerSettings(const Config& conf) :
-_rangeFactor( 6.0f )
+_rangeFactor( 6.0f ),
+_useClustering( false ),
+_useInstancedGableRoofs( false ),
+_useInstancedBoxes( false ),
+_useTextureArrays( false ),
+_maxTextureArraySize( 1024u ),
+_clusterVertexBudget( 16384u ),
+_optimizeIndices( true ),
+_postProcessThreads( 1u ),
+_gridInstanceClustering( true ),
+_tileCachePacked( false ),
+_cacheWriteQueueSize( 64u ),
+_memoryCacheSize( 64u ),
+_memoryCacheCompression( false ),
+_tileCacheCompression( "none" ),
+_tileCacheCompressionLevel( 3 ),
+_tileCacheDictionarySamples( 100u ),
+_textureCacheSize( 512u )
 {
     const Config* bins = conf.child_ptr("bins");
     if ( bins )
@@ -87,6 +138,23 @@ _rangeFactor( 6.0f )
     conf.getIfSet("range_factor", _rangeFactor);
     conf.getIfSet("clustering", _useClustering);
     conf.getIfSet("max_verts_per_cluster", _maxVertsPerCluster);
+    conf.getIfSet("instanced_gable_roofs", _useInstancedGableRoofs);
+    conf.getIfSet("instanced_boxes", _useInstancedBoxes);
+    conf.getIfSet("texture_arrays", _useTextureArrays);
+    conf.getIfSet("max_texture_array_size", _maxTextureArraySize);
+    conf.getIfSet("cluster_vertex_budget", _clusterVertexBudget);
+    conf.getIfSet("optimize_indices", _optimizeIndices);
+    conf.getIfSet("post_process_threads", _postProcessThreads);
+    conf.getIfSet("grid_instance_clustering", _gridInstanceClustering);
+    conf.getIfSet("tile_cache_path", _tileCachePath);
+    conf.getIfSet("tile_cache_packed", _tileCachePacked);
+    conf.getIfSet("cache_write_queue_size", _cacheWriteQueueSize);
+    conf.getIfSet("memory_cache_size_mb", _memoryCacheSize);
+    conf.getIfSet("memory_cache_compression", _memoryCacheCompression);
+    conf.getIfSet("tile_cache_compression", _tileCacheCompression);
+    conf.getIfSet("tile_cache_compression_level", _tileCacheCompressionLevel);
+    conf.getIfSet("tile_cache_dictionary_samples", _tileCacheDictionarySamples);
+    conf.getIfSet("texture_cache_size_mb", _textureCacheSize);
 }
 
 Config
@@ -113,6 +181,23 @@ CompilerSettings::getConfig() const
     conf.addIfSet("range_factor", _rangeFactor);
     conf.addIfSet("clustering", _useClustering);
     conf.addIfSet("max_verts_per_cluster", _maxVertsPerCluster);
+    conf.addIfSet("instanced_gable_roofs", _useInstancedGableRoofs);
+    conf.addIfSet("instanced_boxes", _useInstancedBoxes);
+    conf.addIfSet("texture_arrays", _useTextureArrays);
+    conf.addIfSet("max_texture_array_size", _maxTextureArraySize);
+    conf.addIfSet("cluster_vertex_budget", _clusterVertexBudget);
+    conf.addIfSet("optimize_indices", _optimizeIndices);
+    conf.addIfSet("post_process_threads", _postProcessThreads);
+    conf.addIfSet("grid_instance_clustering", _gridInstanceClustering);
+    conf.addIfSet("tile_cache_path", _tileCachePath);
+    conf.addIfSet("tile_cache_packed", _tileCachePacked);
+    conf.addIfSet("cache_write_queue_size", _cacheWriteQueueSize);
+    conf.addIfSet("memory_cache_size_mb", _memoryCacheSize);
+    conf.addIfSet("memory_cache_compression", _memoryCacheCompression);
+    conf.addIfSet("tile_cache_compression", _tileCacheCompression);
+    conf.addIfSet("tile_cache_compression_level", _tileCacheCompressionLevel);
+    conf.addIfSet("tile_cache_dictionary_samples", _tileCacheDictionarySamples);
+    conf.addIfSet("texture_cache_size_mb", _textureCacheSize);
 
     return conf;
 }
@@ -0,0 +1,320 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "CompressedTileStore"
+#include <osgEarth/Notify>
+#include <osg/Timer>
+#include <cstring>
+
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+#  include <zstd.h>
+#  include <zdict.h>
+#endif
+
+#define LC "[CompressedTileStore] "
+
+// Key of the trained dictionary in the underlying store.
+#define DICTIONARY_KEY "zstd_dictionary"
+
+// Dictionary size; zstd's own default.
+#define DICTIONARY_CAPACITY (112u * 1024u)
+
+// Stop sampling after this much data, even if fewer tiles were seen.
+#define MAX_SAMPLE_BYTES (16u * 1024u * 1024u)
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    const char MAGIC[4] = { 'O', 'E', 'B', 'Z' };
+
+    enum Encoding
+    {
+        ENCODING_RAW  = 0u,
+        ENCODING_ZSTD = 1u
+    };
+
+    // Record header; 16 bytes, so the payload stays 4-byte aligned.
+    struct Header
+    {
+        char     magic[4];
+        unsigned encoding;
+        unsigned dictionaryID; // 0 = none
+        unsigned rawSize;
+    };
+
+    /** TileBlob referring to part of another blob. */
+    class TileBlobView : public TileBlob
+    {
+    public:
+        TileBlobView(TileBlob* parent, size_t offset) : _parent(parent)
+        {
+            _data = parent->data() + offset;
+            _size = parent->size() - offset;
+            _lastModified = parent->getLastModified();
+        }
+
+    protected:
+        virtual ~TileBlobView() { }
+        osg::ref_ptr<TileBlob> _parent;
+    };
+}
+
+CompressedTileStore::CompressedTileStore(TileStore* store, int level, unsigned dictionarySamples) :
+_store( store ),
+_level( level ),
+_dictionarySamples( dictionarySamples ),
+_trained( false ),
+_cdict( 0L ),
+_ddict( 0L )
+{
+    _stats.tilesWritten = 0u;
+    _stats.bytesIn = 0;
+    _stats.bytesOut = 0;
+    _stats.tilesRead = 0u;
+    _stats.bytesRead = 0;
+    _stats.bytesDecoded = 0;
+    _stats.decodeMillis = 0.0;
+    _stats.dictionaryID = 0u;
+
+    loadDictionary();
+}
+
+CompressedTileStore::~CompressedTileStore()
+{
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    ZSTD_freeCDict( (ZSTD_CDict*)_cdict );
+    ZSTD_freeDDict( (ZSTD_DDict*)_ddict );
+#endif
+}
+
+bool
+CompressedTileStore::isAvailable()
+{
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+CompressedTileStore::loadDictionary()
+{
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    osg::ref_ptr<TileBlob> blob = _store->read( DICTIONARY_KEY );
+    if ( !blob.valid() )
+        return;
+
+    _dictionary.assign( blob->data(), blob->size() );
+    _cdict = ZSTD_createCDict( _dictionary.data(), _dictionary.size(), _level );
+    _ddict = ZSTD_createDDict( _dictionary.data(), _dictionary.size() );
+    _stats.dictionaryID = ZSTD_getDictID_fromDict( _dictionary.data(), _dictionary.size() );
+    _trained = true;
+
+    OE_INFO << LC << "Using tile dictionary " << _stats.dictionaryID << "\n";
+#endif
+}
+
+void
+CompressedTileStore::addSample(const char* data, size_t size)
+{
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    std::string samples;
+    std::vector<size_t> sampleSizes;
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        if ( _trained )
+            return;
+
+        _samples.append( data, size );
+        _sampleSizes.push_back( size );
+
+        if ( _sampleSizes.size() < _dictionarySamples && _samples.size() < MAX_SAMPLE_BYTES )
+            return;
+
+        // enough; train once, outside the lock.
+        _trained = true;
+        samples.swap( _samples );
+        sampleSizes.swap( _sampleSizes );
+    }
+
+    std::string dictionary( DICTIONARY_CAPACITY, '\0' );
+    size_t result = ZDICT_trainFromBuffer(
+        &dictionary[0], dictionary.size(),
+        samples.data(), &sampleSizes[0], (unsigned)sampleSizes.size() );
+
+    if ( ZDICT_isError(result) )
+    {
+        OE_WARN << LC << "Failed to train a tile dictionary: " << ZDICT_getErrorName(result) << "\n";
+        return;
+    }
+    dictionary.resize( result );
+
+    if ( !_store->write(DICTIONARY_KEY, dictionary.data(), dictionary.size()) )
+        return;
+
+    Threading::ScopedMutexLock lock(_mutex);
+    _dictionary.swap( dictionary );
+    _cdict = ZSTD_createCDict( _dictionary.data(), _dictionary.size(), _level );
+    _ddict = ZSTD_createDDict( _dictionary.data(), _dictionary.size() );
+    _stats.dictionaryID = ZSTD_getDictID_fromDict( _dictionary.data(), _dictionary.size() );
+
+    OE_INFO << LC << "Trained tile dictionary " << _stats.dictionaryID
+        << " (" << _dictionary.size() << " bytes) from " << sampleSizes.size() << " tiles\n";
+#endif
+}
+
+bool
+CompressedTileStore::write(const std::string& key, const char* data, size_t size)
+{
+    Header header;
+    ::memcpy( header.magic, MAGIC, sizeof(MAGIC) );
+    header.encoding = ENCODING_RAW;
+    header.dictionaryID = 0u;
+    header.rawSize = (unsigned)size;
+
+    std::string record( sizeof(Header), '\0' );
+
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    if ( _dictionarySamples > 0u )
+    {
+        addSample( data, size );
+    }
+
+    const ZSTD_CDict* cdict;
+    unsigned dictionaryID;
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        cdict = (const ZSTD_CDict*)_cdict;
+        dictionaryID = _stats.dictionaryID;
+    }
+
+    size_t bound = ZSTD_compressBound( size );
+    record.resize( sizeof(Header) + bound );
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    size_t result = cdict ?
+        ZSTD_compress_usingCDict( cctx, &record[sizeof(Header)], bound, data, size, cdict ) :
+        ZSTD_compressCCtx( cctx, &record[sizeof(Header)], bound, data, size, _level );
+    ZSTD_freeCCtx( cctx );
+
+    if ( !ZSTD_isError(result) && result < size )
+    {
+        header.encoding = ENCODING_ZSTD;
+        header.dictionaryID = cdict ? dictionaryID : 0u;
+        record.resize( sizeof(Header) + result );
+    }
+    else
+#endif
+    {
+        // doesn't compress; store it as is.
+        record.resize( sizeof(Header) );
+        record.append( data, size );
+    }
+
+    ::memcpy( &record[0], &header, sizeof(Header) );
+
+    if ( !_store->write(key, record.data(), record.size()) )
+        return false;
+
+    Threading::ScopedMutexLock lock(_mutex);
+    _stats.tilesWritten++;
+    _stats.bytesIn += size;
+    _stats.bytesOut += record.size();
+    return true;
+}
+
+TileBlob*
+CompressedTileStore::read(const std::string& key)
+{
+    osg::ref_ptr<TileBlob> blob = _store->read( key );
+    if ( !blob.valid() )
+        return 0L;
+
+    Header header;
+    if ( blob->size() < sizeof(Header) )
+        return 0L;
+    ::memcpy( &header, blob->data(), sizeof(Header) );
+    if ( ::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 )
+        return 0L;
+
+    if ( header.encoding == ENCODING_RAW )
+    {
+        return new TileBlobView( blob.get(), sizeof(Header) );
+    }
+
+#ifdef OSGEARTH_BUILDINGS_HAVE_ZSTD
+    if ( header.encoding == ENCODING_ZSTD )
+    {
+        const ZSTD_DDict* ddict = 0L;
+        if ( header.dictionaryID != 0u )
+        {
+            Threading::ScopedMutexLock lock(_mutex);
+            if ( header.dictionaryID == _stats.dictionaryID )
+                ddict = (const ZSTD_DDict*)_ddict;
+        }
+
+        if ( header.dictionaryID != 0u && !ddict )
+        {
+            OE_DEBUG << LC << "Tile " << key << " needs dictionary " << header.dictionaryID << ", which isn't loaded\n";
+            return 0L;
+        }
+
+        osg::Timer_t start = osg::Timer::instance()->tick();
+
+        std::string buffer( header.rawSize, '\0' );
+        const char* src = blob->data() + sizeof(Header);
+        size_t srcSize = blob->size() - sizeof(Header);
+
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        size_t result = ddict ?
+            ZSTD_decompress_usingDDict( dctx, &buffer[0], buffer.size(), src, srcSize, ddict ) :
+            ZSTD_decompressDCtx( dctx, &buffer[0], buffer.size(), src, srcSize );
+        ZSTD_freeDCtx( dctx );
+
+        if ( ZSTD_isError(result) || result != header.rawSize )
+        {
+            OE_WARN << LC << "Tile " << key << " is corrupt; ignoring it\n";
+            return 0L;
+        }
+
+        double millis = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() );
+        {
+            Threading::ScopedMutexLock lock(_mutex);
+            _stats.tilesRead++;
+            _stats.bytesRead += blob->size();
+            _stats.bytesDecoded += buffer.size();
+            _stats.decodeMillis += millis;
+        }
+
+        return new BufferTileBlob( buffer, blob->getLastModified() );
+    }
+#endif
+
+    OE_DEBUG << LC << "Tile " << key << " has an unsupported encoding\n";
+    return 0L;
+}
+
+CompressedTileStore::Stats
+CompressedTileStore::getStats() const
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    return _stats;
+}
@@ -37,7 +37,8 @@ _color             ( Color::White ),
 _cosR              ( 1.0f ),
 _sinR              ( 0.0f ),
 _parent            ( 0L ),
-_renderAABB        ( false )
+_renderAABB        ( false ),
+_isRectangle       ( false )
 {
     //nop
 }
@@ -58,6 +59,7 @@ _sinR            ( rhs._sinR ),
 _aabb            ( rhs._aabb ),
 _parent          ( rhs._parent ),
 _renderAABB      ( rhs._renderAABB ),
+_isRectangle     ( false ),
 _tag             ( rhs._tag ),
 _longEdgeMidpoint( rhs._longEdgeMidpoint ),
 _longEdgeInsideNormal( rhs._longEdgeInsideNormal )
@@ -143,37 +145,38 @@ Elevation::build(const Polygon* in_footprint, BuildContext& bc)
     if ( !in_footprint || !in_footprint->isValid() )
         return false;
 
+    const Polygon* footprint = prepareFootprint( in_footprint, bc );
+
+    return buildImpl( footprint, bc );
+}
+
+const Polygon*
+Elevation::prepareFootprint(const Polygon* in_footprint, BuildContext& bc)
+{
     const Polygon* footprint = in_footprint;
 
-    // For simplification we replace the footprint with its rotated bounding box:
-    osg::ref_ptr<Polygon> box;
+    // For simplification we replace the footprint with its rotated bounding box.
+    // (A near-rectangle keeps its own corners; it takes the fast path as is.)
     if ( getRenderAsBox() )
     {
-        calculateRotations( in_footprint );
-        if ( _aabb.valid() )
+        const Polygon* box = bc.getFootprintAnalysis( footprint )->getBox();
+        if ( box )
         {
-            box = new Polygon();
-            osg::Vec3d p;
-            p.set( _aabb.xMin(), _aabb.yMin(), 0.0f ); unrotate(p); box->push_back(p);
-            p.set( _aabb.xMax(), _aabb.yMin(), 0.0f ); unrotate(p); box->push_back(p);
-            p.set( _aabb.xMax(), _aabb.yMax(), 0.0f ); unrotate(p); box->push_back(p);
-            p.set( _aabb.xMin(), _aabb.yMax(), 0.0f ); unrotate(p); box->push_back(p);
-            footprint = box.get();
+            footprint = box;
         }
     }
 
-    // Buffer the footprint if necessary to apply an inset:
+    // Offset the footprint if necessary to apply an inset:
     if ( getInset() != 0.0f )
     {
-        osg::ref_ptr<Geometry> inset;
-        BufferParameters bp( BufferParameters::CAP_DEFAULT, BufferParameters::JOIN_MITRE );
-        if ( footprint->buffer(-getInset(), inset, bp) )
+        const Polygon* inset = bc.getFootprintAnalysis( footprint )->getOffset( getInset() );
+        if ( inset )
         {
-            return buildImpl( dynamic_cast<Polygon*>(inset.get()), bc );
+            footprint = inset;
         }
     }
 
-    return buildImpl( footprint, bc );
+    return footprint;
 }
 
 bool
@@ -188,7 +191,9 @@ Elevation::buildImpl(const Polygon* footprint, BuildContext& bc)
     _walls.clear();
 
     /** calculates the rotation based on the footprint */
-    calculateRotations( footprint );
+    FootprintAnalysis* analysis = bc.getFootprintAnalysis( footprint );
+    calculateRotations( *analysis );
+    _isRectangle = analysis->isRectangle();
 
 #if 0
     // offsets: shift the coordinates relative to the dominant rotation angle:
@@ -229,7 +234,7 @@ Elevation::buildImpl(const Polygon* footprint, BuildContext& bc)
 
     // calcluate the bounds and the dominant rotation of the shape
     // based on the longest side.
-    Bounds bounds = footprint->getBounds();
+    const Bounds& bounds = analysis->getBounds();
 
     float aabbWidth = _aabb.xMax() - _aabb.xMin();
     float aabbHeight = _aabb.yMax() - _aabb.yMin();
@@ -461,47 +466,26 @@ Elevation::calculateRotations(const Polygon* footprint)
 {
     if ( footprint )
     {
-        // calculate the rotation data.
-        // looks for the longest segment in the footprint and
-        // returns the angle of that segment relative to north.
-        Segment n;
-        double  maxLen2 = 0.0;
-        ConstSegmentIterator i( footprint, true );
-        while( i.hasMore() )
-        {
-            Segment s = i.next();
-            double len2 = (s.second - s.first).length2();
-            if ( len2 > maxLen2 ) 
-            {
-                maxLen2 = len2;
-                n = s;
-            }
-        }
+        osg::ref_ptr<FootprintAnalysis> analysis = new FootprintAnalysis( footprint );
+        calculateRotations( *analysis );
+    }
+}
 
-        // swap coords if neceesary, so that p1 is always on the left.
-        const osg::Vec3d& p1 = n.first.x() < n.second.x() ? n.first : n.second;
-        const osg::Vec3d& p2 = n.first.x() < n.second.x() ? n.second : n.first;
-
-        // compute a rotation that will transform the long segment to be
-        // parallel to the Y axis.
-        float r = atan2( p2.x()-p1.x(), p2.y()-p1.y() );
-        _sinR = sinf( r );
-        _cosR = cosf( r );
-
-        // cache the midpoint of the longest segment, and the vector that
-        // points towards the inside of the polygon.
-        _longEdgeMidpoint = (p1+p2)*0.5;
-        _longEdgeInsideNormal = (n.second-n.first)^osg::Vec3d(0,0,-1);
-        _longEdgeInsideNormal.normalize();
-        
-        // compute the axis-aligned bbox
-        _aabb.init();
-        for(Polygon::const_iterator i = footprint->begin(); i != footprint->end(); ++i)
-        {
-            osg::Vec3f v(i->x(), i->y(), getTop());
-            rotate( v );
-            _aabb.expandBy( v );
-        }
+void
+Elevation::calculateRotations(const FootprintAnalysis& analysis)
+{
+    _sinR = analysis.getSinR();
+    _cosR = analysis.getCosR();
+    _longEdgeMidpoint = analysis.getLongEdgeMidpoint();
+    _longEdgeInsideNormal = analysis.getLongEdgeInsideNormal();
+
+    // the rotated bbox, raised to the top of this elevation
+    const osg::BoundingBox& rb = analysis.getRotatedBounds();
+    _aabb.init();
+    if ( rb.valid() )
+    {
+        _aabb.expandBy( osg::Vec3f(rb.xMin(), rb.yMin(), getTop()) );
+        _aabb.expandBy( osg::Vec3f(rb.xMax(), rb.yMax(), getTop()) );
     }
 }
 
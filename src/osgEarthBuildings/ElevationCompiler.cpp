@@ -17,8 +17,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "ElevationCompiler"
+#include "IndexOptimizer"
 #include <osgEarthFeatures/Session>
-#include <osgUtil/SmoothingVisitor>
+#include <osgEarth/StringUtils>
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
@@ -27,6 +28,27 @@ using namespace osgEarth::Buildings;
 
 #define LC "[ElevationCompiler] "
 
+namespace
+{
+    // Instanced boxes cannot scale their texture coordinates per building,
+    // so we quantize the texture repeats and make one prototype for each.
+    inline float quantizeRepeats(float r)
+    {
+        return std::max(1.0f, osg::round(r));
+    }
+}
+
+bool
+ElevationCompiler::isInstancedBox(const Elevation* elevation) const
+{
+    return
+        _useInstancedBoxes &&
+        elevation &&
+        elevation->getRenderAsBox() &&
+        elevation->getWalls().size() == 1 &&
+        elevation->getAxisAlignedBoundingBox().valid();
+}
+
 
 bool
 ElevationCompiler::compile(CompilerOutput&       output,
@@ -49,11 +71,14 @@ ElevationCompiler::compile(CompilerOutput&       output,
     // precalculate the frame transformation; combining these will
     // prevent any precision loss during the transform.
     osg::Matrix frame = building->getReferenceFrame() * world2local;
+
+    if ( isInstancedBox(elevation) )
+    {
+        return compileInstancedBox( output, elevation, frame, readOptions );
+    }
         
     SkinResource* skin = elevation->getSkinResource();
-    bool useTexture = skin != 0L;
     float texWidth = 0.0f;
-    float texHeight = 0.0f;
     osg::Vec2f texScale(1.0f, 1.0f);
     osg::Vec2f texBias (0.0f, 0.0f);
     float texLayer = 0.0f;
@@ -64,137 +89,83 @@ ElevationCompiler::compile(CompilerOutput&       output,
         stateSet = output.getSkinStateSet(skin, readOptions);
 
         texWidth = skin->imageWidth().get();
-        texHeight = skin->imageHeight().get();
         texScale.set(skin->imageScaleS().get(), skin->imageScaleT().get());
         texBias.set(skin->imageBiasS().get(), skin->imageBiasT().get());
         texLayer = skin->imageLayer().get();
     }
 
-    bool genColors  = false;
-    bool genNormals = false;
+    // Walls are white; the skin supplies the color.
+    const osg::Vec4f wallColor(1,1,1,1);
 
-    //TODO
-    Color upperWallColor = elevation->getColor();
-    Color lowerWallColor = elevation->getColor();
-    if ( !skin )
-        lowerWallColor = upperWallColor.brightness(0.95f);
+    // Adjacent faces meeting at less than this angle share a normal at their
+    // common corner (so curved walls look smooth).
+    const float smoothingCos = cosf( osg::DegreesToRadians(15.0f) );
 
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setUseVertexBufferObjects( true );
-    geom->setUseDisplayList( false );
+    // Write the walls straight into the pool for this tag and skin.
+    GeometryPool* pool = output.getGeometryPool( elevation->getTag(), stateSet.get() );
 
-    if ( stateSet.valid() )
-    {
-        geom->setStateSet( stateSet.get() );
-    }
+    unsigned numFloors = (unsigned)elevation->getNumFloors();
+    float floorHeight = elevation->getHeight() / (float)elevation->getNumFloors();
 
-    // Count the total number of verts.
-    unsigned totalNumVerts = 0;
+    // Count the quads so we can preallocate.
+    unsigned numQuads = 0;
     for(Elevation::Walls::const_iterator wall = walls.begin(); wall != walls.end(); ++wall)
     {
-        totalNumVerts += (6 * wall->getNumPoints());
-    }
-
-    totalNumVerts *= elevation->getNumFloors();
-    OE_DEBUG << LC << "Extrusion: total verts in elevation = " << totalNumVerts << "\n";
-
-    // preallocate all attribute arrays.
-    osg::Vec3Array* verts = new osg::Vec3Array();
-    geom->setVertexArray( verts );
-
-    osg::Vec4Array* colors = 0L;
-    if ( genColors )
-    {
-        colors = new osg::Vec4Array();
-        geom->setColorArray( colors );
-        geom->setColorBinding( geom->BIND_PER_VERTEX );
+        numQuads += wall->faces.size();
     }
+    numQuads *= numFloors;
+    pool->reserve( numQuads*4, numQuads*6 );
 
-    osg::Vec3Array* texCoords = 0L;
-    if ( skin )
-    {
-        texCoords = new osg::Vec3Array();
-        geom->setTexCoordArray( 0, texCoords );
-    }
-
-    osg::Vec3Array* normals = 0L;
-    if ( genNormals )
-    {
-        normals = new osg::Vec3Array();
-        geom->setNormalArray( normals );
-        geom->setNormalBinding( geom->BIND_PER_VERTEX );
-    }
-
-    unsigned vertPtr = 0;
-    //TODO
-    float  floorHeight = elevation->getHeight() / (float)elevation->getNumFloors();
-
-    OE_DEBUG << LC << "...elevation has " << walls.size() << " walls\n";
+    OE_DEBUG << LC << "...elevation has " << walls.size() << " walls and " << numFloors << " floors\n";
 
     // Each elevation is a collection of walls. One outer wall and
     // zero or more inner walls (where there were holes in the original footprint).
     for(Elevation::Walls::const_iterator wall = walls.begin(); wall != walls.end(); ++wall)
     {
-        osg::DrawElements* de = 
-            totalNumVerts > 0xFFFF ? (osg::DrawElements*) new osg::DrawElementsUInt  ( GL_TRIANGLES ) :
-            totalNumVerts > 0xFF   ? (osg::DrawElements*) new osg::DrawElementsUShort( GL_TRIANGLES ) :
-                                     (osg::DrawElements*) new osg::DrawElementsUByte ( GL_TRIANGLES );
-
-        // pre-allocate for speed
-        //de->reserveElements( numWallVerts );
-        geom->addPrimitiveSet( de );
-
-        OE_DEBUG << LC << "..elevation has " << elevation->getNumFloors() << " floors\n";
+        const Elevation::Faces& faces = wall->faces;
+        unsigned numFaces = faces.size();
+        if ( numFaces == 0 )
+            continue;
+
+        // Face normals in the output frame:
+        std::vector<osg::Vec3f> faceNormals( numFaces );
+        for(unsigned i=0; i<numFaces; ++i)
+        {
+            osg::Vec3d N = (faces[i].right.lower - faces[i].left.lower) ^ osg::Vec3d(0,0,1);
+            N = osg::Matrix::transform3x3( N, frame );
+            N.normalize();
+            faceNormals[i] = N;
+        }
 
-        float numFloorsF = (float)elevation->getNumFloors();
-            
-        for(unsigned flr=0; flr < elevation->getNumFloors(); ++flr)
+        for(unsigned flr=0; flr < numFloors; ++flr)
         {
             float lowerZ = (float)flr * floorHeight;
+            float upperZ = lowerZ + floorHeight;
     
-            OE_DEBUG << LC << "...wall has " << wall->faces.size() << " faces\n";
-            for(Elevation::Faces::const_iterator f = wall->faces.begin(); f != wall->faces.end(); ++f, vertPtr += 4)
+            for(unsigned i=0; i<numFaces; ++i)
             {
+                const Elevation::Face* f = &faces[i];
+
                 osg::Vec3d Lvec = f->left.upper - f->left.lower; Lvec.normalize();
                 osg::Vec3d Rvec = f->right.upper - f->right.lower; Rvec.normalize();
 
-                float upperZ = lowerZ + floorHeight;
-
                 osg::Vec3d LL = (f->left.lower  + Lvec*lowerZ) * frame;
                 osg::Vec3d UL = (f->left.lower  + Lvec*upperZ) * frame;
                 osg::Vec3d LR = (f->right.lower + Rvec*lowerZ) * frame;
                 osg::Vec3d UR = (f->right.lower + Rvec*upperZ) * frame;
 
-                verts->push_back( UL );
-                verts->push_back( LL );
-                verts->push_back( LR );
-                verts->push_back( UR );
-           
-#if 0
-                if ( anchors )
-                {
-                    float x = structure.baseCentroid.x(), y = structure.baseCentroid.y(), vo = structure.verticalOffset;
-
-                    (*anchors)[vertPtr+1].set( x, y, vo, Clamping::ClampToGround );
-                    (*anchors)[vertPtr+2].set( x, y, vo, Clamping::ClampToGround );
-                    (*anchors)[vertPtr+3].set( x, y, vo, Clamping::ClampToGround );
-
-                    (*anchors)[vertPtr+0].set( x, y, vo, Clamping::ClampToAnchor );
-                    (*anchors)[vertPtr+4].set( x, y, vo, Clamping::ClampToAnchor );
-                    (*anchors)[vertPtr+5].set( x, y, vo, Clamping::ClampToAnchor );
-                }
-#endif
-
-                // Assign wall polygon colors.
-                if ( colors )
+                // A rectangle has square corners; otherwise smooth shallow corners.
+                osg::Vec3f NL = faceNormals[i], NR = faceNormals[i];
+                if ( !elevation->isRectangle() )
                 {
-                    colors->push_back( upperWallColor );
-                    colors->push_back( lowerWallColor );
-                    colors->push_back( lowerWallColor );
-                    colors->push_back( upperWallColor );
+                    const osg::Vec3f& prevN = faceNormals[(i+numFaces-1)%numFaces];
+                    const osg::Vec3f& nextN = faceNormals[(i+1)%numFaces];
+                    if ( NL*prevN > smoothingCos ) { NL += prevN; NL.normalize(); }
+                    if ( NR*nextN > smoothingCos ) { NR += nextN; NR.normalize(); }
                 }
 
-                if ( texCoords )
+                osg::Vec3f texUL, texLL, texLR, texUR;
+                if ( pool->hasTexCoords() )
                 {
                     // Calculate the texture coordinates at each corner. The structure builder
                     // will have spaced the verts correctly for this to work.
@@ -206,29 +177,25 @@ ElevationCompiler::compile(CompilerOutput&       output,
                     if ( uR < uL || (uL == 0.0 && uR == 0.0))
                         uR = 1.0f;
 
-                    osg::Vec2f texLL( uL, 0.0f );
-                    osg::Vec2f texLR( uR, 0.0f );
-                    osg::Vec2f texUL( uL, 1.0f );
-                    osg::Vec2f texUR( uR, 1.0f );
-
-                    texUL = texBias + osg::componentMultiply(texUL, texScale);
-                    texUR = texBias + osg::componentMultiply(texUR, texScale);
-                    texLL = texBias + osg::componentMultiply(texLL, texScale);
-                    texLR = texBias + osg::componentMultiply(texLR, texScale);
-                        
-                    texCoords->push_back( osg::Vec3f(texUL.x(), texUL.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texLL.x(), texLL.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texLR.x(), texLR.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texUR.x(), texUR.y(), texLayer) );
+                    osg::Vec2f tLL = texBias + osg::componentMultiply(osg::Vec2f(uL, 0.0f), texScale);
+                    osg::Vec2f tLR = texBias + osg::componentMultiply(osg::Vec2f(uR, 0.0f), texScale);
+                    osg::Vec2f tUL = texBias + osg::componentMultiply(osg::Vec2f(uL, 1.0f), texScale);
+                    osg::Vec2f tUR = texBias + osg::componentMultiply(osg::Vec2f(uR, 1.0f), texScale);
+
+                    texUL.set( tUL.x(), tUL.y(), texLayer );
+                    texLL.set( tLL.x(), tLL.y(), texLayer );
+                    texLR.set( tLR.x(), tLR.y(), texLayer );
+                    texUR.set( tUR.x(), tUR.y(), texLayer );
                 }
 
+                unsigned vertPtr = pool->addVertex( UL, NL, wallColor, texUL );
+                pool->addVertex( LL, NL, wallColor, texLL );
+                pool->addVertex( LR, NR, wallColor, texLR );
+                pool->addVertex( UR, NR, wallColor, texUR );
+
                 // build the triangles.
-                de->addElement( vertPtr+0 );
-                de->addElement( vertPtr+1 );
-                de->addElement( vertPtr+2 );
-                de->addElement( vertPtr+0 );
-                de->addElement( vertPtr+2 );
-                de->addElement( vertPtr+3 );
+                pool->addTriangle( vertPtr+0, vertPtr+1, vertPtr+2 );
+                pool->addTriangle( vertPtr+0, vertPtr+2, vertPtr+3 );
 
             } // faces loop
 
@@ -236,18 +203,188 @@ ElevationCompiler::compile(CompilerOutput&       output,
 
     } // walls loop
 
-    // TODO - temporary, doesn't smooth disconnected edges
-    osgUtil::SmoothingVisitor::smooth( *geom.get(), 15.0f );
-    
-    if ( !genColors )
+    return true;
+}
+
+ModelResource*
+ElevationCompiler::getBoxPrototype(CompilerOutput&       output,
+                                   const Elevation*      elevation,
+                                   unsigned              numFloors,
+                                   const osg::Vec2f&     texRepeats,
+                                   const osgDB::Options* readOptions) const
+{
+    SkinResource* skin = elevation->getSkinResource();
+
+    std::string key = Stringify()
+        << "box:" << elevation->getTag()
+        << ":" << (skin ? skin->imageURI()->full() : "")
+        << ":" << numFloors
+        << ":" << texRepeats.x() << "x" << texRepeats.y();
+
+    // Use the same shared StateSet (or texture array) as the walls compiled
+    // into the pools. Get it before locking, since it may load the image.
+    osg::ref_ptr<osg::StateSet> stateSet;
+    if ( skin )
     {
-        colors = new osg::Vec4Array();
+        stateSet = output.getSkinStateSet(skin, readOptions);
+    }
+    bool textured =
+        stateSet.valid() &&
+        stateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE) != 0L;
+
+    Threading::ScopedMutexLock lock( _prototypesMutex );
+
+    osg::ref_ptr<ModelResource>& proto = _prototypes[key];
+    if ( !proto.valid() )
+    {
+        osg::Vec2f texScale(1.0f, 1.0f);
+        osg::Vec2f texBias (0.0f, 0.0f);
+        float texLayer = 0.0f;
+        if ( skin )
+        {
+            texScale.set(skin->imageScaleS().get(), skin->imageScaleT().get());
+            texBias.set(skin->imageBiasS().get(), skin->imageBiasT().get());
+            texLayer = skin->imageLayer().get();
+        }
+
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects( true );
+        geom->setUseDisplayList( false );
+
+        osg::Vec3Array* verts = new osg::Vec3Array();
+        geom->setVertexArray( verts );
+
+        osg::Vec3Array* normals = new osg::Vec3Array();
+        geom->setNormalArray( normals );
+        geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+        osg::Vec3Array* texCoords = 0L;
+        if ( textured )
+        {
+            texCoords = new osg::Vec3Array();
+            geom->setTexCoordArray( 0, texCoords );
+            geom->setStateSet( stateSet.get() );
+        }
+
+        osg::DrawElementsUShort* de = new osg::DrawElementsUShort( GL_TRIANGLES );
+        geom->addPrimitiveSet( de );
+
+        // The four sides of the unit box, CCW from above, with outward normals.
+        // Each side is split into one quad per texture repeat per floor so the
+        // texture coordinates stay in [0..1] and work with atlased skins.
+        const osg::Vec3f corners[5] = {
+            osg::Vec3f(0,0,0), osg::Vec3f(1,0,0), osg::Vec3f(1,1,0), osg::Vec3f(0,1,0), osg::Vec3f(0,0,0) };
+        const osg::Vec3f sideNormals[4] = {
+            osg::Vec3f(0,-1,0), osg::Vec3f(1,0,0), osg::Vec3f(0,1,0), osg::Vec3f(-1,0,0) };
+
+        float floorHeight = 1.0f / (float)numFloors;
+
+        for(unsigned side=0; side<4; ++side)
+        {
+            unsigned numCols = (unsigned)((side & 1) == 0 ? texRepeats.x() : texRepeats.y());
+            osg::Vec3f step = (corners[side+1] - corners[side]) / (float)numCols;
+
+            for(unsigned flr=0; flr<numFloors; ++flr)
+            {
+                osg::Vec3f lowerZ(0, 0, (float)flr*floorHeight);
+                osg::Vec3f upperZ(0, 0, (float)(flr+1)*floorHeight);
+
+                for(unsigned col=0; col<numCols; ++col)
+                {
+                    unsigned vertPtr = verts->size();
+
+                    osg::Vec3f L = corners[side] + step*(float)col;
+                    osg::Vec3f R = L + step;
+
+                    verts->push_back( L + upperZ );
+                    verts->push_back( L + lowerZ );
+                    verts->push_back( R + lowerZ );
+                    verts->push_back( R + upperZ );
+
+                    normals->insert( normals->end(), 4, sideNormals[side] );
+
+                    if ( texCoords )
+                    {
+                        osg::Vec2f texUL = texBias + osg::componentMultiply(osg::Vec2f(0.0f, 1.0f), texScale);
+                        osg::Vec2f texLL = texBias + osg::componentMultiply(osg::Vec2f(0.0f, 0.0f), texScale);
+                        osg::Vec2f texLR = texBias + osg::componentMultiply(osg::Vec2f(1.0f, 0.0f), texScale);
+                        osg::Vec2f texUR = texBias + osg::componentMultiply(osg::Vec2f(1.0f, 1.0f), texScale);
+
+                        texCoords->push_back( osg::Vec3f(texUL.x(), texUL.y(), texLayer) );
+                        texCoords->push_back( osg::Vec3f(texLL.x(), texLL.y(), texLayer) );
+                        texCoords->push_back( osg::Vec3f(texLR.x(), texLR.y(), texLayer) );
+                        texCoords->push_back( osg::Vec3f(texUR.x(), texUR.y(), texLayer) );
+                    }
+
+                    de->addElement( vertPtr+0 );
+                    de->addElement( vertPtr+1 );
+                    de->addElement( vertPtr+2 );
+                    de->addElement( vertPtr+0 );
+                    de->addElement( vertPtr+2 );
+                    de->addElement( vertPtr+3 );
+                }
+            }
+        }
+
+        osg::Vec4Array* colors = new osg::Vec4Array();
         geom->setColorArray( colors );
         geom->setColorBinding( geom->BIND_OVERALL );
         colors->push_back(osg::Vec4(1,1,1,1));
+
+        // narrowest index type and cache order; every instance draws these.
+        IndexOptimizer::optimize( geom );
+
+        osg::Geode* geode = new osg::Geode();
+        geode->addDrawable( geom );
+
+        proto = new TemplateModelResource( key, geode );
+        if ( !elevation->getTag().empty() )
+        {
+            proto->addTag( elevation->getTag() );
+        }
+
+        OE_DEBUG << LC << "Created prototype " << key << "\n";
     }
-    
-    output.addDrawable( geom.get(), elevation->getTag() );
+
+    return proto.get();
+}
+
+bool
+ElevationCompiler::compileInstancedBox(CompilerOutput&       output,
+                                       const Elevation*      elevation,
+                                       const osg::Matrix&    frame,
+                                       const osgDB::Options* readOptions) const
+{
+    const osg::BoundingBox& aabb = elevation->getAxisAlignedBoundingBox();
+    osg::Vec3f scale(aabb.xMax()-aabb.xMin(), aabb.yMax()-aabb.yMin(), elevation->getHeight());
+    osg::Vec3f bias (aabb.xMin(), aabb.yMin(), elevation->getBottom());
+
+    // the floor count and texture repeats are part of the prototype, so
+    // keep them within a reasonable range.
+    unsigned numFloors = std::max(1u, std::min(100u, (unsigned)elevation->getNumFloors()));
+
+    osg::Vec2f texRepeats(1.0f, 1.0f);
+    SkinResource* skin = elevation->getSkinResource();
+    if ( skin && skin->imageWidth().get() > 0.0f )
+    {
+        texRepeats.set(
+            std::min(32.0f, quantizeRepeats(scale.x() / skin->imageWidth().get())),
+            std::min(32.0f, quantizeRepeats(scale.y() / skin->imageWidth().get())) );
+    }
+
+    ModelResource* proto = getBoxPrototype( output, elevation, numFloors, texRepeats, readOptions );
+    if ( !proto )
+        return false;
+
+    // scale and bias the unit box to the AABB, rotate it back to its
+    // actual location, and transform into the final frame.
+    osg::Matrix matrix = 
+        osg::Matrix::scale(scale) *
+        osg::Matrix::translate(bias) *
+        elevation->getRotation() *
+        frame;
+
+    output.addInstance( proto, matrix );
 
     return true;
 }
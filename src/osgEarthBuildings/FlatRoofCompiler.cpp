@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "FlatRoofCompiler"
+#include "Parapet"
 #include <osgEarth/Tessellator>
 #include <osgEarth/Random>
 #include <osgEarthFeatures/Session>
@@ -147,18 +148,41 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
 
     float roofZ = 0.0f;
 
-    // Create a series of line loops that the tessellator can reorganize into polygons.
-    unsigned vertptr = 0;
-    for(Elevation::Walls::const_iterator wall = elevation->getWalls().begin();
-        wall != elevation->getWalls().end();
-        ++wall)
+    // A parapet that built its cap as a strip needs no tessellation.
+    const Parapet* parapet = dynamic_cast<const Parapet*>(elevation);
+    if ( parapet && !parapet->getCapStrip().empty() )
     {
-        unsigned elevptr = vertptr;
-        for(Elevation::Faces::const_iterator f = wall->faces.begin(); f != wall->faces.end(); ++f)
+        const Parapet::CapStrip& strip = parapet->getCapStrip();
+        for(Parapet::CapStrip::const_iterator c = strip.begin(); c != strip.end(); ++c)
+        {
+            verts->push_back( c->upper );
+            roofZ = c->upper.z();
+
+            if ( colors )
+            {
+                colors->push_back( roof->getColor() );
+            }
+
+            if ( texCoords )
+            {
+                osg::Vec3f tc( c->roofUV.x(), c->roofUV.y(), (float)0.0f );
+                texCoords->push_back( texBias + osg::componentMultiply(tc, texScale) );
+            }
+        }
+        geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, verts->size()) );
+
+        // per-vertex so the roof stays mergeable with tessellated ones:
+        osg::Vec3Array* normal = new osg::Vec3Array(verts->size());
+        geom->setNormalArray( normal );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+        normal->assign( verts->size(), osg::Vec3(0,0,1) );
+    }
+    // A rectangle is just two triangles.
+    else if ( elevation->isRectangle() && elevation->getWalls().size() == 1 )
+    {
+        const Elevation::Faces& faces = elevation->getWalls().front().faces;
+        for(Elevation::Faces::const_iterator f = faces.begin(); f != faces.end(); ++f)
         {
-            // Only use source verts; we skip interim verts inserted by the 
-            // structure building since they are co-linear anyway and thus we don't
-            // need them for the roof line.
             if ( f->left.isFromSource )
             {
                 verts->push_back( f->left.upper );
@@ -174,49 +198,91 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
                     osg::Vec3f tc( f->left.roofUV.x(), f->left.roofUV.y(), (float)0.0f );
                     texCoords->push_back( texBias + osg::componentMultiply(tc, texScale) );
                 }
+            }
+        }
 
-#if 0
-                if ( anchors )
+        static const GLubyte indices[6] = { 0, 1, 2, 0, 2, 3 };
+        geom->addPrimitiveSet( new osg::DrawElementsUByte(GL_TRIANGLES, 6, indices) );
+
+        osg::Vec3Array* normal = new osg::Vec3Array(verts->size());
+        geom->setNormalArray( normal );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+        normal->assign( verts->size(), osg::Vec3(0,0,1) );
+    }
+
+    else
+    {
+        // Create a series of line loops that the tessellator can reorganize into polygons.
+        unsigned vertptr = 0;
+        for(Elevation::Walls::const_iterator wall = elevation->getWalls().begin();
+            wall != elevation->getWalls().end();
+            ++wall)
+        {
+            unsigned elevptr = vertptr;
+            for(Elevation::Faces::const_iterator f = wall->faces.begin(); f != wall->faces.end(); ++f)
+            {
+                // Only use source verts; we skip interim verts inserted by the 
+                // structure building since they are co-linear anyway and thus we don't
+                // need them for the roof line.
+                if ( f->left.isFromSource )
                 {
-                    float 
-                        x = structure.baseCentroid.x(),
-                        y = structure.baseCentroid.y(), 
-                        vo = structure.verticalOffset;
+                    verts->push_back( f->left.upper );
+                    roofZ = f->left.upper.z();
 
-                    if ( flatten )
+                    if ( colors )
                     {
-                        anchors->push_back( osg::Vec4f(x, y, vo, Clamping::ClampToAnchor) );
+                        colors->push_back( roof->getColor() );
                     }
-                    else
+
+                    if ( texCoords )
                     {
-                        anchors->push_back( osg::Vec4f(x, y, vo + f->left.height, Clamping::ClampToGround) );
+                        osg::Vec3f tc( f->left.roofUV.x(), f->left.roofUV.y(), (float)0.0f );
+                        texCoords->push_back( texBias + osg::componentMultiply(tc, texScale) );
+                    }
+
+#if 0
+                    if ( anchors )
+                    {
+                        float 
+                            x = structure.baseCentroid.x(),
+                            y = structure.baseCentroid.y(), 
+                            vo = structure.verticalOffset;
+
+                        if ( flatten )
+                        {
+                            anchors->push_back( osg::Vec4f(x, y, vo, Clamping::ClampToAnchor) );
+                        }
+                        else
+                        {
+                            anchors->push_back( osg::Vec4f(x, y, vo + f->left.height, Clamping::ClampToGround) );
+                        }
                     }
-                }
 #endif
 
-                ++vertptr;
+                    ++vertptr;
+                }
             }
-        }
-        geom->addPrimitiveSet( new osg::DrawArrays(GL_LINE_LOOP, elevptr, vertptr-elevptr) );
-    } 
+            geom->addPrimitiveSet( new osg::DrawArrays(GL_LINE_LOOP, elevptr, vertptr-elevptr) );
+        } 
 
-    osg::Vec3Array* normal = new osg::Vec3Array(verts->size());
-    geom->setNormalArray( normal );
-    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
-    normal->assign( verts->size(), osg::Vec3(0,0,1) );
+        osg::Vec3Array* normal = new osg::Vec3Array(verts->size());
+        geom->setNormalArray( normal );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+        normal->assign( verts->size(), osg::Vec3(0,0,1) );
     
-    // Tessellate the roof lines into polygons.
-    osgEarth::Tessellator oeTess;
-    if (!oeTess.tessellateGeometry(*geom))
-    {
-        //fallback to osg tessellator
-        OE_DEBUG << LC << "Falling back on OSG tessellator (" << geom->getName() << ")" << std::endl;
-
-        osgUtil::Tessellator tess;
-        tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
-        tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
-        tess.retessellatePolygons( *geom );
-        MeshConsolidator::convertToTriangles( *geom );
+        // Tessellate the roof lines into polygons.
+        osgEarth::Tessellator oeTess;
+        if (!oeTess.tessellateGeometry(*geom))
+        {
+            //fallback to osg tessellator
+            OE_DEBUG << LC << "Falling back on OSG tessellator (" << geom->getName() << ")" << std::endl;
+
+            osgUtil::Tessellator tess;
+            tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
+            tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
+            tess.retessellatePolygons( *geom );
+            MeshConsolidator::convertToTriangles( *geom );
+        }
     }
 
 #if 0
@@ -238,7 +304,8 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
     for(osg::Vec3Array::iterator v = verts->begin(); v != verts->end(); ++v)
         (*v) = (*v) * frame;
 
-    output.addDrawable( geom.get(), roof->getTag() );
+    // Add the roof triangles to the pool for this tag and skin.
+    output.getGeometryPool( roof->getTag(), stateSet.get() )->append( geom.get(), roof->getColor() );
     
     // Load models:
     ModelResource* model = roof->getModelResource();
@@ -0,0 +1,151 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "FootprintAnalysis"
+#include "PolygonOffset"
+
+#define LC "[FootprintAnalysis] "
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    // Minimum ratio of footprint area to rotated bbox area for a 4-corner
+    // footprint to be treated as a rectangle.
+    const double RECTANGLE_AREA_RATIO = 0.99;
+}
+
+FootprintAnalysis::FootprintAnalysis(const Polygon* footprint) :
+_footprint( footprint ),
+_sinR     ( 0.0f ),
+_cosR     ( 1.0f ),
+_isRectangle( false )
+{
+    if ( !footprint )
+        return;
+
+    // looks for the longest segment in the footprint and
+    // returns the angle of that segment relative to north.
+    Segment n;
+    double  maxLen2 = 0.0;
+    ConstSegmentIterator i( footprint, true );
+    while( i.hasMore() )
+    {
+        Segment s = i.next();
+        double len2 = (s.second - s.first).length2();
+        if ( len2 > maxLen2 ) 
+        {
+            maxLen2 = len2;
+            n = s;
+        }
+    }
+
+    // swap coords if neceesary, so that p1 is always on the left.
+    const osg::Vec3d& p1 = n.first.x() < n.second.x() ? n.first : n.second;
+    const osg::Vec3d& p2 = n.first.x() < n.second.x() ? n.second : n.first;
+
+    // compute a rotation that will transform the long segment to be
+    // parallel to the Y axis.
+    float r = atan2( p2.x()-p1.x(), p2.y()-p1.y() );
+    _sinR = sinf( r );
+    _cosR = cosf( r );
+
+    // cache the midpoint of the longest segment, and the vector that
+    // points towards the inside of the polygon.
+    _longEdgeMidpoint = (p1+p2)*0.5;
+    _longEdgeInsideNormal = (n.second-n.first)^osg::Vec3d(0,0,-1);
+    _longEdgeInsideNormal.normalize();
+
+    // compute the axis-aligned bbox in the rotated frame
+    for(Polygon::const_iterator i = footprint->begin(); i != footprint->end(); ++i)
+    {
+        float x = i->x(), y = i->y();
+        float x2 = _cosR*x - _sinR*y, y2 = _sinR*x + _cosR*y;
+        _rotatedBounds.expandBy( osg::Vec3f(x2, y2, 0.0f) );
+    }
+
+    _bounds = footprint->getBounds();
+
+    // detect a rectangle by comparing its area to that of the rotated bbox.
+    unsigned numPoints = footprint->size();
+    if ( numPoints > 1 && footprint->front() == footprint->back() )
+        --numPoints;
+
+    if ( numPoints == 4 && footprint->getHoles().empty() && _rotatedBounds.valid() )
+    {
+        double boxArea = 
+            (double)(_rotatedBounds.xMax() - _rotatedBounds.xMin()) *
+            (double)(_rotatedBounds.yMax() - _rotatedBounds.yMin());
+
+        _isRectangle = 
+            boxArea > 0.0 &&
+            fabs(footprint->getSignedArea2D()) >= RECTANGLE_AREA_RATIO * boxArea;
+    }
+}
+
+const Polygon*
+FootprintAnalysis::getBox()
+{
+    if ( !_box.valid() && _rotatedBounds.valid() )
+    {
+        _box = new Polygon();
+        const osg::BoundingBox& b = _rotatedBounds;
+        float c[4][2] = {
+            { b.xMin(), b.yMin() }, { b.xMax(), b.yMin() },
+            { b.xMax(), b.yMax() }, { b.xMin(), b.yMax() } };
+
+        for(int i=0; i<4; ++i)
+        {
+            float x = c[i][0], y = c[i][1];
+            _box->push_back( osg::Vec3d(_cosR*x + _sinR*y, -_sinR*x + _cosR*y, 0.0) );
+        }
+    }
+    return _box.get();
+}
+
+const Polygon*
+FootprintAnalysis::getOffset(float distance, bool* direct)
+{
+    Offsets::iterator i = _offsets.find( distance );
+    if ( i == _offsets.end() )
+    {
+        Offset& offset = _offsets[distance];
+
+        offset.polygon = PolygonOffset::offset( _footprint.get(), distance );
+        offset.direct  = offset.polygon.valid();
+
+        if ( !offset.direct && _footprint.valid() )
+        {
+            osg::ref_ptr<Geometry> result;
+            BufferParameters bp( BufferParameters::CAP_DEFAULT, BufferParameters::JOIN_MITRE );
+            if ( _footprint->buffer(-distance, result, bp) )
+            {
+                offset.polygon = dynamic_cast<Polygon*>( result.get() );
+            }
+        }
+
+        i = _offsets.find( distance );
+    }
+
+    if ( direct )
+        *direct = i->second.direct;
+
+    return i->second.polygon.get();
+}
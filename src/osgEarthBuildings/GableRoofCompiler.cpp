@@ -18,6 +18,7 @@
  */
 #include "GableRoofCompiler"
 #include <osgEarthFeatures/Session>
+#include <osgEarth/StringUtils>
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
@@ -26,8 +27,19 @@ using namespace osgEarth::Buildings;
 
 #define LC "[GableRoofCompiler] "
 
+namespace
+{
+    // Instanced roofs cannot scale their texture coordinates per building,
+    // so we quantize the texture repeats and make one prototype for each.
+    inline float quantizeRepeats(float r)
+    {
+        return std::max(1.0f, osg::round(r));
+    }
+}
+
 GableRoofCompiler::GableRoofCompiler(Session* session) :
-_session( session )
+_session      ( session ),
+_useInstancing( false )
 {
     // build the unit-space template.
     osg::Vec3f LL(0, 0, 0), LM(0.5, 0, 2), LR(1, 0, 0),
@@ -91,6 +103,11 @@ GableRoofCompiler::compile(CompilerOutput&       output,
     // precalculate the frame transformation; combining these will
     // prevent any precision loss during the transform.
     osg::Matrix frame = building->getReferenceFrame() * world2local;
+
+    if ( _useInstancing )
+    {
+        return compileInstanced( output, elevation, frame, readOptions );
+    }
     
     // find a texture:
     SkinResource* skin = roof->getSkinResource();
@@ -100,28 +117,6 @@ GableRoofCompiler::compile(CompilerOutput&       output,
         stateSet = output.getSkinStateSet(skin, readOptions);
     }
 
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setUseVertexBufferObjects( true );
-    geom->setUseDisplayList( false );
-
-    // copy the unit-space template:
-    osg::Vec3Array* verts = new osg::Vec3Array(_verts->begin(), _verts->end());
-    geom->setVertexArray( verts );
-    
-    osg::Vec3Array* texCoords = 0L;
-    if ( stateSet.valid() )
-    {
-        // copy the texture coordinates (though this may not be strictly necessary)
-        texCoords = new osg::Vec3Array(_texCoords->begin(), _texCoords->end());
-        geom->setTexCoordArray( 0, texCoords );
-        geom->setStateSet( stateSet.get() );
-    }
-
-    osg::Vec3Array* normals = new osg::Vec3Array();
-    normals->reserve( verts->size() );
-    geom->setNormalArray( normals );
-    geom->setNormalBinding( geom->BIND_PER_VERTEX );
-
     // highest point (this data is guaranteed to exist)
     float roofZ = elevation->getUppermostZ();
 
@@ -135,29 +130,154 @@ GableRoofCompiler::compile(CompilerOutput&       output,
     if ( skin )
         tscale.set(scale.x() / skin->imageWidth().get(), scale.y() / skin->imageHeight().get());
 
-    // scale and bias the geometry, rotate it back to its actual location,
-    // and transform into the final coordinate frame.
-    for(int i=0; i<verts->size(); ++i)
+    // Write the roof straight into the pool for this tag and skin.
+    GeometryPool* pool = output.getGeometryPool( roof->getTag(), stateSet.get() );
+    unsigned numVerts = _verts->size();
+    pool->reserve( numVerts, numVerts );
+
+    const osg::Vec4f color(1,1,1,1);
+
+    // Each triangle of the unit-space template:
+    for(unsigned i=0; i+2<numVerts; i+=3)
     {
-        osg::Vec3f& v = (*verts)[i];
-        v = osg::componentMultiply(v, scale) + bias;
-        elevation->unrotate( v );
-        v = v * frame;
+        // scale and bias the geometry, rotate it back to its actual location,
+        // and transform into the final coordinate frame.
+        osg::Vec3f v[3];
+        for(unsigned k=0; k<3; ++k)
+        {
+            v[k] = osg::componentMultiply((*_verts)[i+k], scale) + bias;
+            elevation->unrotate( v[k] );
+            v[k] = v[k] * frame;
+        }
+
+        // calculate the normal (after transforming the vertices)
+        osg::Vec3f n = (v[2]-v[1]) ^ (v[0]-v[1]);
+        n.normalize();
 
-        if ( texCoords )
+        unsigned base = pool->getNumVertices();
+        for(unsigned k=0; k<3; ++k)
         {
-            osg::Vec3f& tx = (*texCoords)[i];
-            tx.x() *= tscale.y(), tx.y() *= tscale.x();         
+            osg::Vec3f tx = (*_texCoords)[i+k];
+            tx.x() *= tscale.y(), tx.y() *= tscale.x();
+            pool->addVertex( v[k], n, color, tx );
         }
+        pool->addTriangle( base, base+1, base+2 );
+    }
+
+    return true;
+}
+
+ModelResource*
+GableRoofCompiler::getPrototype(CompilerOutput&       output,
+                                const Roof*           roof,
+                                const osg::Vec2f&     texRepeats,
+                                const osgDB::Options* readOptions) const
+{
+    SkinResource* skin = roof->getSkinResource();
+
+    std::string key = Stringify()
+        << "gable-roof:" << roof->getTag()
+        << ":" << (skin ? skin->imageURI()->full() : "")
+        << ":" << texRepeats.x() << "x" << texRepeats.y();
+
+    // Use the same shared StateSet (or texture array) as the pooled roofs.
+    // Get it before locking, since it may load the image.
+    osg::ref_ptr<osg::StateSet> stateSet;
+    if ( skin )
+    {
+        stateSet = output.getSkinStateSet(skin, readOptions);
+    }
+    bool textured =
+        stateSet.valid() &&
+        stateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE) != 0L;
+
+    Threading::ScopedMutexLock lock( _prototypesMutex );
+
+    osg::ref_ptr<ModelResource>& proto = _prototypes[key];
+    if ( !proto.valid() )
+    {
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects( true );
+        geom->setUseDisplayList( false );
+
+        osg::Vec3Array* verts = new osg::Vec3Array(_verts->begin(), _verts->end());
+        geom->setVertexArray( verts );
+
+        // normals are computed in unit space; the instancing shader transforms
+        // them by the inverse transpose of the instance matrix.
+        osg::Vec3Array* normals = new osg::Vec3Array();
+        normals->reserve( verts->size() );
+        generateNormals( verts, normals );
+        geom->setNormalArray( normals );
+        geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+        if ( textured )
+        {
+            osg::Vec3Array* texCoords = new osg::Vec3Array(_texCoords->begin(), _texCoords->end());
+            for(osg::Vec3Array::iterator tx = texCoords->begin(); tx != texCoords->end(); ++tx)
+            {
+                tx->x() *= texRepeats.y(), tx->y() *= texRepeats.x();
+            }
+            geom->setTexCoordArray( 0, texCoords );
+            geom->setStateSet( stateSet.get() );
+        }
+
+        geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLES, 0, verts->size()) );
+
+        osg::Geode* geode = new osg::Geode();
+        geode->addDrawable( geom );
+
+        proto = new TemplateModelResource( key, geode );
+        if ( !roof->getTag().empty() )
+        {
+            proto->addTag( roof->getTag() );
+        }
+
+        OE_DEBUG << LC << "Created prototype " << key << "\n";
+    }
+
+    return proto.get();
+}
+
+bool
+GableRoofCompiler::compileInstanced(CompilerOutput&       output,
+                                    const Elevation*      elevation,
+                                    const osg::Matrix&    frame,
+                                    const osgDB::Options* readOptions) const
+{
+    const Roof* roof = elevation->getRoof();
+
+    // highest point (this data is guaranteed to exist)
+    float roofZ = elevation->getUppermostZ();
+
+    // the AABB gives us the information to scale+bias the unit template 
+    // to the proper size and shape:
+    const osg::BoundingBox& aabb = elevation->getAxisAlignedBoundingBox();
+    osg::Vec3f scale(aabb.xMax()-aabb.xMin(), aabb.yMax()-aabb.yMin(), 1.0f);
+    osg::Vec3f bias (aabb.xMin(), aabb.yMin(), roofZ);
+
+    osg::Vec2f texRepeats(1.0f, 1.0f);
+    SkinResource* skin = roof->getSkinResource();
+    if ( skin )
+    {
+        texRepeats.set(
+            quantizeRepeats(scale.x() / skin->imageWidth().get()),
+            quantizeRepeats(scale.y() / skin->imageHeight().get()) );
     }
 
-    // calculate normals (after transforming the vertices)
-    generateNormals( verts, normals );
+    ModelResource* proto = getPrototype( output, roof, texRepeats, readOptions );
+    if ( !proto )
+        return false;
 
-    // and finally the triangles.
-    geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLES, 0, verts->size()) );
+    // same transformation compile() applies to each vertex: scale and bias,
+    // rotate back to the actual location, then into the final frame.
+    osg::Matrix matrix = 
+        osg::Matrix::scale(scale) *
+        osg::Matrix::translate(bias) *
+        elevation->getRotation() *
+        frame;
 
-    output.addDrawable( geom.get(), roof->getTag() );
+    output.addInstance( proto, matrix );
 
     return true;
 }
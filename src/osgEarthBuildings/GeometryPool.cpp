@@ -0,0 +1,347 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "GeometryPool"
+#include "IndexOptimizer"
+#include <osg/TriangleIndexFunctor>
+#include <osgEarth/Registry>
+#include <osgEarth/ObjectIndex>
+#include <algorithm>
+
+#define LC "[GeometryPool] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    // Collects the triangles of a geometry, offset to the pool's base vertex.
+    struct CollectTriangles
+    {
+        std::vector<GLuint>* _indices;
+        unsigned             _base;
+
+        void operator()(unsigned i0, unsigned i1, unsigned i2)
+        {
+            _indices->push_back( _base+i0 );
+            _indices->push_back( _base+i1 );
+            _indices->push_back( _base+i2 );
+        }
+    };
+
+    // orders chunk ranges by their centroid along one axis.
+    template<typename T>
+    struct CentroidLess
+    {
+        int _axis;
+        CentroidLess(int axis) : _axis(axis) { }
+        bool operator()(const T& lhs, const T& rhs) const {
+            return lhs.centroid[_axis] < rhs.centroid[_axis];
+        }
+    };
+}
+
+GeometryPool::GeometryPool(osg::StateSet* stateSet) :
+_stateSet( stateSet ),
+_hasObjectIDs( false )
+{
+    _verts   = new osg::Vec3Array();
+    _normals = new osg::Vec3Array();
+    _colors  = new osg::Vec4Array();
+
+    if ( stateSet )
+        _texCoords = new osg::Vec3Array();
+}
+
+void
+GeometryPool::beginChunk(unsigned id, unsigned objectID)
+{
+    if ( _chunks.empty() || _chunks.back().id != id )
+    {
+        Chunk chunk;
+        chunk.id          = id;
+        chunk.objectID    = objectID;
+        chunk.firstVertex = _verts->size();
+        chunk.firstIndex  = _indices.size();
+        _chunks.push_back( chunk );
+
+        if ( objectID != 0u )
+            _hasObjectIDs = true;
+    }
+}
+
+void
+GeometryPool::reserve(unsigned numVerts, unsigned numIndices)
+{
+    unsigned n = _verts->size() + numVerts;
+    _verts->reserve( n );
+    _normals->reserve( n );
+    _colors->reserve( n );
+    if ( _texCoords.valid() )
+        _texCoords->reserve( n );
+
+    _indices.reserve( _indices.size() + numIndices );
+}
+
+void
+GeometryPool::append(const osg::Geometry* geom, const osg::Vec4f& color)
+{
+    const osg::Vec3Array* verts = geom ? dynamic_cast<const osg::Vec3Array*>(geom->getVertexArray()) : 0L;
+    if ( !verts || verts->empty() )
+        return;
+
+    const osg::Vec3Array* normals = dynamic_cast<const osg::Vec3Array*>(geom->getNormalArray());
+    if ( normals && normals->size() != verts->size() )
+        normals = 0L;
+
+    const osg::Vec4Array* colors = dynamic_cast<const osg::Vec4Array*>(geom->getColorArray());
+    if ( colors && colors->size() != verts->size() )
+        colors = 0L;
+
+    const osg::Vec3Array* texCoords = dynamic_cast<const osg::Vec3Array*>(geom->getTexCoordArray(0));
+    if ( texCoords && texCoords->size() != verts->size() )
+        texCoords = 0L;
+
+    unsigned base = _verts->size();
+    reserve( verts->size(), 0 );
+
+    _verts->insert( _verts->end(), verts->begin(), verts->end() );
+
+    if ( normals )
+        _normals->insert( _normals->end(), normals->begin(), normals->end() );
+    else
+        _normals->insert( _normals->end(), verts->size(), osg::Vec3f(0,0,1) );
+
+    if ( colors )
+        _colors->insert( _colors->end(), colors->begin(), colors->end() );
+    else
+        _colors->insert( _colors->end(), verts->size(), color );
+
+    if ( _texCoords.valid() )
+    {
+        if ( texCoords )
+            _texCoords->insert( _texCoords->end(), texCoords->begin(), texCoords->end() );
+        else
+            _texCoords->insert( _texCoords->end(), verts->size(), osg::Vec3f(0,0,0) );
+    }
+
+    osg::TriangleIndexFunctor<CollectTriangles> collect;
+    collect._indices = &_indices;
+    collect._base    = base;
+    geom->accept( collect );
+}
+
+osg::Geometry*
+GeometryPool::createGeometry() const
+{
+    osg::ref_ptr<osg::UIntArray> objectIDs;
+    if ( _hasObjectIDs )
+    {
+        objectIDs = new osg::UIntArray( _verts->size() );
+        for(unsigned c=0; c<_chunks.size(); ++c)
+        {
+            unsigned end = c+1 < _chunks.size() ? _chunks[c+1].firstVertex : _verts->size();
+            std::fill( objectIDs->begin()+_chunks[c].firstVertex, objectIDs->begin()+end, _chunks[c].objectID );
+        }
+    }
+
+    return createGeometry( _verts.get(), _normals.get(), _colors.get(), _texCoords.get(), objectIDs.get(), _indices );
+}
+
+osg::Geometry*
+GeometryPool::createGeometry(osg::Vec3Array*            verts,
+                             osg::Vec3Array*            normals,
+                             osg::Vec4Array*            colors,
+                             osg::Vec3Array*            texCoords,
+                             osg::UIntArray*            objectIDs,
+                             const std::vector<GLuint>& indices) const
+{
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( true );
+    geom->setUseDisplayList( false );
+
+    if ( _stateSet.valid() )
+        geom->setStateSet( _stateSet.get() );
+
+    geom->setVertexArray( verts );
+
+    geom->setNormalArray( normals );
+    geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+    geom->setColorArray( colors );
+    geom->setColorBinding( geom->BIND_PER_VERTEX );
+
+    if ( texCoords )
+        geom->setTexCoordArray( 0, texCoords );
+
+    // per-vertex object IDs, in the form the object index expects:
+    if ( objectIDs )
+    {
+        objectIDs->setBinding( osg::Array::BIND_PER_VERTEX );
+        objectIDs->setNormalize( false );
+        objectIDs->setPreserveDataType( true );
+        geom->setVertexAttribArray( Registry::objectIndex()->getObjectIDAttribLocation(), objectIDs );
+    }
+
+    geom->addPrimitiveSet( IndexOptimizer::createDrawElements(indices, verts->size()) );
+
+    return geom;
+}
+
+void
+GeometryPool::getChunkRanges(ChunkRanges& ranges) const
+{
+    ranges.clear();
+
+    // anything written before the first chunk is a chunk of its own.
+    std::vector<Chunk> chunks;
+    if ( _chunks.empty() || _chunks.front().firstVertex > 0u )
+    {
+        Chunk first = { ~0u, 0u, 0u, 0u };
+        chunks.push_back( first );
+    }
+    chunks.insert( chunks.end(), _chunks.begin(), _chunks.end() );
+
+    for(unsigned c=0; c<chunks.size(); ++c)
+    {
+        ChunkRange r;
+        r.objectID    = chunks[c].objectID;
+        r.firstVertex = chunks[c].firstVertex;
+        r.firstIndex  = chunks[c].firstIndex;
+        r.numVertices = (c+1 < chunks.size() ? chunks[c+1].firstVertex : _verts->size()) - r.firstVertex;
+        r.numIndices  = (c+1 < chunks.size() ? chunks[c+1].firstIndex : _indices.size()) - r.firstIndex;
+
+        if ( r.numVertices == 0u || r.numIndices == 0u )
+            continue;
+
+        osg::BoundingBoxf box;
+        for(unsigned v=r.firstVertex; v<r.firstVertex+r.numVertices; ++v)
+            box.expandBy( (*_verts)[v] );
+        r.centroid = box.center();
+
+        ranges.push_back( r );
+    }
+}
+
+void
+GeometryPool::createGeometries(unsigned maxVerts, std::vector< osg::ref_ptr<osg::Geometry> >& output) const
+{
+    if ( _indices.empty() )
+        return;
+
+    if ( maxVerts == 0u || _verts->size() <= maxVerts )
+    {
+        output.push_back( createGeometry() );
+        return;
+    }
+
+    ChunkRanges ranges;
+    getChunkRanges( ranges );
+
+    cluster( ranges, 0, ranges.size(), _verts->size(), maxVerts, output );
+}
+
+void
+GeometryPool::cluster(ChunkRanges&                                ranges,
+                      unsigned                                    first,
+                      unsigned                                    last,
+                      unsigned                                    numVerts,
+                      unsigned                                    maxVerts,
+                      std::vector< osg::ref_ptr<osg::Geometry> >& output) const
+{
+    if ( numVerts <= maxVerts || last-first <= 1u )
+    {
+        output.push_back( createGeometry(ranges, first, last) );
+        return;
+    }
+
+    // split along the longest axis of the centroids' extent:
+    osg::BoundingBoxf extent;
+    for(unsigned i=first; i<last; ++i)
+        extent.expandBy( ranges[i].centroid );
+
+    float dx = extent.xMax()-extent.xMin(), dy = extent.yMax()-extent.yMin(), dz = extent.zMax()-extent.zMin();
+    int axis = dx >= dy && dx >= dz ? 0 : dy >= dz ? 1 : 2;
+
+    unsigned mid = first + (last-first)/2;
+    std::nth_element( ranges.begin()+first, ranges.begin()+mid, ranges.begin()+last, CentroidLess<ChunkRange>(axis) );
+
+    unsigned leftVerts = 0u;
+    for(unsigned i=first; i<mid; ++i)
+        leftVerts += ranges[i].numVertices;
+
+    cluster( ranges, first, mid, leftVerts,          maxVerts, output );
+    cluster( ranges, mid,   last, numVerts-leftVerts, maxVerts, output );
+}
+
+osg::Geometry*
+GeometryPool::createGeometry(const ChunkRanges& ranges, unsigned first, unsigned last) const
+{
+    unsigned numVerts = 0u, numIndices = 0u;
+    for(unsigned i=first; i<last; ++i)
+    {
+        numVerts   += ranges[i].numVertices;
+        numIndices += ranges[i].numIndices;
+    }
+
+    osg::ref_ptr<osg::Vec3Array> verts     = new osg::Vec3Array();
+    osg::ref_ptr<osg::Vec3Array> normals   = new osg::Vec3Array();
+    osg::ref_ptr<osg::Vec4Array> colors    = new osg::Vec4Array();
+    osg::ref_ptr<osg::Vec3Array> texCoords = _texCoords.valid() ? new osg::Vec3Array() : 0L;
+    osg::ref_ptr<osg::UIntArray> objectIDs = _hasObjectIDs ? new osg::UIntArray() : 0L;
+
+    verts->reserve( numVerts );
+    normals->reserve( numVerts );
+    colors->reserve( numVerts );
+    if ( texCoords.valid() )
+        texCoords->reserve( numVerts );
+    if ( objectIDs.valid() )
+        objectIDs->reserve( numVerts );
+
+    std::vector<GLuint> indices;
+    indices.reserve( numIndices );
+
+    for(unsigned i=first; i<last; ++i)
+    {
+        const ChunkRange& r = ranges[i];
+        unsigned v0 = r.firstVertex, v1 = r.firstVertex + r.numVertices;
+
+        // rebase the chunk's indices onto the new arrays.
+        GLint offset = (GLint)verts->size() - (GLint)r.firstVertex;
+        for(unsigned k=r.firstIndex; k<r.firstIndex+r.numIndices; ++k)
+            indices.push_back( (GLuint)((GLint)_indices[k] + offset) );
+
+        verts->insert  ( verts->end(),   _verts->begin()+v0,   _verts->begin()+v1 );
+        normals->insert( normals->end(), _normals->begin()+v0, _normals->begin()+v1 );
+        colors->insert ( colors->end(),  _colors->begin()+v0,  _colors->begin()+v1 );
+        if ( texCoords.valid() )
+            texCoords->insert( texCoords->end(), _texCoords->begin()+v0, _texCoords->begin()+v1 );
+        if ( objectIDs.valid() )
+            objectIDs->insert( objectIDs->end(), r.numVertices, r.objectID );
+    }
+
+    osg::Geometry* geom = createGeometry( verts.get(), normals.get(), colors.get(), texCoords.get(), objectIDs.get(), indices );
+
+    // a tight initial bound, so culling doesn't need to wait for the first computeBound.
+    osg::BoundingBox bound;
+    for(osg::Vec3Array::const_iterator v = verts->begin(); v != verts->end(); ++v)
+        bound.expandBy( *v );
+    geom->setInitialBound( bound );
+
+    return geom;
+}
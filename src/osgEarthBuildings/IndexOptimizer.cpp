@@ -0,0 +1,315 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "IndexOptimizer"
+#include <osg/Geode>
+#include <osg/NodeVisitor>
+#include <osg/TriangleIndexFunctor>
+#include <cmath>
+
+#define LC "[IndexOptimizer] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    struct CollectTriangles
+    {
+        std::vector<GLuint>* _indices;
+
+        void operator()(unsigned i0, unsigned i1, unsigned i2)
+        {
+            // skip degenerates; they cost a cache slot and draw nothing.
+            if ( i0 == i1 || i1 == i2 || i0 == i2 )
+                return;
+
+            _indices->push_back( i0 );
+            _indices->push_back( i1 );
+            _indices->push_back( i2 );
+        }
+    };
+
+    struct OptimizeVisitor : public osg::NodeVisitor
+    {
+        IndexOptimizer::Stats* _stats;
+
+        OptimizeVisitor(IndexOptimizer::Stats* stats) : _stats(stats)
+        {
+            setTraversalMode( TRAVERSE_ALL_CHILDREN );
+            setNodeMaskOverride( ~0 );
+        }
+
+        void apply(osg::Geode& geode)
+        {
+            for(unsigned i=0; i<geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( geom )
+                    IndexOptimizer::optimize( geom, _stats );
+            }
+        }
+    };
+
+    // Vertex score from the paper: recently used vertices score high (except
+    // for the last triangle's, to discourage strips), and vertices with few
+    // remaining triangles get a boost so they finish and leave the cache.
+    float vertexScore(int cachePos, unsigned numTrisLeft)
+    {
+        if ( numTrisLeft == 0u )
+            return -1.0f;
+
+        float score = 0.0f;
+        if ( cachePos >= 0 )
+        {
+            if ( cachePos < 3 )
+            {
+                score = 0.75f;
+            }
+            else
+            {
+                const float scaler = 1.0f / (float)(IndexOptimizer::CACHE_SIZE - 3u);
+                score = powf( 1.0f - (float)(cachePos-3)*scaler, 1.5f );
+            }
+        }
+
+        score += 2.0f * powf( (float)numTrisLeft, -0.5f );
+        return score;
+    }
+}
+
+void
+IndexOptimizer::optimize(osg::Node* node, Stats* stats)
+{
+    if ( node )
+    {
+        OptimizeVisitor visitor( stats );
+        node->accept( visitor );
+    }
+}
+
+bool
+IndexOptimizer::optimize(osg::Geometry* geom, Stats* stats)
+{
+    if ( !geom || !geom->getVertexArray() || geom->getNumPrimitiveSets() == 0u )
+        return false;
+
+    if ( geom->getNormalBinding() == osg::Geometry::BIND_PER_PRIMITIVE_SET ||
+         geom->getColorBinding()  == osg::Geometry::BIND_PER_PRIMITIVE_SET )
+        return false;
+
+    for(unsigned p=0; p<geom->getNumPrimitiveSets(); ++p)
+    {
+        const osg::PrimitiveSet* ps = geom->getPrimitiveSet(p);
+        if ( ps->getNumInstances() > 0 )
+            return false;
+
+        GLenum mode = ps->getMode();
+        if ( mode != GL_TRIANGLES && mode != GL_TRIANGLE_STRIP && mode != GL_TRIANGLE_FAN && 
+             mode != GL_QUADS && mode != GL_QUAD_STRIP && mode != GL_POLYGON )
+            return false;
+    }
+
+    unsigned numVerts = geom->getVertexArray()->getNumElements();
+
+    std::vector<GLuint> indices;
+    osg::TriangleIndexFunctor<CollectTriangles> collect;
+    collect._indices = &indices;
+    geom->accept( collect );
+
+    if ( indices.empty() )
+        return false;
+
+    unsigned missesBefore = countCacheMisses( indices, numVerts );
+
+    reorder( indices, numVerts );
+
+    unsigned missesAfter = countCacheMisses( indices, numVerts );
+
+    osg::DrawElements* de = createDrawElements( indices, numVerts );
+    geom->removePrimitiveSet( 0, geom->getNumPrimitiveSets() );
+    geom->addPrimitiveSet( de );
+
+    if ( stats )
+    {
+        stats->numGeometries++;
+        stats->numTriangles += indices.size()/3;
+        stats->missesBefore += missesBefore;
+        stats->missesAfter  += missesAfter;
+        stats->indexBytes   += de->getTotalDataSize();
+    }
+
+    return true;
+}
+
+void
+IndexOptimizer::reorder(std::vector<GLuint>& indices, unsigned numVerts)
+{
+    const unsigned numTris = indices.size()/3;
+    if ( numTris < 2u )
+        return;
+
+    // triangles using each vertex; the first numTrisLeft[v] entries of a
+    // vertex's range are the ones not yet emitted.
+    std::vector<unsigned> numTrisLeft( numVerts, 0u );
+    for(unsigned i=0; i<numTris*3; ++i)
+        numTrisLeft[indices[i]]++;
+
+    std::vector<unsigned> offsets( numVerts+1, 0u );
+    for(unsigned v=0; v<numVerts; ++v)
+        offsets[v+1] = offsets[v] + numTrisLeft[v];
+
+    std::vector<unsigned> vertTris( numTris*3 );
+    std::vector<unsigned> fill( offsets.begin(), offsets.end()-1 );
+    for(unsigned t=0; t<numTris; ++t)
+        for(unsigned k=0; k<3; ++k)
+            vertTris[fill[indices[t*3+k]]++] = t;
+
+    std::vector<int>   cachePos( numVerts, -1 );
+    std::vector<float> vertScore( numVerts );
+    for(unsigned v=0; v<numVerts; ++v)
+        vertScore[v] = vertexScore( -1, numTrisLeft[v] );
+
+    std::vector<float> triScore( numTris );
+    std::vector<bool>  emitted( numTris, false );
+    int best = -1;
+    float bestScore = -1.0f;
+    for(unsigned t=0; t<numTris; ++t)
+    {
+        triScore[t] = vertScore[indices[t*3]] + vertScore[indices[t*3+1]] + vertScore[indices[t*3+2]];
+        if ( triScore[t] > bestScore )
+        {
+            bestScore = triScore[t];
+            best = t;
+        }
+    }
+
+    std::vector<GLuint> output;
+    output.reserve( numTris*3 );
+
+    std::vector<GLuint> cache, newCache;
+    cache.reserve( CACHE_SIZE+3 );
+    newCache.reserve( CACHE_SIZE+3 );
+
+    unsigned scan = 0u;
+
+    while( output.size() < numTris*3 )
+    {
+        // nothing in the cache has triangles left; take the next one in order.
+        if ( best < 0 )
+        {
+            while( emitted[scan] ) ++scan;
+            best = scan;
+        }
+
+        emitted[best] = true;
+
+        newCache.clear();
+        for(unsigned k=0; k<3; ++k)
+        {
+            GLuint v = indices[best*3+k];
+            output.push_back( v );
+            newCache.push_back( v );
+
+            // retire the triangle from this vertex's list.
+            unsigned* first = &vertTris[offsets[v]];
+            unsigned  n     = numTrisLeft[v];
+            for(unsigned i=0; i<n; ++i)
+            {
+                if ( first[i] == (unsigned)best )
+                {
+                    first[i] = first[n-1];
+                    first[n-1] = best;
+                    break;
+                }
+            }
+            numTrisLeft[v]--;
+        }
+
+        for(unsigned i=0; i<cache.size(); ++i)
+        {
+            GLuint v = cache[i];
+            if ( v != newCache[0] && v != newCache[1] && v != newCache[2] )
+                newCache.push_back( v );
+        }
+
+        // update the scores of everything that was or is in the cache:
+        for(unsigned i=0; i<newCache.size(); ++i)
+        {
+            GLuint v = newCache[i];
+            cachePos[v] = i < CACHE_SIZE ? (int)i : -1;
+            vertScore[v] = vertexScore( cachePos[v], numTrisLeft[v] );
+        }
+
+        best = -1;
+        bestScore = -1.0f;
+        for(unsigned i=0; i<newCache.size(); ++i)
+        {
+            GLuint v = newCache[i];
+            for(unsigned j=0; j<numTrisLeft[v]; ++j)
+            {
+                unsigned t = vertTris[offsets[v]+j];
+                triScore[t] = vertScore[indices[t*3]] + vertScore[indices[t*3+1]] + vertScore[indices[t*3+2]];
+                if ( triScore[t] > bestScore )
+                {
+                    bestScore = triScore[t];
+                    best = t;
+                }
+            }
+        }
+
+        if ( newCache.size() > CACHE_SIZE )
+            newCache.resize( CACHE_SIZE );
+        cache.swap( newCache );
+    }
+
+    indices.swap( output );
+}
+
+unsigned
+IndexOptimizer::countCacheMisses(const std::vector<GLuint>& indices, unsigned numVerts, unsigned cacheSize)
+{
+    // A vertex is in the FIFO iff fewer than cacheSize misses have happened
+    // since it was loaded.
+    std::vector<int> loadedAt( numVerts, -1 );
+    unsigned misses = 0u;
+    for(std::vector<GLuint>::const_iterator i = indices.begin(); i != indices.end(); ++i)
+    {
+        int& t = loadedAt[*i];
+        if ( t < 0 || misses - (unsigned)t >= cacheSize )
+        {
+            t = misses++;
+        }
+    }
+    return misses;
+}
+
+osg::DrawElements*
+IndexOptimizer::createDrawElements(const std::vector<GLuint>& indices, unsigned numVerts)
+{
+    osg::DrawElements* de =
+        numVerts > 0x10000 ? (osg::DrawElements*) new osg::DrawElementsUInt  ( GL_TRIANGLES ) :
+        numVerts > 0x100   ? (osg::DrawElements*) new osg::DrawElementsUShort( GL_TRIANGLES ) :
+                             (osg::DrawElements*) new osg::DrawElementsUByte ( GL_TRIANGLES );
+
+    de->reserveElements( indices.size() );
+    for(std::vector<GLuint>::const_iterator i = indices.begin(); i != indices.end(); ++i)
+        de->addElement( *i );
+
+    return de;
+}
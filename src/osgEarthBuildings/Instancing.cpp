@@ -0,0 +1,179 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "Instancing"
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/NodeVisitor>
+#include <osg/TextureBuffer>
+#include <osg/VertexAttribDivisor>
+#include <osgEarth/ObjectIndex>
+#include <osgEarth/Registry>
+#include <osgEarth/VirtualProgram>
+
+#define LC "[Instancing] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define TBO_SAMPLER "oeb_instance_tbo"
+
+namespace
+{
+    const char* instancingVS =
+        "#version " GLSL_VERSION_STR "\n"
+        "#extension GL_EXT_gpu_shader4 : enable\n"
+        "#extension GL_ARB_draw_instanced: enable\n"
+        "uniform samplerBuffer " TBO_SAMPLER ";\n"
+        "vec3 vp_Normal;\n"
+        "void oeb_instancing_vertex(inout vec4 VertexMODEL)\n"
+        "{\n"
+        "    int index = 4 * gl_InstanceID;\n"
+        "    mat4 xform = mat4(\n"
+        "        texelFetch(" TBO_SAMPLER ", index  ),\n"
+        "        texelFetch(" TBO_SAMPLER ", index+1),\n"
+        "        texelFetch(" TBO_SAMPLER ", index+2),\n"
+        "        texelFetch(" TBO_SAMPLER ", index+3) );\n"
+        "    VertexMODEL = xform * VertexMODEL;\n"
+        // Normals take the inverse transpose, so they stay perpendicular under
+        // the non-uniform scale of parametric instances. The cofactor matrix is
+        // that up to a factor of the determinant, whose sign we keep.
+        "    mat3 m = mat3(xform);\n"
+        "    mat3 cof = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));\n"
+        "    vp_Normal = normalize(cof * vp_Normal) * sign(dot(m[0], cof[0]));\n"
+        "}\n";
+
+    // Sets the instance count on every primitive set, and a bound that
+    // covers all the instances since culling can't see them.
+    struct SetupGeometries : public osg::NodeVisitor
+    {
+        const Instancing::MatrixVector& _matrices;
+        unsigned _first, _count;
+        osg::ref_ptr<osg::UIntArray> _objectIDs;
+
+        SetupGeometries(const Instancing::MatrixVector& matrices, unsigned first, unsigned count, osg::UIntArray* objectIDs) :
+            osg::NodeVisitor(TRAVERSE_ALL_CHILDREN),
+            _matrices(matrices), _first(first), _count(count), _objectIDs(objectIDs)
+        {
+            setNodeMaskOverride(~0);
+        }
+
+        void apply(osg::Geode& geode)
+        {
+            for(unsigned i=0; i<geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( !geom )
+                    continue;
+
+                geom->setUseDisplayList( false );
+                geom->setUseVertexBufferObjects( true );
+
+                for(unsigned p=0; p<geom->getNumPrimitiveSets(); ++p)
+                    geom->getPrimitiveSet(p)->setNumInstances( _count );
+
+                if ( _objectIDs.valid() )
+                    geom->setVertexAttribArray( Registry::objectIndex()->getObjectIDAttribLocation(), _objectIDs.get() );
+
+                const osg::BoundingBox& local = geom->getBoundingBox();
+                osg::BoundingBox bound;
+                for(unsigned m=_first; m<_first+_count; ++m)
+                    for(unsigned c=0; c<8; ++c)
+                        bound.expandBy( local.corner(c) * _matrices[m] );
+
+                geom->setInitialBound( bound );
+                geom->dirtyBound();
+            }
+        }
+    };
+}
+
+osg::Group*
+Instancing::createInstancedGroup(osg::Node*                   model,
+                                 const MatrixVector&          matrices,
+                                 const std::vector<unsigned>* objectIDs)
+{
+    osg::Group* group = new osg::Group();
+
+    if ( !model || matrices.empty() )
+        return group;
+
+    for(unsigned first=0; first<matrices.size(); first += MAX_INSTANCES_PER_BATCH)
+    {
+        unsigned count = osg::minimum( (unsigned)matrices.size()-first, MAX_INSTANCES_PER_BATCH );
+
+        // the first batch uses the model as-is; others share its arrays.
+        osg::ref_ptr<osg::Node> batch = first == 0u ? model : osg::clone(
+            model,
+            osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES | osg::CopyOp::DEEP_COPY_PRIMITIVES );
+
+        // pack the matrices, one per four texels:
+        osg::Image* image = new osg::Image();
+        image->allocateImage( 4*count, 1, 1, GL_RGBA, GL_FLOAT );
+        image->setInternalTextureFormat( GL_RGBA32F_ARB );
+        float* ptr = (float*)image->data();
+        for(unsigned m=first; m<first+count; ++m)
+        {
+            const osg::Matrix& mat = matrices[m];
+            for(int row=0; row<4; ++row)
+                for(int col=0; col<4; ++col)
+                    *ptr++ = (float)mat(row, col);
+        }
+
+        osg::TextureBuffer* tbo = new osg::TextureBuffer( image );
+        tbo->setInternalFormat( GL_RGBA32F_ARB );
+        tbo->setUnRefImageDataAfterApply( false );
+
+        osg::StateSet* ss = new osg::StateSet();
+        ss->setTextureAttribute( TBO_UNIT, tbo );
+        ss->addUniform( new osg::Uniform(TBO_SAMPLER, TBO_UNIT) );
+
+        // one object ID per instance:
+        osg::ref_ptr<osg::UIntArray> batchIDs;
+        if ( objectIDs && objectIDs->size() == matrices.size() )
+        {
+            batchIDs = new osg::UIntArray( objectIDs->begin()+first, objectIDs->begin()+first+count );
+            batchIDs->setBinding( osg::Array::BIND_PER_VERTEX );
+            batchIDs->setNormalize( false );
+            batchIDs->setPreserveDataType( true );
+
+            ss->setAttribute( new osg::VertexAttribDivisor(Registry::objectIndex()->getObjectIDAttribLocation(), 1) );
+        }
+
+        osg::Group* batchGroup = new osg::Group();
+        batchGroup->setStateSet( ss );
+        batchGroup->addChild( batch.get() );
+        group->addChild( batchGroup );
+
+        SetupGeometries setup( matrices, first, count, batchIDs.get() );
+        batch->accept( setup );
+    }
+
+    return group;
+}
+
+void
+Instancing::install(osg::StateSet* stateSet)
+{
+    if ( !stateSet )
+        return;
+
+    VirtualProgram* vp = VirtualProgram::getOrCreate( stateSet );
+    vp->setName( "Building instancing" );
+    vp->setFunction( "oeb_instancing_vertex", instancingVS, ShaderComp::LOCATION_VERTEX_MODEL, -FLT_MAX );
+}
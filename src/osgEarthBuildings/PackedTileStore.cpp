@@ -0,0 +1,459 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "PackedTileStore"
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <OpenThreads/Atomic>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#  include <process.h>
+#  define GETPID _getpid
+#  define FSEEK  _fseeki64
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define GETPID getpid
+#  define FSEEK  fseeko
+#endif
+
+#define LC "[PackedTileStore] "
+
+#define PACK_EXTENSION  "oebp"
+#define INDEX_EXTENSION "oebi"
+
+// A writer starts a new pack when its pack grows past this.
+#define MAX_PACK_SIZE (size_t(1) << 30)
+
+// Records start on 8-byte boundaries, which keeps decoded arrays aligned.
+#define RECORD_ALIGNMENT 8u
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    /** TileBlob pointing into a pack mapping. */
+    class PackedTileBlob : public TileBlob
+    {
+    public:
+        PackedTileBlob(osg::Referenced* mapping, const char* data, size_t size, TimeStamp timestamp) :
+            _mapping(mapping)
+        {
+            _data = data;
+            _size = size;
+            _lastModified = timestamp;
+        }
+
+    protected:
+        virtual ~PackedTileBlob() { }
+        osg::ref_ptr<osg::Referenced> _mapping;
+    };
+
+    // Journal record: key length, key, offset, size, timestamp.
+    bool writeIndexRecord(FILE* file, const std::string& key, size_t offset, unsigned size, TimeStamp timestamp)
+    {
+        unsigned keyLength = key.size();
+        unsigned long long offset64 = offset;
+        long long timestamp64 = timestamp;
+        return
+            ::fwrite(&keyLength, sizeof(keyLength), 1, file) == 1 &&
+            ::fwrite(key.data(), 1, keyLength, file) == keyLength &&
+            ::fwrite(&offset64, sizeof(offset64), 1, file) == 1 &&
+            ::fwrite(&size, sizeof(size), 1, file) == 1 &&
+            ::fwrite(&timestamp64, sizeof(timestamp64), 1, file) == 1;
+    }
+
+    bool readIndexRecord(FILE* file, std::string& key, size_t& offset, unsigned& size, TimeStamp& timestamp)
+    {
+        unsigned keyLength;
+        unsigned long long offset64;
+        long long timestamp64;
+
+        if ( ::fread(&keyLength, sizeof(keyLength), 1, file) != 1 || keyLength > 4096u )
+            return false;
+
+        key.resize( keyLength );
+        if ( keyLength > 0u && ::fread(&key[0], 1, keyLength, file) != keyLength )
+            return false;
+
+        if ( ::fread(&offset64, sizeof(offset64), 1, file) != 1 ||
+             ::fread(&size, sizeof(size), 1, file) != 1 ||
+             ::fread(&timestamp64, sizeof(timestamp64), 1, file) != 1 )
+            return false;
+
+        offset = (size_t)offset64;
+        timestamp = (TimeStamp)timestamp64;
+        return true;
+    }
+
+    size_t getFileSize(const std::string& fileName)
+    {
+        struct stat st;
+        return ::stat(fileName.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+    }
+}
+
+//...................................................................
+
+PackedTileStore::Mapping*
+PackedTileStore::Mapping::open(const std::string& fileName)
+{
+#ifdef _WIN32
+    // no mapping on Windows (yet); see readEntry.
+    return 0L;
+#else
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0L;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return 0L;
+    }
+
+    void* ptr = ::mmap(0L, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (ptr == MAP_FAILED)
+        return 0L;
+
+    return new Mapping(ptr, (size_t)st.st_size);
+#endif
+}
+
+PackedTileStore::Mapping::Mapping(void* ptr, size_t size) :
+data( (const char*)ptr ),
+size( size ),
+_ptr( ptr )
+{
+    //nop
+}
+
+PackedTileStore::Mapping::~Mapping()
+{
+#ifndef _WIN32
+    ::munmap(_ptr, size);
+#endif
+}
+
+//...................................................................
+
+PackedTileStore::PackedTileStore(const std::string& rootPath) :
+_rootPath( rootPath ),
+_liveBytes( 0 ),
+_packBytes( 0 ),
+_packFile( 0L ),
+_indexFile( 0L ),
+_writePack( 0u ),
+_writeOffset( 0 )
+{
+    osgDB::makeDirectory( _rootPath );
+    load();
+}
+
+PackedTileStore::~PackedTileStore()
+{
+    closeWriter();
+}
+
+std::string
+PackedTileStore::getFileName(const std::string& name, const char* extension) const
+{
+    return osgDB::concatPaths( _rootPath, name + "." + extension );
+}
+
+void
+PackedTileStore::load()
+{
+    // Writer names start with their creation time, so sorting them replays
+    // the journals roughly in the order they were written.
+    std::vector<std::string> names;
+    osgDB::DirectoryContents contents = osgDB::getDirectoryContents( _rootPath );
+    for(osgDB::DirectoryContents::const_iterator i = contents.begin(); i != contents.end(); ++i)
+    {
+        if ( osgDB::getLowerCaseFileExtension(*i) == INDEX_EXTENSION )
+            names.push_back( osgDB::getNameLessExtension(*i) );
+    }
+    std::sort( names.begin(), names.end() );
+
+    for(std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); ++name)
+    {
+        loadIndex( *name );
+    }
+
+    OE_INFO << LC << "Opened " << _rootPath << ": " << _entries.size() << " tiles in " << _packs.size() << " packs\n";
+}
+
+void
+PackedTileStore::loadIndex(const std::string& name)
+{
+    FILE* file = ::fopen( getFileName(name, INDEX_EXTENSION).c_str(), "rb" );
+    if ( !file )
+        return;
+
+    size_t packSize = getFileSize( getFileName(name, PACK_EXTENSION) );
+
+    Pack pack;
+    pack.name = name;
+    unsigned packIndex = _packs.size();
+    _packs.push_back( pack );
+    _packBytes += packSize;
+
+    std::string key;
+    Entry entry;
+    entry.pack = packIndex;
+    while( readIndexRecord(file, key, entry.offset, entry.size, entry.timestamp) )
+    {
+        // a journal entry can outlive the end of its pack after a crash.
+        if ( entry.offset + entry.size > packSize )
+            break;
+
+        std::map<std::string, Entry>::iterator i = _entries.find(key);
+        if ( i == _entries.end() )
+        {
+            _entries[key] = entry;
+            _liveBytes += entry.size;
+        }
+        else if ( entry.timestamp >= i->second.timestamp )
+        {
+            _liveBytes -= i->second.size;
+            i->second = entry;
+            _liveBytes += entry.size;
+        }
+    }
+
+    ::fclose( file );
+}
+
+bool
+PackedTileStore::openWriter()
+{
+    closeWriter();
+
+    // unique per process and per writer so concurrent writers don't collide:
+    static OpenThreads::Atomic s_sequence;
+    std::string name = Stringify()
+        << std::setw(12) << std::setfill('0') << (unsigned long long)::time(0)
+        << "_" << GETPID() << "_" << (++s_sequence);
+
+    _packFile = ::fopen( getFileName(name, PACK_EXTENSION).c_str(), "wb" );
+    _indexFile = ::fopen( getFileName(name, INDEX_EXTENSION).c_str(), "wb" );
+    if ( !_packFile || !_indexFile )
+    {
+        OE_WARN << LC << "Failed to create pack " << name << " in " << _rootPath << "\n";
+        closeWriter();
+        return false;
+    }
+
+    Pack pack;
+    pack.name = name;
+    _writePack = _packs.size();
+    _packs.push_back( pack );
+    _writeOffset = 0;
+    return true;
+}
+
+void
+PackedTileStore::closeWriter()
+{
+    if ( _packFile )
+        ::fclose( _packFile );
+    if ( _indexFile )
+        ::fclose( _indexFile );
+    _packFile = 0L;
+    _indexFile = 0L;
+}
+
+bool
+PackedTileStore::append(const std::string& key, const char* data, size_t size, TimeStamp timestamp)
+{
+    if ( !_packFile || _writeOffset >= MAX_PACK_SIZE )
+    {
+        if ( !openWriter() )
+            return false;
+    }
+
+    size_t pad = (RECORD_ALIGNMENT - (_writeOffset % RECORD_ALIGNMENT)) % RECORD_ALIGNMENT;
+    static const char zeros[RECORD_ALIGNMENT] = { 0 };
+
+    size_t offset = _writeOffset + pad;
+
+    // the record goes in first, so the journal never refers to missing data.
+    if ( ::fwrite(zeros, 1, pad, _packFile) != pad ||
+         ::fwrite(data, 1, size, _packFile) != size ||
+         ::fflush(_packFile) != 0 ||
+         !writeIndexRecord(_indexFile, key, offset, (unsigned)size, timestamp) ||
+         ::fflush(_indexFile) != 0 )
+    {
+        OE_WARN << LC << "Failed to write " << key << " to pack " << _packs[_writePack].name << "\n";
+        // whatever got written is garbage now; continue in a new pack.
+        closeWriter();
+        return false;
+    }
+
+    _writeOffset = offset + size;
+    _packBytes += pad + size;
+
+    Entry entry;
+    entry.pack = _writePack;
+    entry.offset = offset;
+    entry.size = size;
+    entry.timestamp = timestamp;
+
+    std::map<std::string, Entry>::iterator i = _entries.find(key);
+    if ( i != _entries.end() )
+        _liveBytes -= i->second.size;
+    _entries[key] = entry;
+    _liveBytes += size;
+
+    return true;
+}
+
+bool
+PackedTileStore::write(const std::string& key, const char* data, size_t size)
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    return append( key, data, size, (TimeStamp)::time(0) );
+}
+
+TileBlob*
+PackedTileStore::readEntry(const Entry& entry)
+{
+    Pack& pack = _packs[entry.pack];
+
+#ifdef _WIN32
+    // no mapping on Windows (yet); read the record.
+    FILE* file = ::fopen( getFileName(pack.name, PACK_EXTENSION).c_str(), "rb" );
+    if ( !file )
+        return 0L;
+
+    std::string buffer( entry.size, '\0' );
+    bool ok =
+        FSEEK(file, entry.offset, SEEK_SET) == 0 &&
+        (entry.size == 0u || ::fread(&buffer[0], 1, entry.size, file) == entry.size);
+    ::fclose( file );
+
+    return ok ? new BufferTileBlob(buffer, entry.timestamp) : 0L;
+#else
+    // packs grow, so map again when a record lies past the current mapping.
+    if ( !pack.mapping.valid() || entry.offset + entry.size > pack.mapping->size )
+    {
+        pack.mapping = Mapping::open( getFileName(pack.name, PACK_EXTENSION) );
+    }
+
+    if ( !pack.mapping.valid() || entry.offset + entry.size > pack.mapping->size )
+    {
+        OE_WARN << LC << "Pack " << pack.name << " is missing or truncated\n";
+        return 0L;
+    }
+
+    return new PackedTileBlob( pack.mapping.get(), pack.mapping->data + entry.offset, entry.size, entry.timestamp );
+#endif
+}
+
+TileBlob*
+PackedTileStore::read(const std::string& key)
+{
+    Threading::ScopedMutexLock lock(_mutex);
+
+    std::map<std::string, Entry>::const_iterator i = _entries.find(key);
+    if ( i == _entries.end() )
+        return 0L;
+
+    return readEntry( i->second );
+}
+
+bool
+PackedTileStore::compact()
+{
+    Threading::ScopedMutexLock lock(_mutex);
+
+    // copy the live records into fresh packs, keeping their timestamps.
+    std::map<std::string, Entry> entries;
+    entries.swap( _entries );
+    size_t liveBytes = _liveBytes;
+    _liveBytes = 0;
+
+    if ( !openWriter() )
+    {
+        _entries.swap( entries );
+        _liveBytes = liveBytes;
+        return false;
+    }
+
+    unsigned firstNewPack = _writePack;
+
+    for(std::map<std::string, Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i)
+    {
+        osg::ref_ptr<TileBlob> blob = readEntry( i->second );
+        if ( !blob.valid() || !append(i->first, blob->data(), blob->size(), i->second.timestamp) )
+        {
+            // leave the old packs alone; the new ones just duplicate records.
+            OE_WARN << LC << "Compaction of " << _rootPath << " failed at " << i->first << "\n";
+            for(std::map<std::string, Entry>::const_iterator j = i; j != entries.end(); ++j)
+            {
+                _entries.insert( *j );
+                _liveBytes += j->second.size;
+            }
+            return false;
+        }
+    }
+
+    closeWriter();
+
+    // Journals go first: if this is cut short, the surviving journals still
+    // only refer to packs that exist.
+    for(unsigned p = 0; p < firstNewPack; ++p)
+        ::remove( getFileName(_packs[p].name, INDEX_EXTENSION).c_str() );
+    for(unsigned p = 0; p < firstNewPack; ++p)
+        ::remove( getFileName(_packs[p].name, PACK_EXTENSION).c_str() );
+
+    // only the new packs are left.
+    _packs.erase( _packs.begin(), _packs.begin() + firstNewPack );
+    for(std::map<std::string, Entry>::iterator i = _entries.begin(); i != _entries.end(); ++i)
+        i->second.pack -= firstNewPack;
+
+    _packBytes = 0;
+    for(std::vector<Pack>::const_iterator p = _packs.begin(); p != _packs.end(); ++p)
+        _packBytes += getFileSize( getFileName(p->name, PACK_EXTENSION) );
+
+    OE_INFO << LC << "Compacted " << _rootPath << " to " << _entries.size() << " tiles, " << (_packBytes/1024u) << " KB\n";
+    return true;
+}
+
+PackedTileStore::Stats
+PackedTileStore::getStats() const
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    Stats stats;
+    stats.tiles = _entries.size();
+    stats.liveBytes = _liveBytes;
+    stats.packBytes = _packBytes;
+    stats.packs = _packs.size();
+    return stats;
+}
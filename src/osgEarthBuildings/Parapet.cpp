@@ -63,30 +63,89 @@ Parapet::setWidth(float width)
 }
 
 bool
-Parapet::build(const Polygon* footprint, BuildContext& bc)
+Parapet::build(const Polygon* in_footprint, BuildContext& bc)
 {
-    if ( getWidth() > 0.0f )
+    _capStrip.clear();
+
+    if ( getWidth() <= 0.0f )
+        return Elevation::build( in_footprint, bc );
+
+    if ( !in_footprint || !in_footprint->isValid() )
+        return false;
+
+    const Polygon* footprint = prepareFootprint( in_footprint, bc );
+    if ( !footprint || !footprint->isValid() )
+        return false;
+
+    bool direct = false;
+    const Polygon* inner = bc.getFootprintAnalysis( footprint )->getOffset( getWidth(), &direct );
+    if ( !inner )
+        return buildImpl( footprint, bc );
+
+    // Fast path: the parapet is a ring of quads between the outer wall and its
+    // inset; if the inset came straight from PolygonOffset, its vertices pair up
+    // with the outer ones and the roof cap can be built as a strip.
+    if ( direct && footprint->getSignedArea2D() > 0.0 )
     {
-        // copy the outer ring of the footprint. Ignore any holes.
-        osg::ref_ptr<Polygon> copy = dynamic_cast<Polygon*>(footprint->clone());
-    
-        // apply a negative buffer to the outer ring:
-        osg::ref_ptr<Geometry> hole;
-        BufferParameters bp(BufferParameters::CAP_DEFAULT, BufferParameters::JOIN_MITRE);
-        if ( copy->buffer(-getWidth(), hole, bp) )
-        {
-            Ring* ring = dynamic_cast<Ring*>( hole.get() );
-            if ( ring )
-            {
-                // rewind the new geometry CW and add it as a hole:
-                ring->rewind(Geometry::ORIENTATION_CW);
-                copy->getHoles().push_back( ring );
-                return Elevation::build( copy.get(), bc );
-            }
-        }
+        osg::ref_ptr<Polygon> copy = new Polygon();
+        copy->insert( copy->end(), footprint->begin(), footprint->begin()+inner->size() );
+
+        // add the inset as a CW hole:
+        Ring* hole = new Ring();
+        hole->insert( hole->end(), inner->rbegin(), inner->rend() );
+        copy->getHoles().push_back( hole );
+
+        if ( !buildImpl(copy.get(), bc) )
+            return false;
+
+        buildCapStrip( inner->size() );
+        return true;
     }
 
-    return Elevation::build( footprint, bc );
+    // Otherwise add the (buffered) inset as a hole and let the roof compiler
+    // tessellate the cap.
+    osg::ref_ptr<Polygon> copy = dynamic_cast<Polygon*>( footprint->clone() );
+
+    Ring* hole = new Ring();
+    hole->insert( hole->end(), inner->begin(), inner->end() );
+    hole->rewind( Geometry::ORIENTATION_CW );
+    copy->getHoles().push_back( hole );
+
+    return buildImpl( copy.get(), bc );
+}
+
+void
+Parapet::buildCapStrip(unsigned numCorners)
+{
+    // The outer wall and the inner (hole) wall were built from paired rings,
+    // the inner one in reverse order. Collect the source corners of each.
+    if ( _walls.size() != 2 )
+        return;
+
+    std::vector<const Corner*> outer, inner;
+    outer.reserve( numCorners );
+    inner.reserve( numCorners );
+
+    for(Faces::const_iterator f = _walls[0].faces.begin(); f != _walls[0].faces.end(); ++f)
+        if ( f->left.isFromSource )
+            outer.push_back( &f->left );
+
+    for(Faces::const_iterator f = _walls[1].faces.begin(); f != _walls[1].faces.end(); ++f)
+        if ( f->left.isFromSource )
+            inner.push_back( &f->left );
+
+    if ( outer.size() != numCorners || inner.size() != numCorners )
+        return;
+
+    // Alternate inner and outer corners so the strip winds CCW from above,
+    // and close it by repeating the first pair.
+    _capStrip.reserve( 2*(numCorners+1) );
+    for(unsigned i=0; i<=numCorners; ++i)
+    {
+        unsigned k = i % numCorners;
+        _capStrip.push_back( *inner[numCorners-1-k] );
+        _capStrip.push_back( *outer[k] );
+    }
 }
 
 Config
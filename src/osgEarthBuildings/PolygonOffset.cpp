@@ -0,0 +1,175 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "PolygonOffset"
+
+#define LC "[PolygonOffset] "
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+// same as the GEOS default mitre limit.
+const double PolygonOffset::MITRE_LIMIT = 5.0;
+
+namespace
+{
+    // twice the signed area of a ring in the XY plane (positive = CCW)
+    double signedArea2(const std::vector<osg::Vec3d>& p)
+    {
+        double a = 0.0;
+        for(unsigned i=0, j=p.size()-1; i<p.size(); j=i++)
+            a += p[j].x()*p[i].y() - p[i].x()*p[j].y();
+        return a;
+    }
+
+    inline double cross2(const osg::Vec3d& o, const osg::Vec3d& a, const osg::Vec3d& b)
+    {
+        return (a.x()-o.x())*(b.y()-o.y()) - (a.y()-o.y())*(b.x()-o.x());
+    }
+
+    // whether segments ab and cd properly intersect or touch.
+    bool segmentsIntersect(const osg::Vec3d& a, const osg::Vec3d& b, const osg::Vec3d& c, const osg::Vec3d& d)
+    {
+        // quick reject on bounding boxes:
+        if (osg::maximum(a.x(),b.x()) < osg::minimum(c.x(),d.x()) ||
+            osg::maximum(c.x(),d.x()) < osg::minimum(a.x(),b.x()) ||
+            osg::maximum(a.y(),b.y()) < osg::minimum(c.y(),d.y()) ||
+            osg::maximum(c.y(),d.y()) < osg::minimum(a.y(),b.y()))
+        {
+            return false;
+        }
+
+        double d1 = cross2(c, d, a);
+        double d2 = cross2(c, d, b);
+        double d3 = cross2(a, b, c);
+        double d4 = cross2(a, b, d);
+
+        return
+            ((d1 > 0.0 && d2 < 0.0) || (d1 < 0.0 && d2 > 0.0) || d1 == 0.0 || d2 == 0.0) &&
+            ((d3 > 0.0 && d4 < 0.0) || (d3 < 0.0 && d4 > 0.0) || d3 == 0.0 || d4 == 0.0);
+    }
+}
+
+bool
+PolygonOffset::isSelfIntersecting(const std::vector<osg::Vec3d>& p)
+{
+    unsigned n = p.size();
+    for(unsigned i=0; i<n; ++i)
+    {
+        const osg::Vec3d& a = p[i];
+        const osg::Vec3d& b = p[(i+1)%n];
+
+        // skip the adjacent edges, which always share an endpoint:
+        for(unsigned j=i+2; j<n; ++j)
+        {
+            if ( i == 0 && j == n-1 )
+                continue;
+
+            if ( segmentsIntersect(a, b, p[j], p[(j+1)%n]) )
+                return true;
+        }
+    }
+    return false;
+}
+
+bool
+PolygonOffset::offset(const Ring* ring, double distance, std::vector<osg::Vec3d>& output)
+{
+    output.clear();
+
+    if ( !ring )
+        return false;
+
+    // ignore a closing point:
+    unsigned n = ring->size();
+    if ( n > 1 && (*ring)[0] == (*ring)[n-1] )
+        --n;
+    if ( n < 3 )
+        return false;
+
+    std::vector<osg::Vec3d> input( ring->begin(), ring->begin()+n );
+
+    double area = signedArea2(input);
+    if ( area == 0.0 )
+        return false;
+
+    // the interior lies to the left of a CCW ring and to the right of a CW ring.
+    double side = area > 0.0 ? 1.0 : -1.0;
+
+    output.resize( n );
+
+    for(unsigned i=0; i<n; ++i)
+    {
+        const osg::Vec3d& prev = input[(i+n-1)%n];
+        const osg::Vec3d& curr = input[i];
+        const osg::Vec3d& next = input[(i+1)%n];
+
+        osg::Vec2d e0( curr.x()-prev.x(), curr.y()-prev.y() );
+        osg::Vec2d e1( next.x()-curr.x(), next.y()-curr.y() );
+        if ( e0.normalize() == 0.0 || e1.normalize() == 0.0 )
+            return false;
+
+        // inward normals of the adjoining edges:
+        osg::Vec2d n0( -e0.y()*side, e0.x()*side );
+        osg::Vec2d n1( -e1.y()*side, e1.x()*side );
+
+        osg::Vec2d mitre = n0 + n1;
+        if ( mitre.normalize() < 1e-6 )
+            return false;
+
+        double cosHalfAngle = mitre * n0;
+        if ( cosHalfAngle < 1.0/MITRE_LIMIT )
+            return false;
+
+        double d = distance / cosHalfAngle;
+        output[i].set( curr.x() + mitre.x()*d, curr.y() + mitre.y()*d, curr.z() );
+    }
+
+    // every offset edge must run in the same direction as its source edge;
+    // otherwise the offset has swept past a short edge and inverted.
+    for(unsigned i=0; i<n; ++i)
+    {
+        unsigned j = (i+1)%n;
+        osg::Vec3d a = input[j] - input[i];
+        osg::Vec3d b = output[j] - output[i];
+        if ( a.x()*b.x() + a.y()*b.y() <= 0.0 )
+            return false;
+    }
+
+    // winding must survive, and the offset edges must not overlap each other.
+    if ( signedArea2(output)*side <= 0.0 || isSelfIntersecting(output) )
+        return false;
+
+    return true;
+}
+
+Polygon*
+PolygonOffset::offset(const Polygon* polygon, double distance)
+{
+    if ( !polygon || !polygon->getHoles().empty() )
+        return 0L;
+
+    std::vector<osg::Vec3d> points;
+    if ( !offset(polygon, distance, points) )
+        return 0L;
+
+    Polygon* result = new Polygon();
+    result->insert( result->end(), points.begin(), points.end() );
+    return result;
+}
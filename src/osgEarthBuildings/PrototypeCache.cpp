@@ -0,0 +1,142 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "PrototypeCache"
+#include "Compiler"
+#include "CompilerOutput"
+#include <osgUtil/Optimizer>
+#include <osgEarth/Registry>
+#include <osgEarth/ShaderGenerator>
+#include <osgEarthSymbology/ResourceCache>
+
+#define LC "[PrototypeCache] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+PrototypeCache::PrototypeCache(StateSetCache* sscache) :
+_sscache( sscache )
+{
+    if ( !_sscache.valid() )
+        _sscache = new StateSetCache();
+}
+
+osg::Node*
+PrototypeCache::get(ModelResource*        model,
+                    Session*              session,
+                    TextureCache*         texCache,
+                    const osgDB::Options* readOptions,
+                    double*               shaderGenSaved)
+{
+    if ( shaderGenSaved )
+        *shaderGenSaved = 0.0;
+
+    if ( !model )
+        return 0L;
+
+    // The cache's lock only covers the lookup; the model is prepared under
+    // its own lock, so other threads wait only if they want the same model.
+    osg::ref_ptr<Prototype> proto;
+    {
+        Threading::ScopedMutexLock lock( _mutex );
+
+        osg::ref_ptr<Prototype>& entry = _prototypes[model];
+        if ( !entry.valid() )
+            entry = new Prototype();
+        proto = entry.get();
+
+        if ( !model->name().empty() && _modelsByName.find(model->name()) == _modelsByName.end() )
+            _modelsByName[model->name()] = model;
+    }
+
+    Threading::ScopedMutexLock lock( proto->mutex );
+
+    // remember failures too, so we don't retry a bad model on every tile.
+    if ( !proto->prepared )
+    {
+        proto->node = createPrototype( model, session, texCache, readOptions, proto->shaderGenTime );
+        proto->prepared = true;
+    }
+    else if ( shaderGenSaved && proto->node.valid() )
+    {
+        *shaderGenSaved = proto->shaderGenTime;
+    }
+    return proto->node.get();
+}
+
+ModelResource*
+PrototypeCache::findModel(const std::string& name) const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    ModelsByName::const_iterator i = _modelsByName.find( name );
+    return i != _modelsByName.end() ? i->second.get() : 0L;
+}
+
+osg::Node*
+PrototypeCache::createPrototype(ModelResource*        model,
+                                Session*              session,
+                                TextureCache*         texCache,
+                                const osgDB::Options* readOptions,
+                                double&               shaderGenTime)
+{
+    osg::ref_ptr<osg::Node> node;
+    TemplateModelResource* generated = dynamic_cast<TemplateModelResource*>(model);
+    if ( generated )
+    {
+        // A compiler's template has no file to load; prepare a copy of its node.
+        if ( generated->getNode() )
+        {
+            node = osg::clone( generated->getNode(), osg::CopyOp(
+                osg::CopyOp::DEEP_COPY_NODES |
+                osg::CopyOp::DEEP_COPY_DRAWABLES |
+                osg::CopyOp::DEEP_COPY_STATESETS) );
+        }
+    }
+
+    // Other instance models use the session's resource cache, so the model
+    // file is only read once even if the prototype cache is flushed.
+    else if ( !session || !session->getResourceCache() ||
+              !session->getResourceCache()->cloneOrCreateInstanceNode(model, node, readOptions) )
+    {
+        node = 0L;
+    }
+
+    if ( !node.valid() )
+    {
+        OE_WARN << LC << "Failed to materialize resource " << model->uri()->full() << "\n";
+        return 0L;
+    }
+
+    // remove any transforms since these will screw up instancing.
+    osgUtil::Optimizer optimizer;
+    optimizer.optimize(
+        node.get(),
+        optimizer.STATIC_OBJECT_DETECTION | optimizer.FLATTEN_STATIC_TRANSFORMS );
+
+    // share texture objects with the rest of the buildings.
+    if ( texCache )
+        texCache->consolidate( node.get() );
+
+    OE_START_TIMER(shaderGen);
+    Registry::instance()->shaderGenerator().run( node.get(), "Resource Model", _sscache.get() );
+    shaderGenTime = OE_GET_TIMER(shaderGen);
+
+    OE_DEBUG << LC << "Prepared prototype for " << model->uri()->full() << "\n";
+
+    return node.release();
+}
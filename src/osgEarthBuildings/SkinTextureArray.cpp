@@ -0,0 +1,148 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "SkinTextureArray"
+#include <osgEarth/ImageUtils>
+#include <osgEarth/StringUtils>
+
+#define LC "[SkinTextureArray] "
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    unsigned nextPowerOfTwo(unsigned v)
+    {
+        unsigned p = 1u;
+        while( p < v ) p <<= 1;
+        return p;
+    }
+}
+
+SkinTextureArray::SkinTextureArray() :
+_maxTextureSize( 1024u )
+{
+    //nop
+}
+
+bool
+SkinTextureArray::build(ResourceLibrary* library, const osgDB::Options* readOptions)
+{
+    if ( !library )
+        return false;
+
+    SkinResourceVector skins;
+    library->getSkins( skins, readOptions );
+
+    // Load the images of the skins that aren't already atlased:
+    std::vector< osg::ref_ptr<SkinResource> > layerSkins;
+    std::vector< osg::ref_ptr<osg::Image> >   layerImages;
+    unsigned s = 1u, t = 1u;
+
+    for(SkinResourceVector::iterator i = skins.begin(); i != skins.end(); ++i)
+    {
+        SkinResource* skin = i->get();
+
+        if (skin->imageLayer().isSet() || 
+            skin->imageBiasS().isSet() || skin->imageBiasT().isSet() ||
+            skin->imageScaleS().isSet() || skin->imageScaleT().isSet())
+        {
+            continue;
+        }
+
+        osg::ref_ptr<osg::Image> image = skin->createImage( readOptions );
+        if ( !image.valid() || image->s() < 1 || image->t() < 1 )
+        {
+            OE_WARN << LC << "Failed to load skin image " << skin->imageURI()->full() << "\n";
+            continue;
+        }
+
+        s = std::max(s, (unsigned)image->s());
+        t = std::max(t, (unsigned)image->t());
+
+        layerSkins.push_back( skin );
+        layerImages.push_back( image.get() );
+    }
+
+    if ( layerImages.empty() )
+        return false;
+
+    s = std::min( nextPowerOfTwo(s), _maxTextureSize );
+    t = std::min( nextPowerOfTwo(t), _maxTextureSize );
+
+    _texture = new osg::Texture2DArray();
+    _texture->setName( "oeb.skins" );
+    _texture->setTextureSize( s, t, layerImages.size() );
+    _texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR );
+    _texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+    _texture->setWrap  ( osg::Texture::WRAP_S, osg::Texture::REPEAT );
+    _texture->setWrap  ( osg::Texture::WRAP_T, osg::Texture::REPEAT );
+    _texture->setResizeNonPowerOfTwoHint( false );
+    _texture->setUnRefImageDataAfterApply( false );
+
+    // All layers must have the same size and format.
+    unsigned layer = 0;
+    for(unsigned i=0; i<layerImages.size(); ++i)
+    {
+        osg::ref_ptr<osg::Image> image = ImageUtils::convertToRGBA8( layerImages[i].get() );
+        if ( image.valid() && ((unsigned)image->s() != s || (unsigned)image->t() != t) )
+        {
+            osg::ref_ptr<osg::Image> resized;
+            if ( ImageUtils::resizeImage(image.get(), s, t, resized) )
+                image = resized.get();
+            else
+                image = 0L;
+        }
+
+        if ( !image.valid() )
+        {
+            OE_WARN << LC << "Failed to prepare skin image " << layerSkins[i]->imageURI()->full() << "\n";
+            continue;
+        }
+
+        // A unique name so that cached tiles can find the shared texture again.
+        image->setFileName( Stringify() << layerSkins[i]->imageURI()->full() << "#" << layer );
+
+        _texture->setImage( layer, image.get() );
+        layerSkins[i]->imageLayer() = layer;
+        _skins.insert( layerSkins[i].get() );
+        ++layer;
+    }
+
+    if ( layer == 0 )
+    {
+        _texture = 0L;
+        return false;
+    }
+
+    _texture->setTextureDepth( layer );
+
+    _stateSet = new osg::StateSet();
+    _stateSet->setTextureAttributeAndModes( 0, _texture.get(), osg::StateAttribute::ON );
+
+    OE_INFO << LC << "Loaded " << layer << " skins into a " << s << "x" << t << " texture array\n";
+    return true;
+}
+
+bool
+SkinTextureArray::contains(const SkinResource* skin) const
+{
+    return _skins.find(skin) != _skins.end();
+}
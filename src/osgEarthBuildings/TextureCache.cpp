@@ -0,0 +1,492 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TextureCache"
+#include <osg/Texture2D>
+#include <osg/TextureBuffer>
+#include <osgEarth/NodeUtils>
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <osgEarth/URI>
+#include <algorithm>
+
+#define LC "[TextureCache] "
+
+// Fraction of the budget to evict down to, so eviction doesn't run on every load.
+#define EVICT_TO_FRACTION 0.9
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    size_t textureSize(const osg::Texture* tex)
+    {
+        size_t bytes = 0;
+        if ( tex )
+        {
+            for (unsigned i = 0; i < tex->getNumImages(); ++i)
+            {
+                const osg::Image* image = tex->getImage(i);
+                if ( image )
+                    bytes += image->getTotalSizeInBytesIncludingMipmaps();
+            }
+        }
+        return bytes;
+    }
+
+    struct ConsolidateTextures : public TextureAndImageVisitor
+    {
+        TextureCache* _cache;
+        ConsolidateTextures(TextureCache* cache) : _cache(cache) { }
+        void apply(osg::StateSet& stateSet)
+        {
+            osg::StateSet::TextureAttributeList& a = stateSet.getTextureAttributeList();
+            for (osg::StateSet::TextureAttributeList::iterator i = a.begin(); i != a.end(); ++i)
+            {
+                osg::StateSet::AttributeList& b = *i;
+                for (osg::StateSet::AttributeList::iterator j = b.begin(); j != b.end(); ++j)
+                {
+                    osg::StateAttribute* sa = j->second.first.get();
+                    if (sa)
+                    {
+                        osg::Texture* tex = dynamic_cast<osg::Texture*>(sa);
+                        if (tex)
+                        {
+                            osg::ref_ptr<osg::Texture> sharedTex = _cache->getOrInsert(tex);
+                            if (sharedTex.valid() && sharedTex.get() != tex)
+                            {
+                                j->second.first = sharedTex.get();
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    // True if nothing outside the cache holds "texture" or "stateSet".
+    // The caller holds the entry's mutex.
+    bool isUnused(const osg::Texture* texture, const osg::StateSet* stateSet)
+    {
+        int internalRefs = 1;
+        if ( stateSet )
+        {
+            if ( stateSet->referenceCount() > 1 )
+                return false;
+            if ( stateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE) == texture )
+                ++internalRefs;
+        }
+        return texture->referenceCount() <= internalRefs;
+    }
+
+    struct EvictionCandidate
+    {
+        unsigned    lastUsed;
+        unsigned    shard;
+        std::string key;
+        bool operator < (const EvictionCandidate& rhs) const { return lastUsed < rhs.lastUsed; }
+    };
+}
+
+TextureCache::TextureCache() :
+_budget   ( 0 ),
+_clock    ( 0 ),
+_hits     ( 0 ),
+_misses   ( 0 ),
+_evictions( 0 ),
+_entries  ( 0 ),
+_bytes    ( 0 )
+{
+    //nop
+}
+
+TextureCache::Shard&
+TextureCache::getShard(const std::string& key)
+{
+    return _shards[hashString(key) % NUM_SHARDS];
+}
+
+osg::ref_ptr<TextureCache::Entry>
+TextureCache::getEntry(const std::string& key)
+{
+    // Only the lookup happens under the shard lock; the caller loads the
+    // texture under the entry's own lock. The returned reference keeps the
+    // entry from being evicted while the caller uses it.
+    Shard& shard = getShard(key);
+    Threading::ScopedMutexLock lock(shard.mutex);
+    osg::ref_ptr<Entry>& entry = shard.entries[key];
+    if ( !entry.valid() )
+        entry = new Entry();
+    return entry;
+}
+
+void
+TextureCache::remove(const std::string& key, Entry* entry)
+{
+    Shard& shard = getShard(key);
+    Threading::ScopedMutexLock lock(shard.mutex);
+    Entries::iterator i = shard.entries.find(key);
+    if ( i != shard.entries.end() && i->second.get() == entry )
+        shard.entries.erase( i );
+}
+
+bool
+TextureCache::loadSkin(Entry* entry, SkinResource* skin, const osgDB::Options* readOptions)
+{
+    // entry->mutex is held by the caller.
+    if ( entry->texture.valid() )
+    {
+        ++_hits;
+        return false;
+    }
+
+    entry->texture = skin->createTexture(readOptions);
+    if ( !entry->texture.valid() )
+        return false;
+
+    ++_misses;
+    entry->bytes = textureSize(entry->texture.get());
+    return true;
+}
+
+void
+TextureCache::added(Entry* entry)
+{
+    bool overBudget;
+    {
+        Threading::ScopedMutexLock lock(_statsMutex);
+        ++_entries;
+        _bytes += entry->bytes;
+        overBudget = _budget > 0 && _bytes > _budget;
+    }
+
+    if ( overBudget )
+        evict();
+}
+
+osg::ref_ptr<osg::Texture>
+TextureCache::get(SkinResource* skin, const osgDB::Options* readOptions)
+{
+    osg::ref_ptr<Entry> entry = getEntry(skin->imageURI()->full());
+    osg::ref_ptr<osg::Texture> result;
+    bool loaded;
+    {
+        Threading::ScopedMutexLock lock(entry->mutex);
+        loaded = loadSkin(entry.get(), skin, readOptions);
+        entry->lastUsed = ++_clock;
+        result = entry->texture.get();
+    }
+
+    if ( loaded )
+        added(entry.get());
+
+    return result;
+}
+
+osg::ref_ptr<osg::Texture>
+TextureCache::getOrInsert(osg::Texture* tex)
+{
+    osg::ref_ptr<osg::Texture> result = tex;
+
+    if (tex && 
+        tex->getNumImages() > 0 &&                      
+        tex->getImage(0) &&
+        !tex->getImage(0)->getFileName().empty() &&     // has a valid filename
+        dynamic_cast<osg::TextureBuffer*>(tex) == 0L)   // isn't an instance data texture
+    {
+        osg::ref_ptr<Entry> entry = getEntry(tex->getImage(0)->getFileName());
+        bool inserted = false;
+        {
+            Threading::ScopedMutexLock lock(entry->mutex);
+            if ( entry->texture.valid() )
+            {
+                ++_hits;
+            }
+            else
+            {
+                ++_misses;
+                entry->texture = tex;
+                entry->bytes = textureSize(tex);
+                inserted = true;
+            }
+            entry->lastUsed = ++_clock;
+            result = entry->texture.get();
+        }
+
+        if ( inserted )
+            added(entry.get());
+    }
+
+    return result;
+}
+
+osg::ref_ptr<osg::StateSet>
+TextureCache::getSkinStateSet(SkinResource* skin, const osgDB::Options* readOptions, bool& reused)
+{
+    osg::ref_ptr<Entry> entry = getEntry(skin->imageURI()->full());
+    osg::ref_ptr<osg::StateSet> result;
+    bool loaded;
+    {
+        Threading::ScopedMutexLock lock(entry->mutex);
+        loaded = loadSkin(entry.get(), skin, readOptions);
+        reused = entry->stateSet.valid();
+        if ( entry->texture.valid() )
+        {
+            if ( !entry->stateSet.valid() )
+            {
+                entry->stateSet = new osg::StateSet();
+                entry->stateSet->setTextureAttributeAndModes(0, entry->texture.get(), osg::StateAttribute::ON);
+            }
+            entry->lastUsed = ++_clock;
+            result = entry->stateSet.get();
+        }
+    }
+
+    if ( loaded )
+    {
+        added(entry.get());
+    }
+    else if ( !result.valid() )
+    {
+        // don't cache a failed load; the next tile tries again.
+        remove(skin->imageURI()->full(), entry.get());
+        result = new osg::StateSet();
+    }
+
+    return result;
+}
+
+osg::ref_ptr<osg::StateSet>
+TextureCache::getSkinStateSet(const std::string& stateKey, const osgDB::Options* readOptions)
+{
+    if ( !TextureStore::isContentKey(stateKey) )
+        return getStateSet(stateKey, std::string(), readOptions);
+
+    // A content key shares the entry of its image URI. Its own entry only
+    // remembers that URI so the store is asked once, and goes away with it.
+    if ( !_store.valid() )
+        return 0L;
+
+    osg::ref_ptr<Entry> alias = getEntry(stateKey);
+    std::string imageURI;
+    {
+        Threading::ScopedMutexLock lock(alias->mutex);
+        if ( alias->alias.empty() && !_store->getURI(stateKey, alias->alias) )
+            alias->alias.clear();
+        imageURI = alias->alias;
+    }
+
+    osg::ref_ptr<osg::StateSet> result;
+    if ( !imageURI.empty() )
+        result = getStateSet(imageURI, stateKey, readOptions);
+
+    if ( !result.valid() )
+        remove(stateKey, alias.get());
+
+    return result;
+}
+
+osg::ref_ptr<osg::StateSet>
+TextureCache::getStateSet(const std::string& imageURI, const std::string& contentKey, const osgDB::Options* readOptions)
+{
+    osg::ref_ptr<Entry> entry = getEntry(imageURI);
+    osg::ref_ptr<osg::StateSet> result;
+    bool loaded = false;
+    {
+        Threading::ScopedMutexLock lock(entry->mutex);
+        if ( entry->texture.valid() )
+        {
+            ++_hits;
+        }
+        else
+        {
+            // prefer the copy in the texture store; the URI may not be reachable.
+            osg::ref_ptr<osg::Image> image;
+            if ( !contentKey.empty() )
+            {
+                std::string storedURI;
+                image = _store->get(contentKey, readOptions, storedURI);
+            }
+            if ( !image.valid() )
+                image = URI(imageURI).getImage( readOptions );
+
+            if ( image.valid() )
+            {
+                // same texture setup as SkinResource::createTexture.
+                osg::Texture2D* tex = new osg::Texture2D( image.get() );
+                tex->setWrap( osg::Texture::WRAP_S, osg::Texture::REPEAT );
+                tex->setWrap( osg::Texture::WRAP_T, osg::Texture::REPEAT );
+                tex->setResizeNonPowerOfTwoHint( false );
+                tex->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+                tex->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR );
+                tex->setMaxAnisotropy( 4.0f );
+                entry->texture = tex;
+                entry->bytes = textureSize(tex);
+                ++_misses;
+                loaded = true;
+            }
+        }
+
+        if ( entry->texture.valid() )
+        {
+            if ( !entry->stateSet.valid() )
+            {
+                entry->stateSet = new osg::StateSet();
+                entry->stateSet->setTextureAttributeAndModes(0, entry->texture.get(), osg::StateAttribute::ON);
+            }
+            if ( !contentKey.empty() && std::find(entry->aliases.begin(), entry->aliases.end(), contentKey) == entry->aliases.end() )
+            {
+                entry->aliases.push_back( contentKey );
+            }
+            entry->lastUsed = ++_clock;
+            result = entry->stateSet.get();
+        }
+    }
+
+    if ( loaded )
+        added(entry.get());
+    else if ( !result.valid() )
+        remove(imageURI, entry.get());
+
+    return result;
+}
+
+void
+TextureCache::consolidate(osg::Node* node)
+{
+    if ( node )
+    {
+        ConsolidateTextures visitor( this );
+        node->accept( visitor );
+    }
+}
+
+void
+TextureCache::evict()
+{
+    // one thread evicts at a time; the others just carry on.
+    if ( _evictMutex.trylock() != 0 )
+        return;
+
+    size_t target = (size_t)(EVICT_TO_FRACTION * (double)_budget);
+
+    // An entry referenced outside its shard is being loaded or used right
+    // now, and one locked by another thread is too; both are skipped.
+    std::vector<EvictionCandidate> candidates;
+    for (unsigned s = 0; s < NUM_SHARDS; ++s)
+    {
+        Shard& shard = _shards[s];
+        Threading::ScopedMutexLock lock(shard.mutex);
+        for (Entries::iterator i = shard.entries.begin(); i != shard.entries.end(); ++i)
+        {
+            Entry* entry = i->second.get();
+            if ( entry->referenceCount() > 1 || entry->mutex.trylock() != 0 )
+                continue;
+
+            if ( entry->texture.valid() && isUnused(entry->texture.get(), entry->stateSet.get()) )
+            {
+                EvictionCandidate c;
+                c.lastUsed = entry->lastUsed;
+                c.shard    = s;
+                c.key      = i->first;
+                candidates.push_back( c );
+            }
+            entry->mutex.unlock();
+        }
+    }
+
+    // least recently used first.
+    std::sort( candidates.begin(), candidates.end() );
+
+    unsigned count = 0;
+    size_t   freed = 0;
+    for (std::vector<EvictionCandidate>::const_iterator c = candidates.begin(); c != candidates.end(); ++c)
+    {
+        {
+            Threading::ScopedMutexLock lock(_statsMutex);
+            if ( _bytes <= target )
+                break;
+        }
+
+        std::vector<std::string> aliases;
+        size_t bytes = 0;
+        {
+            Shard& shard = _shards[c->shard];
+            Threading::ScopedMutexLock lock(shard.mutex);
+            Entries::iterator i = shard.entries.find(c->key);
+            if ( i == shard.entries.end() )
+                continue;
+
+            // check again, it may have been used since.
+            Entry* entry = i->second.get();
+            if ( entry->referenceCount() > 1 || entry->mutex.trylock() != 0 )
+                continue;
+
+            bool unused = entry->texture.valid() && isUnused(entry->texture.get(), entry->stateSet.get());
+            if ( unused )
+            {
+                bytes = entry->bytes;
+                aliases.swap( entry->aliases );
+            }
+            entry->mutex.unlock();
+
+            if ( !unused )
+                continue;
+
+            shard.entries.erase( i );
+        }
+
+        // content keys pointing at the texture go with it.
+        for (std::vector<std::string>::const_iterator a = aliases.begin(); a != aliases.end(); ++a)
+        {
+            Shard& shard = getShard(*a);
+            Threading::ScopedMutexLock lock(shard.mutex);
+            shard.entries.erase( *a );
+        }
+
+        ++_evictions;
+        ++count;
+        freed += bytes;
+
+        Threading::ScopedMutexLock statsLock(_statsMutex);
+        --_entries;
+        _bytes -= std::min(bytes, _bytes);
+    }
+
+    _evictMutex.unlock();
+
+    if ( count > 0 )
+    {
+        OE_DEBUG << LC << "Evicted " << count << " textures (" << (freed/1024) << " KB)\n";
+    }
+}
+
+TextureCache::Stats
+TextureCache::getStats() const
+{
+    Stats stats;
+    stats.hits      = _hits;
+    stats.misses    = _misses;
+    stats.evictions = _evictions;
+
+    Threading::ScopedMutexLock lock(_statsMutex);
+    stats.entries = _entries;
+    stats.bytes   = _bytes;
+    return stats;
+}
@@ -0,0 +1,211 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TextureStore"
+#include "TileFormat"
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <osgEarth/URI>
+#include <osgDB/FileNameUtils>
+#include <osgDB/Registry>
+#include <cstring>
+#include <sstream>
+
+#define LC "[TextureStore] "
+
+// State keys starting with this refer to the texture store.
+#define CONTENT_KEY_PREFIX '#'
+
+#define RECORD_PREFIX "tex_"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+TextureStore::TextureStore(TileStore* store) :
+_store( store )
+{
+    _stats.textures = 0u;
+    _stats.bytesStored = 0;
+    _stats.references = 0u;
+    _stats.bytesReferenced = 0;
+}
+
+bool
+TextureStore::isContentKey(const std::string& stateKey)
+{
+    return !stateKey.empty() && stateKey[0] == CONTENT_KEY_PREFIX;
+}
+
+void
+TextureStore::remember(const std::string& key, const std::string& uri, size_t size)
+{
+    _keysByURI[uri] = key;
+    _urisByKey[key] = uri;
+    if ( _sizes.find(key) == _sizes.end() )
+    {
+        _sizes[key] = size;
+        _stats.textures++;
+        _stats.bytesStored += size;
+    }
+}
+
+std::string
+TextureStore::put(const std::string& uri, const osgDB::Options* readOptions)
+{
+    if ( uri.empty() || !_store.valid() )
+        return "";
+
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<std::string, std::string>::const_iterator i = _keysByURI.find(uri);
+        if ( i != _keysByURI.end() )
+            return i->second;
+    }
+
+    ReadResult r = URI(uri).readString( readOptions );
+    if ( !r.succeeded() || r.getString().empty() )
+    {
+        OE_WARN << LC << "Failed to read " << uri << "\n";
+        return "";
+    }
+    const std::string& bytes = r.getString();
+
+    // hash plus size, so two files would have to agree on both to collide.
+    std::string key = Stringify()
+        << CONTENT_KEY_PREFIX << hashToString(bytes) << "_" << std::hex << bytes.size();
+
+    // Another thread or an earlier run may have stored the same content; the
+    // store replaces files atomically, so storing it again is harmless.
+    std::string recordKey = RECORD_PREFIX + key.substr(1);
+    osg::ref_ptr<TileBlob> existing = _store->read( recordKey );
+    if ( !existing.valid() )
+    {
+        // record: the source URI, a null, and the file as read.
+        std::string record;
+        record.reserve( uri.size() + 1 + bytes.size() );
+        record.append( uri );
+        record.push_back( '\0' );
+        record.append( bytes );
+
+        if ( !_store->write(recordKey, record.data(), record.size()) )
+            return "";
+    }
+
+    Threading::ScopedMutexLock lock(_mutex);
+    remember( key, uri, bytes.size() );
+    return key;
+}
+
+bool
+TextureStore::putTextures(const std::set<std::string>& uris, std::string& tile, std::set<std::string>& contentKeys)
+{
+    std::map<std::string, std::string> stateKeys;
+    for(std::set<std::string>::const_iterator uri = uris.begin(); uri != uris.end(); ++uri)
+    {
+        std::string key = put( *uri, 0L );
+        if ( !key.empty() )
+        {
+            stateKeys[*uri] = key;
+            contentKeys.insert( key );
+        }
+    }
+
+    if ( stateKeys.empty() )
+        return true;
+
+    std::string output;
+    if ( !TileFormat::replaceStateKeys(tile.data(), tile.size(), stateKeys, output) )
+        return false;
+
+    tile.swap( output );
+    return true;
+}
+
+osg::Image*
+TextureStore::get(const std::string& key, const osgDB::Options* readOptions, std::string& uri)
+{
+    if ( !isContentKey(key) || !_store.valid() )
+        return 0L;
+
+    osg::ref_ptr<TileBlob> blob = _store->read( RECORD_PREFIX + key.substr(1) );
+    if ( !blob.valid() )
+        return 0L;
+
+    const char* end = (const char*)::memchr( blob->data(), '\0', blob->size() );
+    if ( !end )
+    {
+        OE_WARN << LC << "Texture record " << key << " is corrupt\n";
+        return 0L;
+    }
+
+    uri.assign( blob->data(), end );
+    size_t offset = (end - blob->data()) + 1;
+
+    osgDB::ReaderWriter* rw = osgDB::Registry::instance()->getReaderWriterForExtension(
+        osgDB::getLowerCaseFileExtension(uri) );
+    if ( !rw )
+    {
+        OE_WARN << LC << "No image reader for " << uri << "\n";
+        return 0L;
+    }
+
+    std::istringstream in( std::string(blob->data() + offset, blob->size() - offset) );
+    osgDB::ReaderWriter::ReadResult r = rw->readImage( in, readOptions );
+    if ( !r.validImage() )
+    {
+        OE_WARN << LC << "Failed to decode texture " << key << " (" << uri << ")\n";
+        return 0L;
+    }
+
+    osg::Image* image = r.takeImage();
+    image->setFileName( uri );
+
+    Threading::ScopedMutexLock lock(_mutex);
+    remember( key, uri, blob->size() - offset );
+    return image;
+}
+
+bool
+TextureStore::getURI(const std::string& key, std::string& uri) const
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    std::map<std::string, std::string>::const_iterator i = _urisByKey.find(key);
+    if ( i == _urisByKey.end() )
+        return false;
+    uri = i->second;
+    return true;
+}
+
+void
+TextureStore::addReference(const std::string& key)
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    std::map<std::string, size_t>::const_iterator i = _sizes.find(key);
+    if ( i != _sizes.end() )
+    {
+        _stats.references++;
+        _stats.bytesReferenced += i->second;
+    }
+}
+
+TextureStore::Stats
+TextureStore::getStats() const
+{
+    Threading::ScopedMutexLock lock(_mutex);
+    return _stats;
+}
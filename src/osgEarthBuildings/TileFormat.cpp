@@ -0,0 +1,469 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TileFormat"
+#include <osg/PrimitiveSet>
+#include <cstring>
+
+#define LC "[TileFormat] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    const char     MAGIC[4]     = { 'O', 'E', 'B', 'T' };
+    const unsigned ENDIAN_CHECK = 0x01020304u;
+
+    enum GeometryFlags
+    {
+        HAS_TEXCOORDS = 1u << 0
+    };
+
+    // Appends raw bytes, padded to a 4-byte boundary.
+    void put(std::string& out, const void* data, size_t size)
+    {
+        if ( size > 0 )
+            out.append( static_cast<const char*>(data), size );
+        size_t pad = (4 - (size & 3)) & 3;
+        if ( pad > 0 )
+            out.append( pad, '\0' );
+    }
+
+    void putUInt(std::string& out, unsigned value)
+    {
+        put( out, &value, sizeof(value) );
+    }
+
+    void putString(std::string& out, const std::string& value)
+    {
+        putUInt( out, value.size() );
+        put( out, value.data(), value.size() );
+    }
+
+    // Bounds-checked reader over an encoded buffer; every read is
+    // 4-byte aligned because every write was padded.
+    struct Reader
+    {
+        const char* _ptr;
+        const char* _end;
+
+        Reader(const char* data, size_t size) : _ptr(data), _end(data+size) { }
+
+        size_t remaining() const { return (size_t)(_end - _ptr); }
+
+        const char* take(size_t size)
+        {
+            if ( size > remaining() )
+                return 0L;
+            size_t padded = (size + 3) & ~size_t(3);
+            if ( padded > remaining() )
+                return 0L;
+            const char* result = _ptr;
+            _ptr += padded;
+            return result;
+        }
+
+        bool getUInt(unsigned& value)
+        {
+            const char* p = take( sizeof(value) );
+            if ( !p ) return false;
+            ::memcpy( &value, p, sizeof(value) );
+            return true;
+        }
+
+        bool getString(std::string& value)
+        {
+            unsigned size;
+            if ( !getUInt(size) ) return false;
+            const char* p = take( size );
+            if ( !p ) return false;
+            value.assign( p, size );
+            return true;
+        }
+
+        // Reads "count" items of "perItem" T's each. The counts come from the
+        // file, so the size is checked for overflow before it's compared
+        // against what's left.
+        template<typename T>
+        bool getArray(const T*& value, size_t count, size_t perItem =1u)
+        {
+            value = 0L;
+            if ( perItem > 0u && count > remaining() / perItem / sizeof(T) )
+                return false;
+            const char* p = take( count*perItem*sizeof(T) );
+            value = reinterpret_cast<const T*>(p);
+            return p != 0L;
+        }
+    };
+
+    // True if every index refers to one of the geometry's vertices.
+    bool indicesInRange(const void* indices, unsigned indexSize, unsigned numIndices, unsigned numVerts)
+    {
+        for(unsigned i=0; i<numIndices; ++i)
+        {
+            unsigned index =
+                indexSize == 4u ? static_cast<const GLuint*  >(indices)[i] :
+                indexSize == 2u ? static_cast<const GLushort*>(indices)[i] :
+                                  static_cast<const GLubyte* >(indices)[i];
+            if ( index >= numVerts )
+                return false;
+        }
+        return true;
+    }
+
+    // Smallest encoding of a geometry and of an instance set, to reject
+    // record counts the buffer can't possibly hold before allocating.
+    const size_t MIN_GEOMETRY_SIZE  = 6u*sizeof(unsigned);
+    const size_t MIN_INSTANCES_SIZE = 2u*sizeof(unsigned);
+}
+
+//............................................................................
+
+namespace
+{
+    bool readHeader(Reader& in, unsigned& numGeometries, unsigned& numInstanceSets, osg::Matrixd& localToWorld, std::string& metadata)
+    {
+        const char* magic = in.take( sizeof(MAGIC) );
+        if ( !magic || ::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 )
+            return false;
+
+        unsigned version, endian, reserved;
+        if ( !in.getUInt(version) || version != TileFormat::VERSION ||
+             !in.getUInt(endian)  || endian  != ENDIAN_CHECK ||
+             !in.getUInt(numGeometries) ||
+             !in.getUInt(numInstanceSets) ||
+             !in.getUInt(reserved) )
+        {
+            return false;
+        }
+
+        const char* l2w = in.take( 16*sizeof(double) );
+        if ( !l2w )
+            return false;
+        double values[16];
+        ::memcpy( values, l2w, sizeof(values) );
+        localToWorld.set( values );
+
+        return in.getString( metadata );
+    }
+}
+
+//............................................................................
+
+TileFormat::Writer::Writer(const osg::Matrixd& localToWorld) :
+_localToWorld   ( localToWorld ),
+_numGeometries  ( 0u ),
+_numInstanceSets( 0u )
+{
+    //nop
+}
+
+bool
+TileFormat::Writer::addGeometry(const std::string&   tag,
+                                const std::string&   stateKey,
+                                const osg::Geometry* geom)
+{
+    if ( !geom || geom->getNumPrimitiveSets() != 1 )
+        return false;
+
+    const osg::Vec3Array* verts   = dynamic_cast<const osg::Vec3Array*>(geom->getVertexArray());
+    const osg::Vec3Array* normals = dynamic_cast<const osg::Vec3Array*>(geom->getNormalArray());
+    const osg::Vec4Array* colors  = dynamic_cast<const osg::Vec4Array*>(geom->getColorArray());
+    if ( !verts || !normals || !colors || verts->empty() )
+        return false;
+
+    const unsigned numVerts = verts->size();
+    if ( normals->size() != numVerts || colors->size() != numVerts )
+        return false;
+
+    const osg::Vec3Array* texCoords = 0L;
+    if ( geom->getTexCoordArray(0) )
+    {
+        texCoords = dynamic_cast<const osg::Vec3Array*>(geom->getTexCoordArray(0));
+        if ( !texCoords || texCoords->size() != numVerts )
+            return false;
+    }
+
+    const osg::DrawElements* de = dynamic_cast<const osg::DrawElements*>(geom->getPrimitiveSet(0));
+    if ( !de || de->getMode() != GL_TRIANGLES || de->getNumInstances() > 0 || de->getNumIndices() % 3u != 0u )
+        return false;
+
+    unsigned indexSize =
+        dynamic_cast<const osg::DrawElementsUByte*> (de) ? 1u :
+        dynamic_cast<const osg::DrawElementsUShort*>(de) ? 2u :
+        dynamic_cast<const osg::DrawElementsUInt*>  (de) ? 4u : 0u;
+    if ( indexSize == 0u )
+        return false;
+
+    Geometry record;
+    record.tag        = tag;
+    record.stateKey   = stateKey;
+    record.numVerts   = numVerts;
+    record.verts      = static_cast<const float*>(verts->getDataPointer());
+    record.normals    = static_cast<const float*>(normals->getDataPointer());
+    record.colors     = static_cast<const float*>(colors->getDataPointer());
+    record.texCoords  = texCoords ? static_cast<const float*>(texCoords->getDataPointer()) : 0L;
+    record.indexSize  = indexSize;
+    record.numIndices = de->getNumIndices();
+    record.indices    = de->getDataPointer();
+    addGeometry( record );
+    return true;
+}
+
+void
+TileFormat::Writer::addGeometry(const Geometry& record)
+{
+    unsigned flags = 0u;
+    if ( record.texCoords ) flags |= HAS_TEXCOORDS;
+
+    const size_t n = record.numVerts;
+
+    std::string& out = _geometries;
+    putString( out, record.tag );
+    putString( out, record.stateKey );
+    putUInt  ( out, record.numVerts );
+    putUInt  ( out, flags );
+    putUInt  ( out, record.indexSize );
+    putUInt  ( out, record.numIndices );
+
+    put( out, record.verts,   n*3*sizeof(float) );
+    put( out, record.normals, n*3*sizeof(float) );
+    put( out, record.colors,  n*4*sizeof(float) );
+    if ( record.texCoords )
+        put( out, record.texCoords, n*3*sizeof(float) );
+    put( out, record.indices, (size_t)record.numIndices*record.indexSize );
+
+    ++_numGeometries;
+}
+
+void
+TileFormat::Writer::addInstances(const std::string&              modelName,
+                                 const std::vector<osg::Matrix>& matrices)
+{
+    // matrices are stored single-precision; they are local to the tile.
+    std::vector<float> values;
+    values.reserve( matrices.size()*16 );
+    for(std::vector<osg::Matrix>::const_iterator m = matrices.begin(); m != matrices.end(); ++m)
+    {
+        const osg::Matrix::value_type* ptr = m->ptr();
+        for(unsigned i=0; i<16; ++i)
+            values.push_back( (float)ptr[i] );
+    }
+
+    Instances record;
+    record.modelName = modelName;
+    record.count     = matrices.size();
+    record.matrices  = values.empty() ? 0L : &values.front();
+    addInstances( record );
+}
+
+void
+TileFormat::Writer::addInstances(const Instances& record)
+{
+    std::string& out = _instances;
+    putString( out, record.modelName );
+    putUInt  ( out, record.count );
+    if ( record.count > 0u )
+        put( out, record.matrices, (size_t)record.count*16*sizeof(float) );
+
+    ++_numInstanceSets;
+}
+
+std::string
+TileFormat::Writer::finish() const
+{
+    std::string out;
+    out.reserve( 160 + _metadata.size() + _geometries.size() + _instances.size() );
+
+    put    ( out, MAGIC, sizeof(MAGIC) );
+    putUInt( out, VERSION );
+    putUInt( out, ENDIAN_CHECK );
+    putUInt( out, _numGeometries );
+    putUInt( out, _numInstanceSets );
+    putUInt( out, 0u ); // reserved; keeps the matrix 8-byte aligned
+    put    ( out, _localToWorld.ptr(), 16*sizeof(double) );
+    putString( out, _metadata );
+
+    out.append( _geometries );
+    out.append( _instances );
+    return out;
+}
+
+//............................................................................
+
+bool
+TileFormat::decode(const char* data, size_t size, Tile& output)
+{
+    Reader in( data, size );
+
+    unsigned numGeometries, numInstanceSets;
+    if ( !readHeader(in, numGeometries, numInstanceSets, output.localToWorld, output.metadata) )
+        return false;
+
+    if ( numGeometries > in.remaining() / MIN_GEOMETRY_SIZE )
+        return false;
+
+    output.geometries.resize( numGeometries );
+    for(unsigned g=0; g<numGeometries; ++g)
+    {
+        Geometry& record = output.geometries[g];
+        unsigned flags;
+        if ( !in.getString(record.tag) ||
+             !in.getString(record.stateKey) ||
+             !in.getUInt(record.numVerts) ||
+             !in.getUInt(flags) ||
+             !in.getUInt(record.indexSize) ||
+             !in.getUInt(record.numIndices) )
+        {
+            return false;
+        }
+
+        if ( record.numVerts == 0u ||
+             record.numIndices % 3u != 0u ||
+             (record.indexSize != 1u && record.indexSize != 2u && record.indexSize != 4u) )
+        {
+            return false;
+        }
+
+        record.texCoords = 0L;
+
+        if ( !in.getArray(record.verts,   record.numVerts, 3u) ||
+             !in.getArray(record.normals, record.numVerts, 3u) ||
+             !in.getArray(record.colors,  record.numVerts, 4u) )
+        {
+            return false;
+        }
+        if ( (flags & HAS_TEXCOORDS) && !in.getArray(record.texCoords, record.numVerts, 3u) )
+            return false;
+
+        // a bad index would make the GPU read past the vertex arrays.
+        const char* indices;
+        if ( !in.getArray(indices, record.numIndices, record.indexSize) ||
+             !indicesInRange(indices, record.indexSize, record.numIndices, record.numVerts) )
+        {
+            return false;
+        }
+        record.indices = indices;
+    }
+
+    if ( numInstanceSets > in.remaining() / MIN_INSTANCES_SIZE )
+        return false;
+
+    output.instances.resize( numInstanceSets );
+    for(unsigned i=0; i<numInstanceSets; ++i)
+    {
+        Instances& record = output.instances[i];
+        if ( !in.getString(record.modelName) ||
+             !in.getUInt(record.count) ||
+             !in.getArray(record.matrices, record.count, 16u) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+TileFormat::readMetadata(const char* data, size_t size, std::string& metadata)
+{
+    Reader in( data, size );
+    unsigned numGeometries, numInstanceSets;
+    osg::Matrixd localToWorld;
+    return readHeader( in, numGeometries, numInstanceSets, localToWorld, metadata );
+}
+
+bool
+TileFormat::replaceStateKeys(const char*                               data,
+                             size_t                                    size,
+                             const std::map<std::string, std::string>& stateKeys,
+                             std::string&                              output)
+{
+    Tile tile;
+    if ( !decode(data, size, tile) )
+        return false;
+
+    Writer writer( tile.localToWorld );
+    writer.setMetadata( tile.metadata );
+
+    for(std::vector<Geometry>::const_iterator g = tile.geometries.begin(); g != tile.geometries.end(); ++g)
+    {
+        std::map<std::string, std::string>::const_iterator k = stateKeys.find( g->stateKey );
+        if ( k != stateKeys.end() )
+        {
+            Geometry record = *g;
+            record.stateKey = k->second;
+            writer.addGeometry( record );
+        }
+        else
+        {
+            writer.addGeometry( *g );
+        }
+    }
+
+    for(std::vector<Instances>::const_iterator i = tile.instances.begin(); i != tile.instances.end(); ++i)
+    {
+        writer.addInstances( *i );
+    }
+
+    output = writer.finish();
+    return true;
+}
+
+osg::Geometry*
+TileFormat::createGeometry(const Geometry& record)
+{
+    const size_t n = record.numVerts;
+
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( true );
+    geom->setUseDisplayList( false );
+
+    // each array is sized once and filled with a single copy.
+    osg::Vec3Array* verts = new osg::Vec3Array( n );
+    ::memcpy( (void*)&verts->front(), record.verts, n*3*sizeof(float) );
+    geom->setVertexArray( verts );
+
+    osg::Vec3Array* normals = new osg::Vec3Array( n );
+    ::memcpy( (void*)&normals->front(), record.normals, n*3*sizeof(float) );
+    geom->setNormalArray( normals );
+    geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+    osg::Vec4Array* colors = new osg::Vec4Array( n );
+    ::memcpy( (void*)&colors->front(), record.colors, n*4*sizeof(float) );
+    geom->setColorArray( colors );
+    geom->setColorBinding( geom->BIND_PER_VERTEX );
+
+    if ( record.texCoords )
+    {
+        osg::Vec3Array* texCoords = new osg::Vec3Array( n );
+        ::memcpy( (void*)&texCoords->front(), record.texCoords, n*3*sizeof(float) );
+        geom->setTexCoordArray( 0, texCoords );
+    }
+
+    osg::DrawElements* de =
+        record.indexSize == 4u ? (osg::DrawElements*) new osg::DrawElementsUInt  ( GL_TRIANGLES, record.numIndices ) :
+        record.indexSize == 2u ? (osg::DrawElements*) new osg::DrawElementsUShort( GL_TRIANGLES, record.numIndices ) :
+                                 (osg::DrawElements*) new osg::DrawElementsUByte ( GL_TRIANGLES, record.numIndices );
+    if ( record.numIndices > 0 )
+        ::memcpy( const_cast<GLvoid*>(de->getDataPointer()), record.indices, (size_t)record.numIndices*record.indexSize );
+    geom->addPrimitiveSet( de );
+
+    return geom;
+}
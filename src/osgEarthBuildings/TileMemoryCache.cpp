@@ -0,0 +1,135 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TileMemoryCache"
+#include <osgEarth/Notify>
+#include <osgDB/Registry>
+#include <osgDB/ObjectWrapper>
+#include <sstream>
+
+#define LC "[TileMemoryCache] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    // OSG's zlib compressor; NULL if OSG was built without zlib.
+    osgDB::BaseCompressor* getCompressor()
+    {
+        return osgDB::Registry::instance()->getObjectWrapperManager()->findCompressor("zlib");
+    }
+}
+
+TileMemoryCache::TileMemoryCache(size_t maxBytes, bool compress) :
+_maxBytes( maxBytes ),
+_compress( compress )
+{
+    if ( _compress && !getCompressor() )
+    {
+        OE_WARN << LC << "No zlib compressor available; tiles will be kept uncompressed\n";
+        _compress = false;
+    }
+}
+
+void
+TileMemoryCache::insert(const std::string& key, const std::string& data)
+{
+    // compress outside the lock.
+    std::string stored;
+    if ( _compress )
+    {
+        std::ostringstream out;
+        if ( !getCompressor()->compress(out, data) )
+            return;
+        stored = out.str();
+    }
+    else
+    {
+        stored = data;
+    }
+
+    // a tile bigger than the whole budget isn't worth evicting everything for.
+    if ( stored.size() > _maxBytes )
+        return;
+
+    Threading::ScopedMutexLock lock( _mutex );
+
+    std::map<std::string, LRU::iterator>::iterator i = _index.find( key );
+    if ( i != _index.end() )
+    {
+        _stats.bytes -= i->second->second.size();
+        _lru.erase( i->second );
+        _index.erase( i );
+    }
+
+    _lru.push_front( Entry(key, std::string()) );
+    _lru.front().second.swap( stored );
+    _index[key] = _lru.begin();
+    _stats.bytes += _lru.front().second.size();
+
+    while ( _stats.bytes > _maxBytes && _lru.size() > 1 )
+    {
+        const Entry& oldest = _lru.back();
+        _stats.bytes -= oldest.second.size();
+        _index.erase( oldest.first );
+        _lru.pop_back();
+        ++_stats.evictions;
+    }
+
+    _stats.entries = _lru.size();
+}
+
+bool
+TileMemoryCache::get(const std::string& key, std::string& data)
+{
+    std::string stored;
+    {
+        Threading::ScopedMutexLock lock( _mutex );
+
+        std::map<std::string, LRU::iterator>::iterator i = _index.find( key );
+        if ( i == _index.end() )
+        {
+            ++_stats.misses;
+            return false;
+        }
+
+        // most recently used goes to the front.
+        _lru.splice( _lru.begin(), _lru, i->second );
+        ++_stats.hits;
+
+        if ( !_compress )
+        {
+            data = _lru.front().second;
+            return true;
+        }
+
+        stored = _lru.front().second;
+    }
+
+    std::istringstream in( stored );
+    data.clear();
+    return getCompressor()->decompress( in, data );
+}
+
+TileMemoryCache::Stats
+TileMemoryCache::getStats() const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    return _stats;
+}
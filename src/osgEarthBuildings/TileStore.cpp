@@ -0,0 +1,183 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TileStore"
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <OpenThreads/Atomic>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#  include <process.h>
+#  define GETPID _getpid
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define GETPID getpid
+#endif
+
+#define LC "[TileStore] "
+
+#define TILE_EXTENSION "oebt"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+#ifndef _WIN32
+    /** TileBlob backed by a read-only memory mapping of a whole file. */
+    class MappedTileBlob : public TileBlob
+    {
+    public:
+        static MappedTileBlob* open(const std::string& fileName)
+        {
+            int fd = ::open(fileName.c_str(), O_RDONLY);
+            if (fd < 0)
+                return 0L;
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+            {
+                ::close(fd);
+                return 0L;
+            }
+
+            void* ptr = ::mmap(0L, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            // the mapping stays valid after the descriptor is closed.
+            ::close(fd);
+
+            if (ptr == MAP_FAILED)
+                return 0L;
+
+            return new MappedTileBlob(ptr, (size_t)st.st_size, (TimeStamp)st.st_mtime);
+        }
+
+    protected:
+        MappedTileBlob(void* ptr, size_t size, TimeStamp lastModified) : _ptr(ptr)
+        {
+            _data = (const char*)ptr;
+            _size = size;
+            _lastModified = lastModified;
+        }
+
+        virtual ~MappedTileBlob()
+        {
+            ::munmap(_ptr, _size);
+        }
+
+        void* _ptr;
+    };
+#endif
+}
+
+BufferTileBlob::BufferTileBlob(const std::string& buffer, TimeStamp lastModified) :
+_buffer( buffer )
+{
+    _data = _buffer.data();
+    _size = _buffer.size();
+    _lastModified = lastModified;
+}
+
+//...................................................................
+
+FileTileStore::FileTileStore(const std::string& rootPath) :
+_rootPath( rootPath )
+{
+    osgDB::makeDirectory( _rootPath );
+}
+
+std::string
+FileTileStore::getFileName(const std::string& key) const
+{
+    return osgDB::concatPaths( _rootPath, key + "." TILE_EXTENSION );
+}
+
+TileBlob*
+FileTileStore::read(const std::string& key)
+{
+    std::string fileName = getFileName( key );
+
+#ifdef _WIN32
+    // no mapping on Windows (yet); read the whole file.
+    std::ifstream in( fileName.c_str(), std::ios::binary );
+    if ( !in.is_open() )
+        return 0L;
+
+    std::string buffer( (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>() );
+    if ( buffer.empty() )
+        return 0L;
+
+    struct stat st;
+    TimeStamp lastModified = ::stat(fileName.c_str(), &st) == 0 ? (TimeStamp)st.st_mtime : 0;
+    return new BufferTileBlob( buffer, lastModified );
+#else
+    return MappedTileBlob::open( fileName );
+#endif
+}
+
+bool
+FileTileStore::write(const std::string& key, const char* data, size_t size)
+{
+    std::string fileName = getFileName( key );
+
+    // unique per process and per write so concurrent writers don't collide:
+    static OpenThreads::Atomic s_sequence;
+    std::string tempName = Stringify()
+        << fileName << "." << GETPID() << "." << (++s_sequence) << ".tmp";
+
+    {
+        std::ofstream out( tempName.c_str(), std::ios::binary | std::ios::trunc );
+        if ( !out.is_open() )
+        {
+            OE_WARN << LC << "Failed to open " << tempName << " for writing\n";
+            return false;
+        }
+
+        out.write( data, size );
+        if ( out.fail() )
+        {
+            out.close();
+            ::remove( tempName.c_str() );
+            OE_WARN << LC << "Failed to write " << tempName << "\n";
+            return false;
+        }
+    }
+
+#ifdef _WIN32
+    // rename() won't replace an existing file on Windows.
+    ::remove( fileName.c_str() );
+#endif
+
+    if ( ::rename(tempName.c_str(), fileName.c_str()) != 0 )
+    {
+        ::remove( tempName.c_str() );
+        OE_WARN << LC << "Failed to rename " << tempName << " to " << fileName << "\n";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,127 @@
+
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "WorkerPool"
+#include <OpenThreads/ScopedLock>
+
+#define LC "[WorkerPool] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+WorkerPool::WorkerPool(unsigned numThreads) :
+_done( false )
+{
+    for (unsigned i = 0; i < numThreads; ++i)
+    {
+        _threads.push_back( new WorkerThread(this) );
+        _threads.back()->startThread();
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        ScopedLock lock( _mutex );
+        _done = true;
+        _queued.broadcast();
+    }
+    for (unsigned i = 0; i < _threads.size(); ++i)
+    {
+        _threads[i]->join();
+        delete _threads[i];
+    }
+}
+
+WorkerPool::Task*
+WorkerPool::take(Batch* batch)
+{
+    Task* task = (*batch->tasks)[batch->next++].get();
+    if ( batch->next >= batch->tasks->size() )
+        _batches.remove( batch );
+    return task;
+}
+
+void
+WorkerPool::finished(Batch* batch)
+{
+    if ( --batch->remaining == 0u )
+        _finished.broadcast();
+}
+
+void
+WorkerPool::run(Tasks& tasks)
+{
+    if ( tasks.empty() )
+        return;
+
+    Batch batch;
+    batch.tasks     = &tasks;
+    batch.next      = 0u;
+    batch.remaining = tasks.size();
+
+    ScopedLock lock( _mutex );
+
+    if ( !_threads.empty() && tasks.size() > 1u )
+    {
+        _batches.push_back( &batch );
+        _queued.broadcast();
+    }
+
+    // work on our own tasks until they're all handed out...
+    while ( batch.next < tasks.size() )
+    {
+        Task* task = take( &batch );
+        _mutex.unlock();
+        task->run();
+        _mutex.lock();
+        finished( &batch );
+    }
+
+    // ...then wait for the ones the workers took.
+    while ( batch.remaining > 0u )
+    {
+        _finished.wait( &_mutex );
+    }
+}
+
+void
+WorkerPool::work()
+{
+    ScopedLock lock( _mutex );
+    for (;;)
+    {
+        while ( _batches.empty() && !_done )
+        {
+            _queued.wait( &_mutex );
+        }
+
+        if ( _done )
+            break;
+
+        // oldest batch first, so tiles finish in the order they came in.
+        Batch* batch = _batches.front();
+        Task* task = take( batch );
+        _mutex.unlock();
+        task->run();
+        _mutex.lock();
+        finished( batch );
+    }
+}